@@ -0,0 +1,58 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bundle.c
+ *
+ *    Description: Offline tool that packs tilemaps, fonts, and character associations
+ *                 into a bundle for CRLoadBundle.
+ *
+ *        Version:  1.0
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+#include "crga.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void Usage(const char *name) {
+    printf("usage: %s OUT.crb ASSET...\n", name);
+    printf("  tilemap PATH TILE_WIDTH TILE_HEIGHT\n");
+    printf("  font PATH SIZE\n");
+    printf("  sdf PATH SIZE\n");
+    printf("  assoc CHARACTER INDEX\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        Usage(argv[0]);
+        return 1;
+    }
+    SetTraceLogLevel(LOG_WARNING);
+    CRBundle bundle = CRNewBundle();
+    int i = 2;
+    while (i < argc) {
+        const char *kind = argv[i];
+        if (strcmp(kind, "tilemap") == 0 && i + 3 < argc) {
+            CRBundleTilemap(&bundle, argv[i + 1], atoi(argv[i + 2]), atoi(argv[i + 3]));
+            i += 4;
+        } else if (strcmp(kind, "font") == 0 && i + 2 < argc) {
+            CRBundleFont(&bundle, argv[i + 1], atoi(argv[i + 2]), 0);
+            i += 3;
+        } else if (strcmp(kind, "sdf") == 0 && i + 2 < argc) {
+            CRBundleFont(&bundle, argv[i + 1], atoi(argv[i + 2]), 1);
+            i += 3;
+        } else if (strcmp(kind, "assoc") == 0 && i + 2 < argc) {
+            CRBundleCharAssoc(&bundle, argv[i + 1], atoi(argv[i + 2]));
+            i += 3;
+        } else {
+            Usage(argv[0]);
+            CRFreeBundle(&bundle);
+            return 1;
+        }
+    }
+    int saved = CRSaveBundle(&bundle, argv[1]);
+    CRFreeBundle(&bundle);
+    return saved ? 0 : 1;
+}
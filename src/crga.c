@@ -15,24 +15,57 @@
  *
  * =====================================================================================
  */
+#if __linux__
+// pseudo-terminals for the terminal server
+#define _GNU_SOURCE
+#endif
 #include "crga.h"
 #include "crgahelper.h"
 #include "termdraw.h"
+#include <rlgl.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#if !_WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#if SERVER
+#include <sys/epoll.h>
+#include <termios.h>
+#endif
 
+#if THREADS
+// each thread works on whichever context it last set, so contexts can be drawn on different cores
+__thread CRConfig *cr_config;
+#else
 CRConfig *cr_config;
-void (*CRWorldDraw)();
-void (*CRUIDraw)();
-void (*CRPreDraw)();
-void (*CRPostDraw)();
+#endif
+void *CRDefaultAllocate(void *user, size_t size) {
+    return malloc(size);
+}
+void *CRDefaultReallocate(void *user, void *pointer, size_t size) {
+    return realloc(pointer, size);
+}
+void CRDefaultDeallocate(void *user, void *pointer) {
+    free(pointer);
+}
+// copied into every config made after CRSetAllocator
+CRAllocator cr_allocator = {0, CRDefaultAllocate, CRDefaultReallocate, CRDefaultDeallocate};
 
 #if TERMINAL
 int TerminalShouldClose();
-int camera_shift = 0;
-int terminal_should_close = 0;
 #if UNIX
 #include <ncurses.h>
+#include <poll.h>
 #elif _WIN32
 //#include <curses.h>
 #endif
@@ -41,7 +74,7 @@ int terminal_should_close = 0;
 
 // Init
 void CRInit() {
-    CRConfig *config = (CRConfig *) malloc(sizeof(CRConfig));
+    CRConfig *config = (CRConfig *) cr_allocator.allocate(cr_allocator.user, sizeof(CRConfig));
     CRInitConfig(config);
     CRSetConfig(config);
     CRInitCharIndexAssoc();
@@ -59,18 +92,21 @@ void CRInitConfig(CRConfig *config) {
     config->title = "CRGA Basic Window";
 
     config->tile_size = 20.0f;
+    config->font_size = 24.0f;
 
     config->default_layer_width = config->window_width / config->tile_size;
     config->default_layer_height = config->window_height / config->tile_size;
 
     config->default_foreground = WHITE;
     config->default_background = BLACK;
-    config->default_visibility = 0;
+    config->default_visibility = 255;
 
     config->world_layers = 0;
     config->world_layer_count = 0;
+    config->world_layer_capacity = 0;
     config->ui_layers = 0;
     config->ui_layer_count = 0;
+    config->ui_layer_capacity = 0;
 
     config->main_camera.target = (Vector2){0.0f, 0.0f};
     config->main_camera.offset = (Vector2){0.0f, 0.0f};
@@ -80,13 +116,114 @@ void CRInitConfig(CRConfig *config) {
     config->background_color = BLACK;
 
     config->assocs = 0;
+    config->bundle_assoc_starts = 0;
+    config->bundle_assocs = 0;
+    config->bundle_mapping = 0;
+    config->bundle_mapping_size = 0;
     config->assoc_count = 0;
+    config->assoc_capacity = 0;
 
     config->fonts = 0;
     config->font_count = 0;
+    config->font_capacity = 0;
+    config->sdf_shader = (Shader) {0};
 
     config->tilemaps = 0;
     config->tilemap_count = 0;
+    config->tilemap_capacity = 0;
+
+    config->glyph_atlases = 0;
+    config->glyph_atlas_count = 0;
+    config->glyph_atlas_capacity = 0;
+
+    config->masks = 0;
+    config->mask_count = 0;
+    config->mask_capacity = 0;
+
+    config->fovs = 0;
+    config->fov_count = 0;
+    config->fov_capacity = 0;
+
+    config->occlusion = 0;
+    config->occlusion_width = 0;
+    config->occlusion_height = 0;
+    config->occlusion_top = 0;
+    config->occlusion_bottom = INT_MAX;
+
+    config->palettes = 0;
+    config->palette_count = 0;
+    config->palette_capacity = 0;
+    config->palette_texture = (Texture2D) {0};
+    config->palette_shader = (Shader) {0};
+    config->palette_override = -1;
+    config->palette_tint = WHITE;
+
+    config->layer_shader = (Shader) {0};
+
+    config->text_layouts = 0;
+    config->text_layout_count = 0;
+    config->text_layout_capacity = 0;
+    config->text_layout_slots = 0;
+    config->text_layout_slot_count = 0;
+    config->text_cache_bytes = 0;
+    config->text_cache_budget = 1 << 20;
+
+    config->frame = 0;
+
+    config->allocator = cr_allocator;
+    config->frame_arena = (CRArena) {0};
+    config->dump_memory = 0;
+
+    config->render_on_demand = 0;
+    config->redraw = 1;
+    config->animations = 0;
+    config->drawn_camera = (Camera2D) {0};
+    config->idle_timeout = 1.0f / config->fps;
+
+    config->update_step = 1.0 / 60.0;
+    config->max_update_steps = 5;
+    config->update_accumulator = 0;
+    config->last_update_time = -1;
+    config->update_alpha = 1.0f;
+    config->interpolating = 0;
+
+    config->tweens = (CRTweens) {0};
+
+    config->tile_animations = 0;
+    config->tile_animation_count = 0;
+    config->tile_animation_capacity = 0;
+    config->tile_animation_texture = (Texture2D) {0};
+    config->tile_animation_table_stale = 0;
+
+    config->particle_time = -1;
+
+    config->commands = (CRCommandQueue) {0};
+
+    config->world_draw = 0;
+    config->ui_draw = 0;
+    config->pre_draw = 0;
+    config->post_draw = 0;
+    config->update = 0;
+    config->render = 0;
+
+    config->terminal_camera = 0;
+    config->should_close = 0;
+
+    config->owns_assets = 1;
+    config->headless = 0;
+    config->cells = 0;
+    config->cell_width = 0;
+    config->cell_height = 0;
+
+    config->recorder = 0;
+    config->stream = 0;
+
+    config->input.head = 0;
+    config->input.count = 0;
+    memset(config->input.presses, 0, sizeof(config->input.presses));
+    config->input.pressed_count = 0;
+    config->input.partial_size = 0;
+    config->input.partial_age = 0;
 }
 inline void CRSetConfig(CRConfig *config) {
     cr_config = config;
@@ -116,55 +253,580 @@ inline void CRInitWindow() {
 #endif
 }
 
+// Memory
+// All of CRGA's memory goes through the config's allocator. The allocator set with CRSetAllocator
+// is also used for the config itself, so it has to be set before CRInit. Swapping it under a live
+// config would hand that config's blocks to an allocator that never made them.
+void CRSetAllocator(CRAllocator allocator) {
+    if (cr_config != 0)
+        return; // TODO allocator set after init error
+    cr_allocator = allocator;
+}
+CRAllocator *CRCurrentAllocator() {
+    return cr_config != 0 ? &cr_config->allocator : &cr_allocator;
+}
+// Every allocation carries its size and category in front of it, so frees can be accounted for
+typedef struct {
+    size_t size;
+    size_t category;
+} CRAllocHeader;
+void *CRAlloc(size_t size, uint8_t category) {
+    CRAllocator *allocator = CRCurrentAllocator();
+    CRAllocHeader *header = allocator->allocate(allocator->user, sizeof(CRAllocHeader) + size);
+    if (header == 0)
+        return 0;
+    header->size = size;
+    header->category = category;
+    CRTrackMemory(category, size);
+    return header + 1;
+}
+void *CRCalloc(size_t count, size_t size, uint8_t category) {
+    void *pointer = CRAlloc(count * size, category);
+    if (pointer != 0)
+        memset(pointer, 0, count * size);
+    return pointer;
+}
+void *CRRealloc(void *pointer, size_t size, uint8_t category) {
+    if (pointer == 0)
+        return CRAlloc(size, category);
+    CRAllocator *allocator = CRCurrentAllocator();
+    CRAllocHeader *header = (CRAllocHeader *) pointer - 1;
+    size_t old_size = header->size;
+    uint8_t old_category = header->category;
+    header = allocator->reallocate(allocator->user, header, sizeof(CRAllocHeader) + size);
+    if (header == 0)
+        return 0;
+    CRUntrackMemory(old_category, old_size);
+    CRTrackMemory(category, size);
+    header->size = size;
+    header->category = category;
+    return header + 1;
+}
+void CRFree(void *pointer) {
+    if (pointer == 0)
+        return;
+    CRAllocator *allocator = CRCurrentAllocator();
+    CRAllocHeader *header = (CRAllocHeader *) pointer - 1;
+    CRUntrackMemory(header->category, header->size);
+    allocator->deallocate(allocator->user, header);
+}
+// Make room for the element at count, doubling the capacity when it's full
+void *CRGrow(void *array, size_t *capacity, size_t count, size_t size, uint8_t category) {
+    if (count < *capacity)
+        return array;
+    size_t new_capacity = *capacity < 4 ? 4 : *capacity * 2;
+    array = CRRealloc(array, new_capacity * size, category);
+    *capacity = new_capacity;
+    return array;
+}
+// Allocations that don't fit in the arena are chained off it with this header in front
+typedef struct CRArenaOverflow {
+    struct CRArenaOverflow *next;
+    size_t size;
+} CRArenaOverflow;
+void *CRArenaAlloc(CRArena *arena, size_t size) {
+    // keep everything aligned for any type
+    size = (size + 15) & ~(size_t) 15;
+    arena->used += size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    if (arena->used <= arena->capacity)
+        return arena->data + arena->used - size;
+    CRArenaOverflow *overflow = CRAlloc(sizeof(CRArenaOverflow) + size, MEMORYARENA);
+    overflow->next = arena->overflow;
+    overflow->size = size;
+    arena->overflow = overflow;
+    return overflow + 1;
+}
+// Throw away everything allocated since the last reset. If the arena overflowed, it grows to fit
+// the most it has held, so a steady frame never touches the heap.
+void CRArenaReset(CRArena *arena) {
+    while (arena->overflow != 0) {
+        CRArenaOverflow *next = arena->overflow->next;
+        CRFree(arena->overflow);
+        arena->overflow = next;
+    }
+    if (arena->peak > arena->capacity) {
+        CRFree(arena->data);
+        arena->capacity = arena->peak + arena->peak / 2;
+        arena->data = CRAlloc(arena->capacity, MEMORYARENA);
+    }
+    arena->used = 0;
+}
+void CRArenaFree(CRArena *arena) {
+    CRArenaReset(arena);
+    CRFree(arena->data);
+    *arena = (CRArena) {0};
+}
+// Memory that lasts until the start of the next frame
+void *CRFrameAlloc(size_t size) {
+    return CRArenaAlloc(&cr_config->frame_arena, size);
+}
+
+// Memory Accounting
+// Kept for the whole process rather than per config, since budgets are per process.
+CRMemoryStats cr_memory;
+const char *cr_memory_names[MEMORYCATEGORIES] = {
+    "layers", "masks", "assocs", "fonts", "tilemaps", "text", "fov", "palettes", "arena", "animation", "other"
+};
+void CRAddBytes(size_t *current, size_t *peak, size_t bytes) {
+#if THREADS
+    // FOV workers allocate too
+    size_t now = __atomic_add_fetch(current, bytes, __ATOMIC_RELAXED);
+    size_t high = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (now > high && !__atomic_compare_exchange_n(peak, &high, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else
+    *current += bytes;
+    if (*current > *peak)
+        *peak = *current;
+#endif
+}
+void CRSubtractBytes(size_t *current, size_t bytes) {
+#if THREADS
+    __atomic_sub_fetch(current, bytes, __ATOMIC_RELAXED);
+#else
+    *current -= bytes;
+#endif
+}
+void CRTrackMemory(uint8_t category, size_t bytes) {
+    CRAddBytes(&cr_memory.cpu[category], &cr_memory.cpu_peak[category], bytes);
+    CRAddBytes(&cr_memory.cpu_total, &cr_memory.cpu_total_peak, bytes);
+}
+void CRUntrackMemory(uint8_t category, size_t bytes) {
+    CRSubtractBytes(&cr_memory.cpu[category], bytes);
+    CRSubtractBytes(&cr_memory.cpu_total, bytes);
+}
+// Estimated, the driver may pad or keep copies
+size_t CRTextureBytes(Texture2D texture) {
+    if (texture.id == 0)
+        return 0;
+    size_t bytes = GetPixelDataSize(texture.width, texture.height, texture.format);
+    // a full mipmap chain adds about a third
+    if (texture.mipmaps > 1)
+        bytes += bytes / 3;
+    return bytes;
+}
+void CRTrackTexture(uint8_t category, Texture2D texture) {
+    size_t bytes = CRTextureBytes(texture);
+    CRAddBytes(&cr_memory.gpu[category], &cr_memory.gpu_peak[category], bytes);
+    CRAddBytes(&cr_memory.gpu_total, &cr_memory.gpu_total_peak, bytes);
+}
+void CRUntrackTexture(uint8_t category, Texture2D texture) {
+    size_t bytes = CRTextureBytes(texture);
+    CRSubtractBytes(&cr_memory.gpu[category], bytes);
+    CRSubtractBytes(&cr_memory.gpu_total, bytes);
+}
+// Glyph data raylib allocated for the font
+size_t CRFontDataBytes(Font *font) {
+    size_t bytes = (sizeof(GlyphInfo) + sizeof(Rectangle)) * font->glyphCount;
+    for (int i = 0; i < font->glyphCount; i++) {
+        if (font->glyphs[i].image.data != 0)
+            bytes += GetPixelDataSize(font->glyphs[i].image.width, font->glyphs[i].image.height, font->glyphs[i].image.format);
+    }
+    return bytes;
+}
+void CRTrackFont(Font *font) {
+    CRTrackMemory(MEMORYFONTS, CRFontDataBytes(font));
+    CRTrackTexture(MEMORYFONTS, font->texture);
+}
+void CRUntrackFont(Font *font) {
+    CRUntrackMemory(MEMORYFONTS, CRFontDataBytes(font));
+    CRUntrackTexture(MEMORYFONTS, font->texture);
+}
+CRMemoryStats CRGetMemoryStats() {
+    return cr_memory;
+}
+CRMemoryUsage CRLayerMemory(CRLayer *layer) {
+    CRMemoryUsage usage = {0, 0};
+    usage.cpu += sizeof(CRTile) * layer->width * layer->height;
+    usage.cpu += sizeof(uint64_t) * layer->occupancy_words * layer->height;
+    if (layer->mask_blocks != 0)
+        usage.cpu += ((layer->width + MASKBLOCK - 1) / MASKBLOCK) * ((layer->height + MASKBLOCK - 1) / MASKBLOCK);
+    if (layer->data != 0) {
+        usage.cpu += sizeof(Color) * layer->width * layer->height * 3;
+        usage.gpu += CRTextureBytes(layer->data_texture);
+    }
+    return usage;
+}
+CRMemoryUsage CRMaskMemory(size_t index) {
+    CRMask *mask = &cr_config->masks[index];
+    CRMemoryUsage usage = {0, 0};
+    usage.cpu = mask->width * mask->height + 2 * mask->block_width * mask->block_height;
+    return usage;
+}
+CRMemoryUsage CRFontMemory(size_t index) {
+    CRMemoryUsage usage = {0, 0};
+    usage.cpu = CRFontDataBytes(&cr_config->fonts[index]);
+    usage.gpu = CRTextureBytes(cr_config->fonts[index].texture);
+    return usage;
+}
+CRMemoryUsage CRTilemapMemory(size_t index) {
+    CRMemoryUsage usage = {0, 0};
+    usage.gpu = CRTextureBytes(cr_config->tilemaps[index].texture);
+    return usage;
+}
+void CRDumpMemory() {
+    fprintf(stderr, "CRGA memory        cpu      cpu peak          gpu      gpu peak\n");
+    for (int i = 0; i < MEMORYCATEGORIES; i++) {
+        fprintf(stderr, "%-10s %12zu  %12zu  %12zu  %12zu\n", cr_memory_names[i],
+                cr_memory.cpu[i], cr_memory.cpu_peak[i], cr_memory.gpu[i], cr_memory.gpu_peak[i]);
+    }
+    fprintf(stderr, "%-10s %12zu  %12zu  %12zu  %12zu\n", "total",
+            cr_memory.cpu_total, cr_memory.cpu_total_peak, cr_memory.gpu_total, cr_memory.gpu_total_peak);
+    for (size_t i = 0; i < cr_config->world_layer_count; i++) {
+        CRMemoryUsage usage = CRLayerMemory(&cr_config->world_layers[i]);
+        fprintf(stderr, "world layer %zu: %zu cpu, %zu gpu\n", i, usage.cpu, usage.gpu);
+    }
+    for (size_t i = 0; i < cr_config->ui_layer_count; i++) {
+        CRMemoryUsage usage = CRLayerMemory(&cr_config->ui_layers[i]);
+        fprintf(stderr, "ui layer %zu: %zu cpu, %zu gpu\n", i, usage.cpu, usage.gpu);
+    }
+    for (size_t i = 0; i < cr_config->font_count; i++) {
+        CRMemoryUsage usage = CRFontMemory(i);
+        fprintf(stderr, "font %zu: %zu cpu, %zu gpu\n", i, usage.cpu, usage.gpu);
+    }
+    for (size_t i = 0; i < cr_config->tilemap_count; i++)
+        fprintf(stderr, "tilemap %zu: %zu gpu\n", i, CRTilemapMemory(i).gpu);
+}
+
 // Cleanup Functions
 void CRClose() {
-    CRUnloadFonts();
-    CRUnloadTilemaps();
-    CRUnloadCharIndexAssoc();
+    if (cr_config->dump_memory)
+        CRDumpMemory();
+    CRStopRecording();
+#if !_WIN32
+    CRStopStream();
+#endif
+    // contexts made with CRNewContext borrow their assets from the context that loaded them
+    if (cr_config->owns_assets) {
+        CRUnloadFonts();
+        CRUnloadGlyphAtlases();
+        CRUnloadTilemaps();
+        CRUnloadCharIndexAssoc();
+    }
     CRUnloadLayers();
+    CRUnloadFOVs();
+    CRUnloadOcclusion();
+    CRUnloadTextLayouts();
     CRUnloadMasks();
+    CRUnloadPalettes();
+    CRUnloadTweens();
+    CRUnloadTileAnimations();
+    CRUnloadCommandQueue();
+    CRArenaFree(&cr_config->frame_arena);
+    CRFree(cr_config->cells);
+    cr_config->cells = 0;
+    if (cr_config->headless)
+        return;
 #if TERMINAL
     CRStopTerm();
 #else
+    if (cr_config->layer_shader.id != 0)
+        UnloadShader(cr_config->layer_shader);
     CloseWindow();
 #endif
 }
+void CRUnloadLayerData(CRLayer *layer) {
+    if (layer->data == 0)
+        return;
+    CRFree(layer->data);
+    layer->data = 0;
+#if !TERMINAL
+    CRUntrackTexture(MEMORYLAYERS, layer->data_texture);
+    UnloadTexture(layer->data_texture);
+#endif
+}
 void CRUnloadLayers() {
     size_t count = cr_config->world_layer_count;
     if (count > 0) {
         for (int i = 0; i < count; i++) {
-            free(cr_config->world_layers[i].grid);
+            CRFree(cr_config->world_layers[i].grid);
+            CRFree(cr_config->world_layers[i].occupancy);
+            CRFree(cr_config->world_layers[i].mask_blocks);
+            CRUnloadLayerData(&cr_config->world_layers[i]);
+            CRUnloadParticles(&cr_config->world_layers[i]);
+            CRUnloadScrollback(&cr_config->world_layers[i]);
         }
-        free(cr_config->world_layers);
     }
+    CRFree(cr_config->world_layers);
     count = cr_config->ui_layer_count;
     if (count > 0) {
         for (int i = 0; i < count; i++) {
-            free(cr_config->ui_layers[i].grid);
+            CRFree(cr_config->ui_layers[i].grid);
+            CRFree(cr_config->ui_layers[i].occupancy);
+            CRFree(cr_config->ui_layers[i].mask_blocks);
+            CRUnloadLayerData(&cr_config->ui_layers[i]);
+            CRUnloadParticles(&cr_config->ui_layers[i]);
+            CRUnloadScrollback(&cr_config->ui_layers[i]);
         }
-        free(cr_config->ui_layers);
     }
+    CRFree(cr_config->ui_layers);
 }
 inline void CRUnloadFonts() {
     for (int i = cr_config->font_count-1; i >= 0; i--) {
+        CRUntrackFont(&cr_config->fonts[i]);
         UnloadFont(cr_config->fonts[i]);
     }
-    free(cr_config->fonts);
+    CRFree(cr_config->fonts);
+#if !TERMINAL
+    if (cr_config->sdf_shader.id != 0)
+        UnloadShader(cr_config->sdf_shader);
+#endif
+}
+void CRUnloadGlyphAtlases() {
+    if (cr_config->glyph_atlas_count == 0)
+        return;
+    for (int i = 0; i < cr_config->glyph_atlas_count; i++) {
+        CRGlyphAtlas *atlas = &cr_config->glyph_atlases[i];
+#if !TERMINAL
+        for (int page = 0; page < atlas->page_count; page++) {
+            CRUntrackTexture(MEMORYFONTS, atlas->pages[page]);
+            UnloadTexture(atlas->pages[page]);
+        }
+#endif
+        CRUntrackMemory(MEMORYFONTS, atlas->file_size);
+        UnloadFileData(atlas->file_data);
+        CRFree(atlas->glyphs);
+    }
+    CRFree(cr_config->glyph_atlases);
+}
+void CRUnmapBundle(void *data, size_t size) {
+#if _WIN32
+    UnloadFileData(data);
+#else
+    munmap(data, size);
+#endif
 }
 inline void CRUnloadCharIndexAssoc() {
+    if (cr_config->bundle_mapping != 0)
+        CRUnmapBundle(cr_config->bundle_mapping, cr_config->bundle_mapping_size);
+    cr_config->bundle_mapping = 0;
+    cr_config->bundle_assoc_starts = 0;
+    cr_config->bundle_assocs = 0;
     if (cr_config->assoc_count == 0)
         return;
-    free(cr_config->assocs);
+    CRFree(cr_config->assocs);
 }
 inline void CRUnloadTilemaps() {
-    free(cr_config->tilemaps);
+    for (int i = 0; i < cr_config->tilemap_count; i++) {
+        CRUntrackTexture(MEMORYTILEMAPS, cr_config->tilemaps[i].texture);
+#if !TERMINAL
+        UnloadTexture(cr_config->tilemaps[i].texture);
+#endif
+    }
+    CRFree(cr_config->tilemaps);
 }
 void CRUnloadMasks() {
     if (cr_config->mask_count == 0)
         return;
-    for (int i = 0; i < cr_config->mask_count; i++)
-        free(cr_config->masks[i].grid);
-    free(cr_config->masks);
+    for (int i = 0; i < cr_config->mask_count; i++) {
+        CRFree(cr_config->masks[i].grid);
+        CRFree(cr_config->masks[i].block_min);
+        CRFree(cr_config->masks[i].block_max);
+    }
+    CRFree(cr_config->masks);
+}
+void CRUnloadFOVs() {
+    if (cr_config->fov_count == 0)
+        return;
+    for (int i = 0; i < cr_config->fov_count; i++) {
+        CRFOV *fov = &cr_config->fovs[i];
+        for (int j = 0; j < fov->light_count; j++)
+            CRFree(fov->lights[j].map);
+        CRFree(fov->lights);
+        CRFree(fov->opacity);
+    }
+    CRFree(cr_config->fovs);
+}
+void CRUnloadOcclusion() {
+    CRFree(cr_config->occlusion);
+    cr_config->occlusion = 0;
+}
+void CRUnloadTextLayouts() {
+    for (size_t i = 0; i < cr_config->text_layout_count; i++) {
+        CRFree(cr_config->text_layouts[i].text);
+        CRFree(cr_config->text_layouts[i].glyphs);
+    }
+    CRFree(cr_config->text_layouts);
+    CRFree(cr_config->text_layout_slots);
+    cr_config->text_layouts = 0;
+    cr_config->text_layout_count = 0;
+    cr_config->text_layout_capacity = 0;
+    cr_config->text_layout_slots = 0;
+    cr_config->text_layout_slot_count = 0;
+    cr_config->text_cache_bytes = 0;
+}
+void CRUnloadPalettes() {
+    if (cr_config->palette_count == 0)
+        return;
+#if !TERMINAL
+    if (!cr_config->headless) {
+        CRUntrackTexture(MEMORYPALETTES, cr_config->palette_texture);
+        UnloadTexture(cr_config->palette_texture);
+        UnloadShader(cr_config->palette_shader);
+    }
+#endif
+    CRFree(cr_config->palettes);
+}
+
+// Render on demand
+// With render_on_demand set, CRLoop only draws a frame when something on screen may have changed:
+// a tile, flag, mask or palette was set, an entity or mask was moved with CRMoveEntity or CRMoveMask,
+// an update step moved an entity, the camera moved, the window was resized, an animation is running,
+// or CRRequestRedraw was called. Anything written to directly has to call CRRequestRedraw itself.
+// Otherwise it waits for input, blocking outright when nothing could change without some.
+void CRSetRenderOnDemand(int enabled) {
+    cr_config->render_on_demand = enabled;
+    cr_config->redraw = 1;
+}
+void CRRequestRedraw() {
+    cr_config->redraw = 1;
+}
+// Redraw every frame until the matching CREndAnimation, for things CRGA can't see change
+void CRBeginAnimation() {
+    cr_config->animations++;
+}
+void CREndAnimation() {
+    if (cr_config->animations > 0)
+        cr_config->animations--;
+}
+int CRShouldRedraw() {
+    if (!cr_config->render_on_demand)
+        return 1;
+    if (memcmp(&cr_config->main_camera, &cr_config->drawn_camera, sizeof(Camera2D)) != 0)
+        cr_config->redraw = 1;
+#if !TERMINAL
+    if (!cr_config->headless && IsWindowResized())
+        cr_config->redraw = 1;
+#endif
+    if (cr_config->animations > 0 || cr_config->interpolating)
+        cr_config->redraw = 1;
+    return cr_config->redraw;
+}
+int CRLayersHaveParticles(CRLayer *layers, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        CRParticles *particles = layers[i].particles;
+        if (particles == 0)
+            continue;
+        if (particles->count > 0)
+            return 1;
+        // an emitter with a low rate leaves the pool empty between particles
+        for (size_t e = 0; e < particles->emitter_count; e++) {
+            if (particles->emitters[e].active && particles->emitters[e].rate > 0.0f)
+                return 1;
+        }
+    }
+    return 0;
+}
+// Whether anything can change while no input arrives, so waiting has to wake up to check
+int CRIdleHasWork() {
+    if (cr_config->pre_draw != 0 || cr_config->update != 0 || cr_config->tile_animation_count > 0 ||
+            cr_config->commands.slots != 0)
+        return 1;
+#if !_WIN32
+    if (cr_config->stream != 0)
+        return 1;
+#endif
+    for (size_t i = 0; i < cr_config->palette_count; i++) {
+        if (cr_config->palettes[i].cycle_speed != 0.0f && cr_config->palettes[i].cycle_length >= 2)
+            return 1;
+    }
+    return CRLayersHaveParticles(cr_config->world_layers, cr_config->world_layer_count) ||
+        CRLayersHaveParticles(cr_config->ui_layers, cr_config->ui_layer_count);
+}
+void CRWaitForInput() {
+    int block = !CRIdleHasWork();
+#if TERMINAL
+    // block until a key arrives or the timeout passes, and leave the key for the next frame to read
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    poll(&input, 1, block ? -1 : cr_config->idle_timeout * 1000);
+#else
+    // nothing was drawn, so EndDrawing didn't poll input for us
+    if (block) {
+        EnableEventWaiting();
+        PollInputEvents();
+        DisableEventWaiting();
+    } else {
+        WaitTime(cr_config->idle_timeout);
+        PollInputEvents();
+    }
+#endif
+}
+
+// Fixed timestep
+// With an update function set, CRLoop calls it update_step seconds apart however fast frames are
+// drawn, catching up with several calls after a slow frame. Entities are drawn between where they
+// were before the last update and where they are now, update_alpha of the way along.
+double CRGetTime() {
+#if !TERMINAL
+    if (cr_config == 0 || !cr_config->headless)
+        return GetTime();
+#endif
+    // there's no raylib window to ask
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+void CRSetUpdateRate(double steps_per_second, int max_steps) {
+    cr_config->update_step = 1.0 / steps_per_second;
+    cr_config->max_update_steps = max_steps;
+}
+void CRSnapshotEntities(CRLayer *layers, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        for (CREntity *entity = layers[i].entities.head; entity != 0; entity = entity->next)
+            entity->previous_position = entity->position;
+    }
+}
+int CREntitiesMoved(CRLayer *layers, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        for (CREntity *entity = layers[i].entities.head; entity != 0; entity = entity->next) {
+            if (entity->previous_position.x != entity->position.x || entity->previous_position.y != entity->position.y)
+                return 1;
+        }
+    }
+    return 0;
+}
+void CRRunUpdates() {
+    double now = CRGetTime();
+    if (cr_config->last_update_time < 0)
+        cr_config->last_update_time = now;
+    cr_config->update_accumulator += now - cr_config->last_update_time;
+    cr_config->last_update_time = now;
+    int steps = 0;
+    while (cr_config->update_accumulator >= cr_config->update_step) {
+        if (steps == cr_config->max_update_steps) {
+            // too far behind to catch up, drop the backlog rather than spiral
+            cr_config->update_accumulator = fmod(cr_config->update_accumulator, cr_config->update_step);
+            break;
+        }
+        CRSnapshotEntities(cr_config->world_layers, cr_config->world_layer_count);
+        CRSnapshotEntities(cr_config->ui_layers, cr_config->ui_layer_count);
+        (*cr_config->update)();
+        CREndInputFrame();
+        cr_config->update_accumulator -= cr_config->update_step;
+        steps++;
+    }
+    cr_config->update_alpha = cr_config->update_accumulator / cr_config->update_step;
+    // entities still on their way to their new positions need every frame drawn
+    cr_config->interpolating = CREntitiesMoved(cr_config->world_layers, cr_config->world_layer_count) ||
+        CREntitiesMoved(cr_config->ui_layers, cr_config->ui_layer_count);
+}
+// Where the entity is drawn this frame
+Vector2 CREntityDrawPosition(CREntity *entity) {
+    if (entity->tween >= 0)
+        return entity->visual_position;
+#if TERMINAL
+    // cells can't be drawn between each other
+    return entity->position;
+#else
+    if (cr_config->update == 0 || cr_config->headless)
+        return entity->position;
+    float alpha = cr_config->update_alpha;
+    return (Vector2) {
+        entity->previous_position.x + (entity->position.x - entity->previous_position.x) * alpha,
+        entity->previous_position.y + (entity->position.y - entity->previous_position.y) * alpha
+    };
+#endif
 }
 
 // Loop
@@ -176,62 +838,184 @@ void CRLoop() {
     while (!WindowShouldClose())
 #endif
         {
-
-        if (CRPreDraw != 0)
-            (*CRPreDraw)();
-
+        if (!CRDrawFrame())
+            CRWaitForInput();
+    }
+}
+// One pass of CRLoop for the current context. Returns 0 if render on demand skipped drawing.
+int CRDrawFrame() {
+    CRArenaReset(&cr_config->frame_arena);
 #if TERMINAL
-        // TODO terminal begin drawing
-        CRBeginTerminalCamera();
-            clear();
-#else
-        BeginDrawing();
+    if (!cr_config->headless)
+        CRPollTerminalInput();
+#endif
+    CRFlushInput();
 
-            ClearBackground(cr_config->background_color);
+    if (cr_config->pre_draw != 0)
+        (*cr_config->pre_draw)();
 
-            BeginMode2D(cr_config->main_camera);
+    if (cr_config->update != 0)
+        CRRunUpdates();
+    if (cr_config->commands.slots != 0)
+        CRApplyCommands();
+    if (cr_config->tweens.count > 0)
+        CRRunTweens();
+    if (cr_config->tile_animation_count > 0)
+        CRUpdateTileAnimations(CRGetTime());
+    CRRunParticles();
+
+    CRUpdatePalettes();
+#if !_WIN32
+    if (cr_config->stream != 0)
+        CRServiceStream(cr_config->stream);
 #endif
 
-                for (int i = 0; i < cr_config->world_layer_count; i++) {
-                    CRDrawLayer(&cr_config->world_layers[i]);
-                }
-                if (CRWorldDraw != 0)
-                    (*CRWorldDraw)();
+    if (!CRShouldRedraw()) {
+        if (cr_config->update == 0)
+            CREndInputFrame();
+        return 0;
+    }
+    cr_config->redraw = 0;
+    cr_config->drawn_camera = cr_config->main_camera;
+
+    if (cr_config->render != 0)
+        (*cr_config->render)(cr_config->update_alpha);
+
+    if (cr_config->headless)
+        CRDrawCells();
+    else
+        CRDrawScreen();
+
+    if (cr_config->post_draw != 0)
+        (*cr_config->post_draw)();
+    if (cr_config->recorder != 0)
+        CRRecordFrame(cr_config->recorder);
+#if !_WIN32
+    if (cr_config->stream != 0)
+        CRStreamFrame(cr_config->stream);
+#endif
+    if (cr_config->update == 0)
+        CREndInputFrame();
+    cr_config->frame++;
+    return 1;
+}
+void CRDrawScreen() {
 #if TERMINAL
-            CREndTerminalCamera();
-            refresh();
+    // TODO terminal begin drawing
+    CRBeginTerminalCamera();
+        clear();
 #else
-            EndMode2D();
+    BeginDrawing();
+
+        ClearBackground(cr_config->background_color);
+
+        BeginMode2D(cr_config->main_camera);
 #endif
+            if (cr_config->occlusion_top >= 0)
+                CRUpdateOcclusion();
 
-            for (int i = 0; i < cr_config->ui_layer_count; i++) {
-                CRDrawLayer(&cr_config->ui_layers[i]);
+            for (int i = 0; i < cr_config->world_layer_count; i++) {
+                CRDrawLayer(&cr_config->world_layers[i]);
             }
-            if (CRUIDraw != 0)
-                (*CRUIDraw)();
+            if (cr_config->world_draw != 0)
+                (*cr_config->world_draw)();
 #if TERMINAL
-        // TODO terminal, end UI mode
-        // TODO terminal end drawing
+        CREndTerminalCamera();
         refresh();
 #else
-        EndDrawing();
+        EndMode2D();
 #endif
 
-        if (CRPostDraw != 0)
-            (*CRPostDraw)();
-    }
+        for (int i = 0; i < cr_config->ui_layer_count; i++) {
+            CRDrawLayer(&cr_config->ui_layers[i]);
+        }
+        if (cr_config->ui_draw != 0)
+            (*cr_config->ui_draw)();
+#if TERMINAL
+    // TODO terminal, end UI mode
+    // TODO terminal end drawing
+    refresh();
+#else
+    EndDrawing();
+#endif
 }
 void CRSetWorldDraw(void (*new_func)()) {
-    CRWorldDraw = new_func;
+    cr_config->world_draw = new_func;
 }
 void CRSetUIDraw(void (*new_func)()) {
-    CRUIDraw = new_func;
+    cr_config->ui_draw = new_func;
 }
 void CRSetPreDraw(void (*new_func)()) {
-    CRPreDraw = new_func;
+    cr_config->pre_draw = new_func;
 }
 void CRSetPostDraw(void (*new_func)()) {
-    CRPostDraw = new_func;
+    cr_config->post_draw = new_func;
+}
+void CRSetUpdate(void (*new_func)()) {
+    cr_config->update = new_func;
+    cr_config->last_update_time = -1;
+    cr_config->update_accumulator = 0;
+}
+void CRSetRender(void (*new_func)(float alpha)) {
+    cr_config->render = new_func;
+}
+
+// Contexts
+// Every CRGA call works on the calling thread's current context, set with CRSetConfig. A server can
+// keep a context per view, each drawn on its own thread, all sharing the fonts, tilemaps and
+// character associations one context loaded. Load every asset before making contexts that share
+// them, since loading more can move the arrays they point into.
+CRConfig *CRGetConfig() {
+    return cr_config;
+}
+// A headless context draws into a width by height grid of cells instead of a window or terminal.
+// shared can be 0 for a context with no assets of its own.
+CRConfig *CRNewContext(CRConfig *shared, int width, int height) {
+    CRConfig *config = cr_allocator.allocate(cr_allocator.user, sizeof(CRConfig));
+    if (config == 0)
+        return 0;
+    CRInitConfig(config);
+    config->headless = 1;
+    // cells are one tile each
+    config->tile_size = 1.0f;
+    config->default_layer_width = width;
+    config->default_layer_height = height;
+    if (shared != 0) {
+        config->owns_assets = 0;
+        config->fonts = shared->fonts;
+        config->font_count = shared->font_count;
+        memcpy(config->font_flags, shared->font_flags, sizeof(config->font_flags));
+        config->sdf_shader = shared->sdf_shader;
+        config->tilemaps = shared->tilemaps;
+        config->tilemap_count = shared->tilemap_count;
+        config->glyph_atlases = shared->glyph_atlases;
+        config->glyph_atlas_count = shared->glyph_atlas_count;
+        config->assocs = shared->assocs;
+        config->assoc_count = shared->assoc_count;
+        config->bundle_assoc_starts = shared->bundle_assoc_starts;
+        config->bundle_assocs = shared->bundle_assocs;
+        memcpy(config->char_index_assoc, shared->char_index_assoc, sizeof(config->char_index_assoc));
+        config->allocator = shared->allocator;
+    }
+    CRConfig *previous = cr_config;
+    CRSetConfig(config);
+    if (shared == 0)
+        CRInitCharIndexAssoc();
+    config->cells = CRCalloc(width * height, sizeof(CRCell), MEMORYLAYERS);
+    config->cell_width = width;
+    config->cell_height = height;
+    CRInitWorld();
+    CRInitUI();
+    CRSetConfig(previous);
+    return config;
+}
+void CRFreeContext(CRConfig *config) {
+    CRConfig *previous = cr_config;
+    CRSetConfig(config);
+    CRClose();
+    CRSetConfig(previous == config ? 0 : previous);
+    // freed with the allocator it was made with
+    config->allocator.deallocate(config->allocator.user, config);
 }
 
 // Font Loading
@@ -239,40 +1023,315 @@ void CRSetPostDraw(void (*new_func)()) {
 inline void CRLoadFont(const char *font_path) {
     CRLoadFontSize(font_path, 96);
 }
-void CRLoadFontSize(const char *font_path, int size) {
+Font *CRNewFont(uint8_t flags) {
     if (cr_config->font_count == 255) {
         // there are too many fonts, exit out
-        return;
-    } else if (cr_config->font_count == 0) {
-        cr_config->fonts = (Font *) malloc(sizeof(Font));
-    } else {
-        cr_config->fonts = (Font *) realloc(cr_config->fonts, sizeof(Font) * (cr_config->font_count + 1));
+        return 0;
     }
+    cr_config->fonts = CRGrow(cr_config->fonts, &cr_config->font_capacity, cr_config->font_count, sizeof(Font), MEMORYFONTS);
     size_t index = cr_config->font_count;
     cr_config->font_count++;
+    cr_config->font_flags[index] = flags;
+    cr_config->fonts[index] = (Font) {0};
+    return &cr_config->fonts[index];
+}
+void CRLoadFontSize(const char *font_path, int size) {
+    Font *font = CRNewFont(0);
+    if (font == 0)
+        return;
     
-    cr_config->fonts[index] = LoadFontEx(font_path, size, 0, 0);
+    *font = LoadFontEx(font_path, size, 0, 0);
+
+    GenTextureMipmaps(&font->texture);
+    SetTextureFilter(font->texture, TEXTURE_FILTER_POINT);
+    CRTrackFont(font);
+}
+
+// SDF fonts store the distance to the glyph's edge instead of its coverage, so one small atlas
+// stays sharp at every tile size and zoom level.
+const char *cr_sdf_shader_code =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    float distance = texture(texture0, fragTexCoord).a - 0.5;\n"
+    "    float change = length(vec2(dFdx(distance), dFdy(distance)));\n"
+    "    float alpha = smoothstep(-change, change, distance);\n"
+    "    finalColor = vec4(fragColor.rgb, fragColor.a*alpha);\n"
+    "}\n";
+
+// The rasterized atlas and glyph metrics are cached next to the font, as <font_path>.sdf<size>:
+// the magic, base size, glyph count, atlas width, height and format, each glyph's value, offsets,
+// advance and rectangle, then the atlas pixels.
+#define SDFCACHEMAGIC 0x46445343 // "CSDF"
+// bigger than any atlas we'd make, and small enough that the pixel size fits in an int
+#define SDFCACHEMAXSIDE 8192
+int CRLoadSDFCache(const char *cache_path, Font *font) {
+    unsigned int size = 0;
+    unsigned char *data = LoadFileData(cache_path, &size);
+    if (data == 0)
+        return 0;
+    const unsigned char *cursor = data;
+    int header[6];
+    if (size < sizeof(header)) {
+        UnloadFileData(data);
+        return 0;
+    }
+    ReadBytes(&cursor, header, sizeof(header));
+    int glyph_count = header[2];
+    size_t glyph_size = sizeof(int) * 4 + sizeof(Rectangle);
+    // a stale or damaged cache is rebuilt, checked before any of its sizes are multiplied out
+    if (header[0] != SDFCACHEMAGIC || header[1] <= 0 || glyph_count <= 0 ||
+            header[3] <= 0 || header[4] <= 0 || header[3] > SDFCACHEMAXSIDE || header[4] > SDFCACHEMAXSIDE) {
+        UnloadFileData(data);
+        return 0;
+    }
+    int pixel_size = GetPixelDataSize(header[3], header[4], header[5]);
+    if (pixel_size <= 0 || size != sizeof(header) + (uint64_t) glyph_count * glyph_size + pixel_size) {
+        UnloadFileData(data);
+        return 0;
+    }
+    font->baseSize = header[1];
+    font->glyphCount = glyph_count;
+    font->glyphPadding = 0;
+    // raylib frees these in UnloadFont, so they have to come from its allocator
+    font->glyphs = RL_CALLOC(glyph_count, sizeof(GlyphInfo));
+    font->recs = RL_MALLOC(sizeof(Rectangle) * glyph_count);
+    for (int i = 0; i < glyph_count; i++) {
+        ReadBytes(&cursor, &font->glyphs[i].value, sizeof(int));
+        ReadBytes(&cursor, &font->glyphs[i].offsetX, sizeof(int));
+        ReadBytes(&cursor, &font->glyphs[i].offsetY, sizeof(int));
+        ReadBytes(&cursor, &font->glyphs[i].advanceX, sizeof(int));
+        ReadBytes(&cursor, &font->recs[i], sizeof(Rectangle));
+    }
+    Image atlas = {(void *) cursor, header[3], header[4], 1, header[5]};
+    font->texture = LoadTextureFromImage(atlas);
+    UnloadFileData(data);
+    return 1;
+}
+void CRSaveSDFCache(const char *cache_path, Font *font, Image atlas) {
+    size_t glyph_size = sizeof(int) * 4 + sizeof(Rectangle);
+    int pixel_size = GetPixelDataSize(atlas.width, atlas.height, atlas.format);
+    int header[6] = {SDFCACHEMAGIC, font->baseSize, font->glyphCount, atlas.width, atlas.height, atlas.format};
+    size_t size = sizeof(header) + font->glyphCount * glyph_size + pixel_size;
+    unsigned char *data = CRAlloc(size, MEMORYFONTS);
+    unsigned char *cursor = data;
+    WriteBytes(&cursor, header, sizeof(header));
+    for (int i = 0; i < font->glyphCount; i++) {
+        WriteBytes(&cursor, &font->glyphs[i].value, sizeof(int));
+        WriteBytes(&cursor, &font->glyphs[i].offsetX, sizeof(int));
+        WriteBytes(&cursor, &font->glyphs[i].offsetY, sizeof(int));
+        WriteBytes(&cursor, &font->glyphs[i].advanceX, sizeof(int));
+        WriteBytes(&cursor, &font->recs[i], sizeof(Rectangle));
+    }
+    WriteBytes(&cursor, atlas.data, pixel_size);
+    SaveFileData(cache_path, data, size);
+    CRFree(data);
+}
+void CRPrepareSDFFont(Font *font) {
+    SetTextureFilter(font->texture, TEXTURE_FILTER_BILINEAR);
+#if !TERMINAL
+    if (cr_config->sdf_shader.id == 0)
+        cr_config->sdf_shader = LoadShaderFromMemory(0, cr_sdf_shader_code);
+#endif
+}
+void CRLoadFontSDF(const char *font_path, int size) {
+    Font *font = CRNewFont(0b1);
+    if (font == 0)
+        return;
+
+    char cache_path[1024];
+    snprintf(cache_path, sizeof(cache_path), "%s.sdf%i", font_path, size);
+    int cached = FileExists(cache_path) && GetFileModTime(cache_path) >= GetFileModTime(font_path);
+    if (!cached || !CRLoadSDFCache(cache_path, font)) {
+        unsigned int file_size = 0;
+        unsigned char *file_data = LoadFileData(font_path, &file_size);
+        if (file_data == 0) {
+            cr_config->font_count--; // give the slot back
+            return; // TODO font file error
+        }
+        font->baseSize = size;
+        font->glyphCount = 95;
+        font->glyphPadding = 0;
+        font->glyphs = LoadFontData(file_data, file_size, size, 0, 0, FONT_SDF);
+        UnloadFileData(file_data);
+        if (font->glyphs == 0) {
+            cr_config->font_count--;
+            return; // TODO font file error
+        }
+        Image atlas = GenImageFontAtlas(font->glyphs, &font->recs, font->glyphCount, size, 0, 1);
+        font->texture = LoadTextureFromImage(atlas);
+        CRSaveSDFCache(cache_path, font, atlas);
+        UnloadImage(atlas);
+        // the atlas has everything, the per glyph images are just taking up memory
+        for (int i = 0; i < font->glyphCount; i++) {
+            UnloadImage(font->glyphs[i].image);
+            font->glyphs[i].image = (Image) {0};
+        }
+    }
+    CRPrepareSDFFont(font);
+    CRTrackFont(font);
+}
 
-    GenTextureMipmaps(&cr_config->fonts[index].texture);
-    SetTextureFilter(cr_config->fonts[index].texture, TEXTURE_FILTER_POINT);
+// Glyph Atlases
+// Glyph atlases only rasterize a glyph the first time it's drawn, so large fonts load instantly
+// and only the glyphs actually on screen take up texture memory.
+size_t CRLoadGlyphAtlas(const char *font_path, int size) {
+    size_t index = cr_config->glyph_atlas_count;
+    cr_config->glyph_atlases = CRGrow(cr_config->glyph_atlases, &cr_config->glyph_atlas_capacity, index, sizeof(CRGlyphAtlas), MEMORYFONTS);
+    cr_config->glyph_atlas_count++;
+    // layers waiting on this atlas start drawing, and covering what's beneath them
+    CRMarkOcclusionDirty(0, INT_MAX);
+    CRGlyphAtlas *atlas = &cr_config->glyph_atlases[index];
+    unsigned int file_size = 0;
+    atlas->file_data = LoadFileData(font_path, &file_size);
+    atlas->file_size = file_size;
+    CRTrackMemory(MEMORYFONTS, file_size);
+    atlas->size = size;
+    atlas->page_count = 0;
+    atlas->current_page = -1;
+    atlas->shelf_x = 0;
+    atlas->shelf_y = 0;
+    atlas->shelf_height = 0;
+    atlas->glyph_count = 0;
+    atlas->glyph_capacity = 256;
+    atlas->glyphs = CRAlloc(sizeof(CRGlyphSlot) * atlas->glyph_capacity, MEMORYFONTS);
+    for (size_t i = 0; i < atlas->glyph_capacity; i++)
+        atlas->glyphs[i].page = -1;
+    return index;
+}
+CRGlyphSlot *CRFindGlyphSlot(CRGlyphSlot *glyphs, size_t capacity, int codepoint) {
+    size_t slot = ((uint32_t) codepoint * 2654435761u) & (capacity - 1);
+    while (glyphs[slot].page >= 0 && glyphs[slot].codepoint != codepoint)
+        slot = (slot + 1) & (capacity - 1);
+    return &glyphs[slot];
+}
+// Rebuild the table, leaving out the glyphs on dropped_page (-1 keeps them all)
+void CRRehashGlyphs(CRGlyphAtlas *atlas, size_t capacity, int dropped_page) {
+    CRGlyphSlot *old = atlas->glyphs;
+    size_t old_capacity = atlas->glyph_capacity;
+    atlas->glyphs = CRAlloc(sizeof(CRGlyphSlot) * capacity, MEMORYFONTS);
+    atlas->glyph_capacity = capacity;
+    atlas->glyph_count = 0;
+    for (size_t i = 0; i < capacity; i++)
+        atlas->glyphs[i].page = -1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].page < 0 || old[i].page == dropped_page)
+            continue;
+        *CRFindGlyphSlot(atlas->glyphs, capacity, old[i].codepoint) = old[i];
+        atlas->glyph_count++;
+    }
+    CRFree(old);
+}
+// Find room for a width by height glyph, starting a new page or clearing out the least recently
+// used one when the current page is full. Returns an empty rectangle for a glyph bigger than a page.
+Rectangle CRPackGlyph(CRGlyphAtlas *atlas, int width, int height) {
+    if (width > GLYPHPAGESIZE || height > GLYPHPAGESIZE)
+        return (Rectangle) {0, 0, 0, 0}; // TODO glyph too big for a page error
+    if (atlas->current_page >= 0 && atlas->shelf_x + width > GLYPHPAGESIZE) {
+        atlas->shelf_x = 0;
+        atlas->shelf_y += atlas->shelf_height;
+        atlas->shelf_height = 0;
+    }
+    if (atlas->current_page < 0 || atlas->shelf_y + height > GLYPHPAGESIZE) {
+        if (atlas->page_count < MAXGLYPHPAGES) {
+            Image image = GenImageColor(GLYPHPAGESIZE, GLYPHPAGESIZE, BLANK);
+            atlas->pages[atlas->page_count] = LoadTextureFromImage(image);
+            CRTrackTexture(MEMORYFONTS, atlas->pages[atlas->page_count]);
+            UnloadImage(image);
+            atlas->current_page = atlas->page_count;
+            atlas->page_count++;
+        } else {
+            int oldest = 0;
+            for (int i = 1; i < atlas->page_count; i++) {
+                if (atlas->page_used[i] < atlas->page_used[oldest])
+                    oldest = i;
+            }
+            CRRehashGlyphs(atlas, atlas->glyph_capacity, oldest);
+            atlas->current_page = oldest;
+        }
+        atlas->page_used[atlas->current_page] = cr_config->frame;
+        atlas->shelf_x = 0;
+        atlas->shelf_y = 0;
+        atlas->shelf_height = 0;
+    }
+    Rectangle rec = {atlas->shelf_x, atlas->shelf_y, width, height};
+    atlas->shelf_x += width;
+    if (height > atlas->shelf_height)
+        atlas->shelf_height = height;
+    return rec;
+}
+CRGlyphSlot *CRGetGlyph(CRGlyphAtlas *atlas, int codepoint) {
+    CRGlyphSlot *slot = CRFindGlyphSlot(atlas->glyphs, atlas->glyph_capacity, codepoint);
+    if (slot->page >= 0) {
+        atlas->page_used[slot->page] = cr_config->frame;
+        return slot;
+    }
+#if TERMINAL
+    return 0;
+#else
+    GlyphInfo *info = LoadFontData(atlas->file_data, atlas->file_size, atlas->size, &codepoint, 1, FONT_DEFAULT);
+    if (info == 0)
+        return 0;
+    Image image = info->image;
+    // glyphs come back as grayscale coverage, pages are white with the coverage as alpha.
+    // Leave a pixel of padding so neighbouring glyphs don't bleed into each other.
+    Rectangle rec = CRPackGlyph(atlas, image.width + 1, image.height + 1);
+    if (rec.width == 0) {
+        UnloadFontData(info, 1);
+        return 0;
+    }
+    rec.width = image.width;
+    rec.height = image.height;
+    if (image.width > 0 && image.height > 0) {
+        Color *pixels = CRFrameAlloc(sizeof(Color) * image.width * image.height);
+        unsigned char *coverage = image.data;
+        for (int i = 0; i < image.width * image.height; i++)
+            pixels[i] = (Color) {255, 255, 255, coverage[i]};
+        // glyphs already batched this frame may be sampling the area about to be overwritten
+        rlDrawRenderBatchActive();
+        UpdateTextureRec(atlas->pages[atlas->current_page], rec, pixels);
+    }
+    if ((atlas->glyph_count + 1) * 10 > atlas->glyph_capacity * 7)
+        CRRehashGlyphs(atlas, atlas->glyph_capacity * 2, -1);
+    slot = CRFindGlyphSlot(atlas->glyphs, atlas->glyph_capacity, codepoint);
+    slot->codepoint = codepoint;
+    slot->page = atlas->current_page;
+    slot->rec = rec;
+    slot->offset_x = info->offsetX;
+    slot->offset_y = info->offsetY;
+    slot->advance_x = info->advanceX;
+    atlas->glyph_count++;
+    UnloadFontData(info, 1);
+    return slot;
+#endif
+}
+void CRPreloadGlyphs(size_t atlas, const char *text) {
+    int length = strlen(text);
+    for (int i = 0; i < length;) {
+        int bytes = 0;
+        int codepoint = GetCodepoint(&text[i], &bytes);
+        i += bytes > 0 ? bytes : 1;
+        CRGetGlyph(&cr_config->glyph_atlases[atlas], codepoint);
+    }
 }
 
 // Tilemap Loading
 // TODO handle tilemap loading within terminal rendering
-void CRLoadTilemap(const char *tilemap_path, int tile_width, int tile_height) {
+void CRAddTilemap(Texture2D tilemap_texture, int tile_width, int tile_height) {
     if (cr_config->tilemap_count == 255) {
         // there are too many tiles, exit out
+        UnloadTexture(tilemap_texture);
         return;
-    } else if (cr_config->tilemap_count == 0) {
-        cr_config->tilemaps = (CRTilemap *) malloc(sizeof(CRTilemap));
-    } else {
-        cr_config->tilemaps = (CRTilemap *) realloc(cr_config->tilemaps, sizeof(CRTilemap) * (cr_config->tilemap_count + 1));
     }
+    cr_config->tilemaps = CRGrow(cr_config->tilemaps, &cr_config->tilemap_capacity, cr_config->tilemap_count, sizeof(CRTilemap), MEMORYTILEMAPS);
     size_t index = cr_config->tilemap_count;
     cr_config->tilemap_count++;
 
-    cr_config->tilemaps[index].texture = LoadTexture(tilemap_path);
-    Texture2D tilemap_texture = cr_config->tilemaps[index].texture;
+    cr_config->tilemaps[index].texture = tilemap_texture;
+    CRTrackTexture(MEMORYTILEMAPS, tilemap_texture);
     
     int count_h = tilemap_texture.width / tile_width;
     int count_v = tilemap_texture.height / tile_height;
@@ -281,7 +1340,27 @@ void CRLoadTilemap(const char *tilemap_path, int tile_width, int tile_height) {
     cr_config->tilemaps[index].height = tile_height;
     cr_config->tilemaps[index].tile_count = count;
 }
+void CRLoadTilemap(const char *tilemap_path, int tile_width, int tile_height) {
+    CRAddTilemap(LoadTexture(tilemap_path), tile_width, tile_height);
+}
+// The entry for character in the loaded bundle's table, or 0 if it doesn't have one
+CRBundleAssoc *CRFindBundleAssoc(char *character) {
+    if (cr_config->bundle_assocs == 0)
+        return 0;
+    uint8_t first = character[0];
+    for (uint32_t i = cr_config->bundle_assoc_starts[first]; i < cr_config->bundle_assoc_starts[first + 1]; i++) {
+        if (cmpstr(cr_config->bundle_assocs[i].character, character, 4))
+            return &cr_config->bundle_assocs[i];
+    }
+    return 0;
+}
 void CRSetCharAssoc(char* character, int index) {
+    // the bundle's table is mapped copy on write, so it can be changed in place
+    CRBundleAssoc *entry = CRFindBundleAssoc(character);
+    if (entry != 0) {
+        entry->index = index;
+        return;
+    }
     // Convert string to index
     int assoc_index = character[0];
     // use index to access value in array
@@ -297,11 +1376,7 @@ void CRSetCharAssoc(char* character, int index) {
     } while(assoc != 0);
     // if it doesn't exist, add add a new association
     size_t assoc_count = cr_config->assoc_count;
-    if  (assoc_count == 0)
-        cr_config->assocs = malloc(sizeof(CRCharIndexAssoc));
-    else
-        cr_config->assocs = realloc(cr_config->assocs, 
-                sizeof(CRCharIndexAssoc) * (assoc_count + 1));
+    cr_config->assocs = CRGrow(cr_config->assocs, &cr_config->assoc_capacity, assoc_count, sizeof(CRCharIndexAssoc), MEMORYASSOCS);
     CRCharIndexAssoc *new_assoc = &cr_config->assocs[assoc_count];
     // copy character over
     for (int i = 0; i < 4; i++)
@@ -315,29 +1390,377 @@ void CRSetCharAssoc(char* character, int index) {
     cr_config->assoc_count++;
 }
 
-// Layers
-CRLayer CRNewLayer() {
-    CRLayer layer;
-    layer.grid = 0;
-    layer.entities.head = 0;
-    layer.entities.tail = 0;
-    layer.tile_index = 0;
-    layer.width = cr_config->default_layer_width;
-    layer.height = cr_config->default_layer_height;
-    layer.position = (Vector2) {0, 0};
-    layer.flags = 0;
+// Asset Bundles
+// A bundle is every asset a game needs already decoded into one file, so startup is a single read
+// and a texture upload per asset. The file is the magic, then sections of a type, a size and the
+// payload, each payload starting on a BUNDLEALIGN boundary so pixel data can be uploaded straight
+// from the mapped file. Everything is stored in the byte order of the machine that built it.
+#define BUNDLEMAGIC 0x42475243 // "CRGB"
+#define BUNDLEALIGN 16
+#define BUNDLETILEMAP 1
+#define BUNDLEFONT 2
+#define BUNDLEASSOCS 4
+// bigger than any texture we'd bundle, and small enough that a mipmap's pixel size fits in an int
+#define BUNDLEMAXSIDE 8192
+CRBundle CRNewBundle() {
+    CRBundle bundle;
+    bundle.data = 0;
+    bundle.size = 0;
+    bundle.capacity = 0;
+    bundle.assocs = 0;
+    bundle.assoc_count = 0;
+    bundle.assoc_capacity = 0;
+    uint32_t magic = BUNDLEMAGIC;
+    CRBundleWrite(&bundle, &magic, sizeof(magic));
+    return bundle;
+}
+void CRBundleWrite(CRBundle *bundle, const void *data, size_t size) {
+    if (bundle->size + size > bundle->capacity) {
+        size_t capacity = bundle->capacity == 0 ? 4096 : bundle->capacity;
+        while (capacity < bundle->size + size)
+            capacity *= 2;
+        bundle->data = CRRealloc(bundle->data, capacity, MEMORYOTHER);
+        bundle->capacity = capacity;
+    }
+    memcpy(bundle->data + bundle->size, data, size);
+    bundle->size += size;
+}
+// Start a section, returning where its size goes so it can be filled in once the payload is written
+size_t CRBundleSection(CRBundle *bundle, uint32_t type) {
+    uint32_t header[2] = {type, 0};
+    if ((bundle->size + sizeof(header)) % BUNDLEALIGN != 0) {
+        // pad with an empty section of type 0, which the loader skips, so the payload is aligned
+        static const unsigned char padding[BUNDLEALIGN] = {0};
+        uint32_t skip[2] = {0, (BUNDLEALIGN - bundle->size % BUNDLEALIGN) % BUNDLEALIGN};
+        CRBundleWrite(bundle, skip, sizeof(skip));
+        CRBundleWrite(bundle, padding, skip[1]);
+    }
+    CRBundleWrite(bundle, header, sizeof(header));
+    return bundle->size - sizeof(uint32_t);
+}
+void CRBundleEndSection(CRBundle *bundle, size_t size_offset) {
+    uint32_t size = bundle->size - size_offset - sizeof(uint32_t);
+    memcpy(bundle->data + size_offset, &size, sizeof(size));
+}
+void CRBundleImage(CRBundle *bundle, Image image) {
+    int32_t header[4] = {image.width, image.height, image.format, image.mipmaps};
+    CRBundleWrite(bundle, header, sizeof(header));
+    // mipmaps are stored one after the other, the same way raylib keeps them in memory
+    size_t size = 0;
+    int width = image.width;
+    int height = image.height;
+    for (int i = 0; i < image.mipmaps; i++) {
+        size += GetPixelDataSize(width, height, image.format);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    CRBundleWrite(bundle, image.data, size);
+}
+void CRBundleTilemapImage(CRBundle *bundle, Image image, int tile_width, int tile_height) {
+    size_t section = CRBundleSection(bundle, BUNDLETILEMAP);
+    int32_t header[4] = {tile_width, tile_height, 0, 0};
+    CRBundleWrite(bundle, header, sizeof(header));
+    CRBundleImage(bundle, image);
+    CRBundleEndSection(bundle, section);
+}
+void CRBundleTilemap(CRBundle *bundle, const char *tilemap_path, int tile_width, int tile_height) {
+    Image image = LoadImage(tilemap_path);
+    if (image.data == 0)
+        return; // TODO couldn't load tilemap error
+    CRBundleTilemapImage(bundle, image, tile_width, tile_height);
+    UnloadImage(image);
+}
+void CRBundleFont(CRBundle *bundle, const char *font_path, int size, int sdf) {
+    unsigned int file_size = 0;
+    unsigned char *file_data = LoadFileData(font_path, &file_size);
+    if (file_data == 0)
+        return; // TODO couldn't load font error
+    // rasterized the same way CRLoadFontSize and CRLoadFontSDF would
+    int glyph_count = 95;
+    int padding = sdf ? 0 : 4;
+    GlyphInfo *glyphs = LoadFontData(file_data, file_size, size, 0, 0, sdf ? FONT_SDF : FONT_DEFAULT);
+    UnloadFileData(file_data);
+    Rectangle *recs = 0;
+    Image atlas = GenImageFontAtlas(glyphs, &recs, glyph_count, size, padding, sdf ? 1 : 0);
+
+    size_t section = CRBundleSection(bundle, BUNDLEFONT);
+    int32_t header[4] = {sdf ? 0b1 : 0, size, glyph_count, padding};
+    CRBundleWrite(bundle, header, sizeof(header));
+    for (int i = 0; i < glyph_count; i++) {
+        int32_t metrics[4] = {glyphs[i].value, glyphs[i].offsetX, glyphs[i].offsetY, glyphs[i].advanceX};
+        CRBundleWrite(bundle, metrics, sizeof(metrics));
+        CRBundleWrite(bundle, &recs[i], sizeof(Rectangle));
+    }
+    CRBundleImage(bundle, atlas);
+    CRBundleEndSection(bundle, section);
+
+    UnloadImage(atlas);
+    UnloadFontData(glyphs, glyph_count);
+    RL_FREE(recs);
+}
+void CRBundleCharAssoc(CRBundle *bundle, char *character, int index) {
+    CRBundleAssoc assoc = {{0}, index};
+    for (int i = 0; i < 4 && character[i] != 0; i++)
+        assoc.character[i] = character[i];
+    for (size_t i = 0; i < bundle->assoc_count; i++) {
+        if (memcmp(bundle->assocs[i].character, assoc.character, 4) == 0) {
+            bundle->assocs[i].index = index;
+            return;
+        }
+    }
+    bundle->assocs = CRGrow(bundle->assocs, &bundle->assoc_capacity, bundle->assoc_count, sizeof(CRBundleAssoc), MEMORYOTHER);
+    bundle->assocs[bundle->assoc_count++] = assoc;
+}
+// The associations go in one section, a count, where each first byte's entries start, then the
+// entries grouped by first byte, so loading is pointing at it
+void CRBundleCharAssocs(CRBundle *bundle) {
+    size_t section = CRBundleSection(bundle, BUNDLEASSOCS);
+    uint32_t count = bundle->assoc_count;
+    uint32_t starts[257] = {0};
+    for (size_t i = 0; i < bundle->assoc_count; i++)
+        starts[(uint8_t) bundle->assocs[i].character[0] + 1]++;
+    for (int i = 0; i < 256; i++)
+        starts[i + 1] += starts[i];
+    CRBundleWrite(bundle, &count, sizeof(count));
+    CRBundleWrite(bundle, starts, sizeof(starts));
+    for (int first = 0; first < 256; first++) {
+        for (size_t i = 0; i < bundle->assoc_count; i++) {
+            if ((uint8_t) bundle->assocs[i].character[0] == first)
+                CRBundleWrite(bundle, &bundle->assocs[i], sizeof(CRBundleAssoc));
+        }
+    }
+    CRBundleEndSection(bundle, section);
+    bundle->assoc_count = 0;
+}
+int CRSaveBundle(CRBundle *bundle, const char *path) {
+    if (bundle->assoc_count > 0)
+        CRBundleCharAssocs(bundle);
+    return SaveFileData(path, bundle->data, bundle->size);
+}
+void CRFreeBundle(CRBundle *bundle) {
+    CRFree(bundle->data);
+    CRFree(bundle->assocs);
+    bundle->data = 0;
+    bundle->size = 0;
+    bundle->capacity = 0;
+    bundle->assocs = 0;
+    bundle->assoc_count = 0;
+    bundle->assoc_capacity = 0;
+}
+// An image with no data if its pixels don't fit before end
+Image CRReadBundleImage(const unsigned char **cursor, const unsigned char *end) {
+    int32_t header[4];
+    if (!ReadBytesChecked(cursor, end, header, sizeof(header)))
+        return (Image) {0};
+    if (header[0] <= 0 || header[1] <= 0 || header[0] > BUNDLEMAXSIDE || header[1] > BUNDLEMAXSIDE ||
+            header[3] <= 0 || header[3] > 32)
+        return (Image) {0};
+    uint64_t size = 0;
+    int width = header[0];
+    int height = header[1];
+    for (int i = 0; i < header[3]; i++) {
+        int mipmap_size = GetPixelDataSize(width, height, header[2]);
+        if (mipmap_size <= 0)
+            return (Image) {0};
+        size += mipmap_size;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    if (size > (uint64_t) (end - *cursor))
+        return (Image) {0};
+    // the pixels are used in place, straight from the file
+    Image image = {(void *) *cursor, header[0], header[1], header[3], header[2]};
+    return image;
+}
+// Returns 0 if the section is cut short
+int CRLoadBundleFont(const unsigned char *cursor, const unsigned char *end) {
+    int32_t header[4];
+    if (!ReadBytesChecked(&cursor, end, header, sizeof(header)))
+        return 0;
+    size_t glyph_size = sizeof(int32_t) * 4 + sizeof(Rectangle);
+    if (header[2] <= 0 || (uint64_t) header[2] * glyph_size > (uint64_t) (end - cursor))
+        return 0;
+    // the atlas is checked before a font slot is taken for it
+    const unsigned char *pixels = cursor + header[2] * glyph_size;
+    Image atlas = CRReadBundleImage(&pixels, end);
+    if (atlas.data == 0)
+        return 0;
+    Font *font = CRNewFont(header[0]);
+    if (font == 0)
+        return 1;
+    font->baseSize = header[1];
+    font->glyphCount = header[2];
+    font->glyphPadding = header[3];
+    // raylib frees these in UnloadFont, so they have to come from its allocator
+    font->glyphs = RL_CALLOC(font->glyphCount, sizeof(GlyphInfo));
+    font->recs = RL_MALLOC(sizeof(Rectangle) * font->glyphCount);
+    for (int i = 0; i < font->glyphCount; i++) {
+        int32_t metrics[4];
+        ReadBytes(&cursor, metrics, sizeof(metrics));
+        font->glyphs[i].value = metrics[0];
+        font->glyphs[i].offsetX = metrics[1];
+        font->glyphs[i].offsetY = metrics[2];
+        font->glyphs[i].advanceX = metrics[3];
+        ReadBytes(&cursor, &font->recs[i], sizeof(Rectangle));
+    }
+    font->texture = LoadTextureFromImage(atlas);
+    if (header[0] & 0b1) {
+        CRPrepareSDFFont(font);
+    } else {
+        GenTextureMipmaps(&font->texture);
+        SetTextureFilter(font->texture, TEXTURE_FILTER_POINT);
+    }
+    CRTrackFont(font);
+    return 1;
+}
+int CRLoadBundle(const char *path) {
+    size_t size = 0;
+#if _WIN32
+    unsigned int file_size = 0;
+    unsigned char *data = LoadFileData(path, &file_size);
+    size = file_size;
+#else
+    unsigned char *data = 0;
+    int file = open(path, O_RDONLY);
+    if (file >= 0) {
+        struct stat info;
+        if (fstat(file, &info) == 0 && info.st_size > 0) {
+            size = info.st_size;
+            // writable but private, so changing an association only copies its page
+            data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+            if (data == MAP_FAILED)
+                data = 0;
+        }
+        close(file);
+    }
+#endif
+    if (data == 0)
+        return 0;
+    uint32_t magic = 0;
+    if (size >= sizeof(magic))
+        memcpy(&magic, data, sizeof(magic));
+    const unsigned char *cursor = data + sizeof(magic);
+    const unsigned char *end = data + size;
+    // the bundle stays mapped for as long as its association table is used
+    int keep = 0;
+    int loaded = magic == BUNDLEMAGIC;
+    while (loaded && cursor + 2 * sizeof(uint32_t) <= end) {
+        uint32_t header[2];
+        ReadBytes(&cursor, header, sizeof(header));
+        if (header[1] > (size_t) (end - cursor)) {
+            loaded = 0;
+            break; // TODO truncated bundle error
+        }
+        const unsigned char *section_end = cursor + header[1];
+        if (header[0] == BUNDLETILEMAP) {
+            const unsigned char *section = cursor;
+            int32_t tile_size[4];
+            Image image = {0};
+            if (ReadBytesChecked(&section, section_end, tile_size, sizeof(tile_size)))
+                image = CRReadBundleImage(&section, section_end);
+            if (image.data == 0) {
+                loaded = 0;
+                break; // TODO truncated bundle error
+            }
+            CRAddTilemap(LoadTextureFromImage(image), tile_size[0], tile_size[1]);
+        } else if (header[0] == BUNDLEFONT) {
+            if (!CRLoadBundleFont(cursor, section_end)) {
+                loaded = 0;
+                break; // TODO truncated bundle error
+            }
+        } else if (header[0] == BUNDLEASSOCS && header[1] >= 258 * sizeof(uint32_t)) {
+            const uint32_t *table = (const uint32_t *) cursor;
+            uint64_t count = table[0];
+            // lookups trust the starts, so they have to climb from 0 to the count
+            int valid = table[1] == 0 && table[257] == count &&
+                count <= (header[1] - 258 * sizeof(uint32_t)) / sizeof(CRBundleAssoc);
+            for (int i = 1; valid && i < 257; i++)
+                valid = table[i] <= table[i + 1];
+            if (valid) {
+                cr_config->bundle_assoc_starts = table + 1;
+                cr_config->bundle_assocs = (CRBundleAssoc *) (table + 258);
+                keep = 1;
+            }
+        }
+        cursor += header[1];
+    }
+    // a few bytes left over are a section header cut short
+    if (loaded && cursor != end)
+        loaded = 0; // TODO truncated bundle error
+    if (!keep) {
+        CRUnmapBundle(data, size);
+    } else {
+        if (cr_config->bundle_mapping != 0)
+            CRUnmapBundle(cr_config->bundle_mapping, cr_config->bundle_mapping_size);
+        cr_config->bundle_mapping = data;
+        cr_config->bundle_mapping_size = size;
+    }
+    return loaded;
+}
+
+// Layers
+CRLayer CRNewLayer() {
+    CRLayer layer;
+    layer.grid = 0;
+    layer.occupancy = 0;
+    layer.occupancy_words = 0;
+    layer.entities.head = 0;
+    layer.entities.tail = 0;
+    layer.particles = 0;
+    layer.scrollback = 0;
+    layer.tile_index = 0;
+    layer.width = cr_config->default_layer_width;
+    layer.height = cr_config->default_layer_height;
+    layer.position = (Vector2) {0, 0};
+    layer.scroll_row = 0;
+    layer.flags = 0;
     layer.mask_count = 0;
+    layer.palette_index = 0;
+    layer.data_texture = (Texture2D) {0};
+    layer.data = 0;
+    layer.dirty_top = -1;
+    layer.dirty_bottom = -1;
+    layer.mask_blocks = 0;
+    layer.mask_dirty_left = -1;
+    layer.mask_dirty_top = -1;
+    layer.mask_dirty_right = -1;
+    layer.mask_dirty_bottom = -1;
+    CRSelectDrawKernel(&layer);
     return layer;
 }
-void CRInitGrid(CRLayer *layer) {
-    int size = layer->width * layer->height;
+// Returns 0 and leaves the layer empty, 0 by 0, if the grid couldn't be allocated
+int CRInitGrid(CRLayer *layer) {
+    size_t size = (size_t) layer->width * layer->height;
     if (layer->grid != 0)
-        free(layer->grid);
-    layer->grid = malloc(sizeof(CRTile) * size);
+        CRFree(layer->grid);
+    if (layer->occupancy != 0)
+        CRFree(layer->occupancy);
+    layer->grid = CRAlloc(sizeof(CRTile) * size, MEMORYLAYERS);
+    layer->occupancy_words = (layer->width + 63) / 64;
+    layer->occupancy = CRCalloc(layer->occupancy_words * layer->height, sizeof(uint64_t), MEMORYLAYERS);
+    int allocated = size == 0 || (layer->grid != 0 && layer->occupancy != 0);
+    if (!allocated) {
+        CRFree(layer->grid);
+        CRFree(layer->occupancy);
+        layer->grid = 0;
+        layer->occupancy = 0;
+        layer->occupancy_words = 0;
+        layer->width = 0;
+        layer->height = 0;
+        size = 0;
+    }
     CRTile zero = {0};
     zero.index.i = 0;
-    for (int i = 0; i < size; i++)
+    for (size_t i = 0; i < size; i++)
         layer->grid[i] = zero;
+    layer->scroll_row = 0;
+    if (layer->scrollback != 0)
+        layer->scrollback->materialized = 0;
+    // the layer may have changed size, so the data texture and mask blocks have to be rebuilt
+    CRUnloadLayerData(layer);
+    CRFree(layer->mask_blocks);
+    layer->mask_blocks = 0;
+    return allocated;
 }
 CRLayer CRInitLayer() {
     CRLayer layer = CRNewLayer();
@@ -355,20 +1778,12 @@ void CRSetUILayer(int index, CRLayer layer) {
     cr_config->ui_layers[index] = layer;
 }
 void CRNewWorldLayer() {
-    if (cr_config->world_layer_count == 0) {
-        cr_config->world_layers = (CRLayer *) malloc(sizeof(CRLayer));
-    } else {
-        cr_config->world_layers = (CRLayer *) realloc(cr_config->world_layers, 
-                sizeof(CRLayer) * (cr_config->world_layer_count + 1));
-    }
+    cr_config->world_layers = CRGrow(cr_config->world_layers, &cr_config->world_layer_capacity,
+            cr_config->world_layer_count, sizeof(CRLayer), MEMORYLAYERS);
 }
 void CRNewUILayer() {
-    if (cr_config->ui_layer_count == 0) {
-        cr_config->ui_layers = (CRLayer *) malloc(sizeof(CRLayer));
-    } else {
-        cr_config->ui_layers = (CRLayer *) realloc(cr_config->ui_layers, 
-                sizeof(CRLayer) * (cr_config->ui_layer_count + 1));
-    }
+    cr_config->ui_layers = CRGrow(cr_config->ui_layers, &cr_config->ui_layer_capacity,
+            cr_config->ui_layer_count, sizeof(CRLayer), MEMORYLAYERS);
 }
 void CRAddWorldLayer(int index, CRLayer layer) {
     if (index > cr_config->world_layer_count)
@@ -383,6 +1798,7 @@ void CRAddWorldLayer(int index, CRLayer layer) {
     }
     cr_config->world_layer_count++;
     cr_config->world_layers[index] = layer;
+    CRMarkOcclusionDirty(0, INT_MAX);
 }
 void CRAddUILayer(int index, CRLayer layer) {
     if (index > cr_config->ui_layer_count)
@@ -402,6 +1818,7 @@ void CRAppendWorldLayer(CRLayer layer) {
     CRNewWorldLayer();
     cr_config->world_layers[cr_config->world_layer_count] = layer;
     cr_config->world_layer_count++;
+    CRMarkOcclusionDirty(0, INT_MAX);
 }
 void CRAppendUILayer(CRLayer layer) {
     CRNewUILayer();
@@ -424,30 +1841,68 @@ void CRInitUI() {
 }
 void CRSetLayerFlags(CRLayer *layer, int flags) {
     layer->flags = flags;
+    CRSelectDrawKernel(layer);
+    CRMarkLayerDirty(layer, 0, layer->height - 1);
+}
+// Masks line up with the layer differently once it moves
+void CRSetLayerPosition(CRLayer *layer, Vector2 position) {
+    layer->position = position;
+    CRMarkMaskBlocksDirty(layer, 0, 0, layer->width - 1, layer->height - 1);
+    CRMarkLayerDirty(layer, 0, layer->height - 1);
 }
 void CRSetWorldFlags(int flags) {
-    cr_config->world_layers[0].flags = flags;
+    CRSetLayerFlags(&cr_config->world_layers[0], flags);
 }
 void CRSetUIFlags(int flags) {
-    cr_config->ui_layers[0].flags = flags;
+    CRSetLayerFlags(&cr_config->ui_layers[0], flags);
+}
+int CRIsWorldLayer(CRLayer *layer) {
+    return layer >= cr_config->world_layers && layer < cr_config->world_layers + cr_config->world_layer_count;
+}
+// Rows of the occlusion grid to rebuild before the next draw
+void CRMarkOcclusionDirty(int top, int bottom) {
+    if (cr_config->occlusion_top < 0 || top < cr_config->occlusion_top)
+        cr_config->occlusion_top = top;
+    if (bottom > cr_config->occlusion_bottom)
+        cr_config->occlusion_bottom = bottom;
+}
+void CRMarkLayerDirty(CRLayer *layer, int top, int bottom) {
+    if (top < 0)
+        top = 0;
+    if (bottom >= layer->height)
+        bottom = layer->height - 1;
+    if (top > bottom)
+        return;
+    // only world layers cover each other
+    if (CRIsWorldLayer(layer))
+        CRMarkOcclusionDirty(top, bottom);
+    cr_config->redraw = 1;
+    if (layer->dirty_top < 0 || top < layer->dirty_top)
+        layer->dirty_top = top;
+    if (bottom > layer->dirty_bottom)
+        layer->dirty_bottom = bottom;
 }
 
 // Mask
 size_t CRNewMask(int width, int height, uint8_t flags, Vector2 position) {
     size_t index = cr_config->mask_count;
-    if (index == 0)
-        cr_config->masks = malloc(sizeof(CRMask));
-    else
-        cr_config->masks = realloc(cr_config->masks, sizeof(CRMask) * (index + 1));
+    cr_config->masks = CRGrow(cr_config->masks, &cr_config->mask_capacity, index, sizeof(CRMask), MEMORYMASKS);
     CRMask *mask = &cr_config->masks[index];
     size_t mask_size = width * height;
-    mask->grid = malloc(sizeof(uint8_t) * mask_size);
+    mask->grid = CRAlloc(sizeof(uint8_t) * mask_size, MEMORYMASKS);
     for (size_t i = 0; i < mask_size; i++)
         mask->grid[i] = 255;
     mask->width = width;
     mask->height = height;
     mask->flags = flags;
     mask->position = position;
+    mask->block_width = (width + MASKBLOCK - 1) / MASKBLOCK;
+    mask->block_height = (height + MASKBLOCK - 1) / MASKBLOCK;
+    size_t block_count = mask->block_width * mask->block_height;
+    mask->block_min = CRAlloc(block_count, MEMORYMASKS);
+    mask->block_max = CRAlloc(block_count, MEMORYMASKS);
+    memset(mask->block_min, 255, block_count);
+    memset(mask->block_max, 255, block_count);
     cr_config->mask_count++;
     return index;
 }
@@ -456,6 +1911,77 @@ void CRAddMaskToLayer(size_t mask_index, CRLayer *layer) {
         return; // TODO out of bounds exception
     layer->mask_indexes[layer->mask_count] = mask_index;
     layer->mask_count++;
+    CRSelectDrawKernel(layer);
+    CRMarkMaskBlocksDirty(layer, 0, 0, layer->width - 1, layer->height - 1);
+    CRMarkLayerDirty(layer, 0, layer->height - 1);
+}
+// Layers only rebuild the mask blocks over cells, on the layer, that a mask changed under
+void CRMarkMaskBlocksDirty(CRLayer *layer, int left, int top, int right, int bottom) {
+    left = left < 0 ? 0 : left;
+    top = top < 0 ? 0 : top;
+    right = right >= layer->width ? layer->width - 1 : right;
+    bottom = bottom >= layer->height ? layer->height - 1 : bottom;
+    if (left > right || top > bottom)
+        return;
+    if (layer->mask_dirty_left < 0) {
+        layer->mask_dirty_left = left;
+        layer->mask_dirty_top = top;
+        layer->mask_dirty_right = right;
+        layer->mask_dirty_bottom = bottom;
+        return;
+    }
+    if (left < layer->mask_dirty_left)
+        layer->mask_dirty_left = left;
+    if (top < layer->mask_dirty_top)
+        layer->mask_dirty_top = top;
+    if (right > layer->mask_dirty_right)
+        layer->mask_dirty_right = right;
+    if (bottom > layer->mask_dirty_bottom)
+        layer->mask_dirty_bottom = bottom;
+}
+void CRMarkMaskDirtyOn(CRLayer *layers, size_t count, size_t mask_index, int left, int top, int right, int bottom) {
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < layers[i].mask_count; j++) {
+            if (layers[i].mask_indexes[j] != mask_index)
+                continue;
+            CRMarkMaskBlocksDirty(&layers[i], left, top, right, bottom);
+            CRMarkLayerDirty(&layers[i], top, bottom);
+            break;
+        }
+    }
+}
+// The area is in mask cells, layers see mask cells shifted by the mask position
+void CRMarkMaskAreaDirty(size_t mask_index, int left, int top, int right, int bottom) {
+    CRMask *mask = &cr_config->masks[mask_index];
+    int x = mask->position.x;
+    int y = mask->position.y;
+    CRMarkMaskDirtyOn(cr_config->world_layers, cr_config->world_layer_count, mask_index,
+            left - x, top - y, right - x, bottom - y);
+    CRMarkMaskDirtyOn(cr_config->ui_layers, cr_config->ui_layer_count, mask_index,
+            left - x, top - y, right - x, bottom - y);
+}
+void CRMarkMaskDirty(size_t mask_index, Vector2 position) {
+    CRMarkMaskAreaDirty(mask_index, position.x, position.y, position.x, position.y);
+}
+// Move a mask, every layer it's on is masked differently all over
+void CRMoveMask(size_t mask_index, Vector2 position) {
+    if (mask_index >= cr_config->mask_count)
+        return; // TODO out of bounds error
+    cr_config->masks[mask_index].position = position;
+    CRLayer *layer_lists[2] = {cr_config->world_layers, cr_config->ui_layers};
+    size_t layer_counts[2] = {cr_config->world_layer_count, cr_config->ui_layer_count};
+    for (int list = 0; list < 2; list++) {
+        for (size_t i = 0; i < layer_counts[list]; i++) {
+            CRLayer *layer = &layer_lists[list][i];
+            for (size_t j = 0; j < layer->mask_count; j++) {
+                if (layer->mask_indexes[j] != mask_index)
+                    continue;
+                CRMarkMaskBlocksDirty(layer, 0, 0, layer->width - 1, layer->height - 1);
+                CRMarkLayerDirty(layer, 0, layer->height - 1);
+                break;
+            }
+        }
+    }
 }
 void CRSetWorldMask(Vector2 position, uint8_t mask_value) {
     if (cr_config->world_layer_count == 0)
@@ -465,9 +1991,7 @@ void CRSetWorldMask(Vector2 position, uint8_t mask_value) {
         size_t new_mask = CRNewMask(layer->width, layer->height, 0b11, layer->position);
         CRAddMaskToLayer(new_mask, layer);
     }
-    CRMask *mask = &cr_config->masks[layer->mask_indexes[0]];
-    size_t mask_position = position.x + position.y * mask->width;
-    mask->grid[mask_position] = mask_value;
+    CRSetMaskValue(layer->mask_indexes[0], position, mask_value);
 }
 void CRSetUIMask(Vector2 position, uint8_t mask_value) {
     if (cr_config->ui_layer_count == 0)
@@ -477,9 +2001,132 @@ void CRSetUIMask(Vector2 position, uint8_t mask_value) {
         size_t new_mask = CRNewMask(layer->width, layer->height, 0b11, layer->position);
         CRAddMaskToLayer(new_mask, layer);
     }
-    CRMask *mask = &cr_config->masks[layer->mask_indexes[0]];
-    size_t mask_position = position.x + position.y * mask->width;
-    mask->grid[mask_position] = mask_value;
+    CRSetMaskValue(layer->mask_indexes[0], position, mask_value);
+}
+void CRSetMaskValue(size_t mask_index, Vector2 position, uint8_t mask_value) {
+    CRMask *mask = &cr_config->masks[mask_index];
+    int x = position.x;
+    int y = position.y;
+    if (x < 0 || y < 0 || x >= mask->width || y >= mask->height)
+        return; // TODO out of bounds error
+    uint8_t *cell = &mask->grid[x + y * mask->width];
+    uint8_t old_value = *cell;
+    *cell = mask_value;
+    size_t block = x / MASKBLOCK + (y / MASKBLOCK) * mask->block_width;
+    if (old_value != mask->block_min[block] && old_value != mask->block_max[block]) {
+        // the old value wasn't an extreme, so the new one can only widen the block's range
+        if (mask_value < mask->block_min[block])
+            mask->block_min[block] = mask_value;
+        if (mask_value > mask->block_max[block])
+            mask->block_max[block] = mask_value;
+    } else {
+        CRUpdateMaskBlocks(mask, x, y, x, y);
+    }
+    CRMarkMaskDirty(mask_index, position);
+}
+void CRUpdateMaskBlocks(CRMask *mask, int left, int top, int right, int bottom) {
+    // area is in cells, every block it touches is rescanned
+    if (left < 0)
+        left = 0;
+    if (top < 0)
+        top = 0;
+    if (right >= mask->width)
+        right = mask->width - 1;
+    if (bottom >= mask->height)
+        bottom = mask->height - 1;
+    for (int by = top / MASKBLOCK; by <= bottom / MASKBLOCK; by++) {
+        for (int bx = left / MASKBLOCK; bx <= right / MASKBLOCK; bx++) {
+            int x1 = (bx + 1) * MASKBLOCK > mask->width ? mask->width : (bx + 1) * MASKBLOCK;
+            int y1 = (by + 1) * MASKBLOCK > mask->height ? mask->height : (by + 1) * MASKBLOCK;
+            uint8_t min = 255;
+            uint8_t max = 0;
+            for (int y = by * MASKBLOCK; y < y1; y++) {
+                uint8_t *row = &mask->grid[y * mask->width];
+                for (int x = bx * MASKBLOCK; x < x1; x++) {
+                    if (row[x] < min)
+                        min = row[x];
+                    if (row[x] > max)
+                        max = row[x];
+                }
+            }
+            mask->block_min[bx + by * mask->block_width] = min;
+            mask->block_max[bx + by * mask->block_width] = max;
+        }
+    }
+}
+// Rebuild the blocks under the layer's dirty area from the masks' own blocks
+void CRLayerMaskBlocks(CRLayer *layer) {
+    int blocks_w = (layer->width + MASKBLOCK - 1) / MASKBLOCK;
+    int blocks_h = (layer->height + MASKBLOCK - 1) / MASKBLOCK;
+    if (layer->mask_blocks == 0) {
+        layer->mask_blocks = CRAlloc(blocks_w * blocks_h, MEMORYLAYERS);
+        CRMarkMaskBlocksDirty(layer, 0, 0, layer->width - 1, layer->height - 1);
+    }
+    if (layer->mask_dirty_left < 0)
+        return;
+    int left = layer->mask_dirty_left / MASKBLOCK;
+    int top = layer->mask_dirty_top / MASKBLOCK;
+    int right = layer->mask_dirty_right / MASKBLOCK;
+    int bottom = layer->mask_dirty_bottom / MASKBLOCK;
+    layer->mask_dirty_left = -1;
+    layer->mask_dirty_top = -1;
+    layer->mask_dirty_right = -1;
+    layer->mask_dirty_bottom = -1;
+    // like CRMaskTile, masks only apply to cells that are still on the layer shifted by its position
+    int on_x0 = -layer->position.x;
+    int on_y0 = -layer->position.y;
+    int on_x1 = on_x0 + layer->width - 1;
+    int on_y1 = on_y0 + layer->height - 1;
+    for (int by = top; by <= bottom; by++) {
+        for (int bx = left; bx <= right; bx++) {
+            // the block's cells on the layer
+            int x0 = bx * MASKBLOCK;
+            int y0 = by * MASKBLOCK;
+            int x1 = x0 + MASKBLOCK > layer->width ? layer->width - 1 : x0 + MASKBLOCK - 1;
+            int y1 = y0 + MASKBLOCK > layer->height ? layer->height - 1 : y0 + MASKBLOCK - 1;
+            // and the ones masks apply to, the rest are left as they are
+            int cx0 = x0 < on_x0 ? on_x0 : x0;
+            int cy0 = y0 < on_y0 ? on_y0 : y0;
+            int cx1 = x1 > on_x1 ? on_x1 : x1;
+            int cy1 = y1 > on_y1 ? on_y1 : y1;
+            int whole = cx0 == x0 && cy0 == y0 && cx1 == x1 && cy1 == y1;
+            uint8_t state = BLOCKVISIBLE;
+            for (int i = 0; cx0 <= cx1 && cy0 <= cy1 && i < layer->mask_count; i++) {
+                CRMask *mask = &cr_config->masks[layer->mask_indexes[i]];
+                // the same cells on the mask, cells off the mask aren't masked
+                int mx0 = cx0 + mask->position.x;
+                int my0 = cy0 + mask->position.y;
+                int mx1 = cx1 + mask->position.x;
+                int my1 = cy1 + mask->position.y;
+                int covered = whole && mx0 >= 0 && my0 >= 0 && mx1 < mask->width && my1 < mask->height;
+                mx0 = mx0 < 0 ? 0 : mx0;
+                my0 = my0 < 0 ? 0 : my0;
+                mx1 = mx1 >= mask->width ? mask->width - 1 : mx1;
+                my1 = my1 >= mask->height ? mask->height - 1 : my1;
+                if (mx0 > mx1 || my0 > my1)
+                    continue;
+                // the mask blocks overlapping the cells are a superset of them, so this is conservative
+                uint8_t min = 255;
+                uint8_t max = 0;
+                for (int mby = my0 / MASKBLOCK; mby <= my1 / MASKBLOCK; mby++) {
+                    for (int mbx = mx0 / MASKBLOCK; mbx <= mx1 / MASKBLOCK; mbx++) {
+                        size_t block = mbx + mby * mask->block_width;
+                        if (mask->block_min[block] < min)
+                            min = mask->block_min[block];
+                        if (mask->block_max[block] > max)
+                            max = mask->block_max[block];
+                    }
+                }
+                if (covered && max == 0) {
+                    state = BLOCKHIDDEN;
+                    break;
+                }
+                if (min < 255)
+                    state = BLOCKMIXED;
+            }
+            layer->mask_blocks[bx + by * blocks_w] = state;
+        }
+    }
 }
 uint8_t CRMaskTile(CRLayer *layer, Vector2 position, uint8_t flags) {
     // Position is the position on the layer
@@ -487,12 +2134,12 @@ uint8_t CRMaskTile(CRLayer *layer, Vector2 position, uint8_t flags) {
     if (position.x < 0 || position.x > layer->width || position.y < 0 || position.y > layer->height) {
         return 255;
     }
-    CRTile *tile = &layer->grid[(int) (position.x + position.y * layer->width)];
+    CRTile *tile = &layer->grid[(int) position.x + LayerRow(layer, position.y) * layer->width];
     if (tile->index.i == 0)
         return 255;
     uint8_t mask_value = 255;
     for (int i = 0; i < layer->mask_count; i++) {
-        CRMask mask = cr_config->masks[i];
+        CRMask mask = cr_config->masks[layer->mask_indexes[i]];
         // see if point is on the layer and mask, otherwise move to the next layer
         if (!(OnLayer(layer, position) && OnMask(&mask, position)))
             continue;
@@ -513,89 +2160,1115 @@ uint8_t CRMaskTile(CRLayer *layer, Vector2 position, uint8_t flags) {
     return mask_value;
 }
 
+// Field of view and lighting
+size_t CRNewFOV(size_t mask_index) {
+    size_t index = cr_config->fov_count;
+    cr_config->fovs = CRGrow(cr_config->fovs, &cr_config->fov_capacity, index, sizeof(CRFOV), MEMORYFOV);
+    CRFOV *fov = &cr_config->fovs[index];
+    CRMask *mask = &cr_config->masks[mask_index];
+    fov->width = mask->width;
+    fov->height = mask->height;
+    fov->mask_index = mask_index;
+    fov->opacity = CRCalloc(mask->width * mask->height, sizeof(uint8_t), MEMORYFOV);
+    fov->lights = 0;
+    fov->light_count = 0;
+    fov->light_capacity = 0;
+    // nothing is lit yet, so the whole mask starts hidden
+    fov->dirty = 1;
+    fov->dirty_left = 0;
+    fov->dirty_top = 0;
+    fov->dirty_right = mask->width - 1;
+    fov->dirty_bottom = mask->height - 1;
+    cr_config->fov_count++;
+    return index;
+}
+void CRDirtyFOVArea(CRFOV *fov, int x, int y, int radius) {
+    int left = x - radius;
+    int top = y - radius;
+    int right = x + radius;
+    int bottom = y + radius;
+    if (!fov->dirty) {
+        fov->dirty = 1;
+        fov->dirty_left = left;
+        fov->dirty_top = top;
+        fov->dirty_right = right;
+        fov->dirty_bottom = bottom;
+        return;
+    }
+    if (left < fov->dirty_left)
+        fov->dirty_left = left;
+    if (top < fov->dirty_top)
+        fov->dirty_top = top;
+    if (right > fov->dirty_right)
+        fov->dirty_right = right;
+    if (bottom > fov->dirty_bottom)
+        fov->dirty_bottom = bottom;
+}
+void CRSetOpacity(size_t fov_index, Vector2 position, uint8_t opaque) {
+    CRFOV *fov = &cr_config->fovs[fov_index];
+    int x = position.x;
+    int y = position.y;
+    if (x < 0 || y < 0 || x >= fov->width || y >= fov->height)
+        return; // TODO out of bounds error
+    if (fov->opacity[x + y * fov->width] == opaque)
+        return;
+    fov->opacity[x + y * fov->width] = opaque;
+    // only the lights that could reach the cell have to be recast
+    for (int i = 0; i < fov->light_count; i++) {
+        CRLight *light = &fov->lights[i];
+        if (!light->active || light->map == 0)
+            continue;
+        if (abs(x - light->map_x) <= light->map_radius && abs(y - light->map_y) <= light->map_radius)
+            light->dirty = 1;
+    }
+}
+size_t CRAddLight(size_t fov_index, Vector2 position, int radius, uint8_t intensity) {
+    CRFOV *fov = &cr_config->fovs[fov_index];
+    size_t index = fov->light_count;
+    // reuse the slot of a removed light
+    for (size_t i = 0; i < fov->light_count; i++) {
+        if (!fov->lights[i].active && fov->lights[i].map == 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index == fov->light_count) {
+        fov->lights = CRGrow(fov->lights, &fov->light_capacity, index, sizeof(CRLight), MEMORYFOV);
+        fov->light_count++;
+    }
+    CRLight *light = &fov->lights[index];
+    light->position = position;
+    light->radius = radius;
+    light->intensity = intensity;
+    light->active = 1;
+    light->dirty = 1;
+    light->map = 0;
+    light->map_x = position.x;
+    light->map_y = position.y;
+    light->map_radius = 0;
+    return index;
+}
+void CRMoveLight(size_t fov, size_t light, Vector2 position) {
+    CRLight *l = &cr_config->fovs[fov].lights[light];
+    if (l->position.x == position.x && l->position.y == position.y)
+        return;
+    l->position = position;
+    l->dirty = 1;
+}
+void CRSetLight(size_t fov, size_t light, int radius, uint8_t intensity) {
+    CRLight *l = &cr_config->fovs[fov].lights[light];
+    l->radius = radius;
+    l->intensity = intensity;
+    l->dirty = 1;
+}
+void CRRemoveLight(size_t fov, size_t light) {
+    CRLight *l = &cr_config->fovs[fov].lights[light];
+    l->active = 0;
+    l->dirty = 1;
+}
+void CRLightCell(CRFOV *fov, CRLight *light, int x, int y, int dx, int dy) {
+    int radius = light->map_radius;
+    float distance = sqrtf(dx * dx + dy * dy);
+    float value = light->intensity * (1.0f - distance / (radius + 1));
+    int side = 2 * radius + 1;
+    light->map[(x - light->map_x + radius) + (y - light->map_y + radius) * side] = value;
+}
+// Recursive shadowcasting over one octant. xx, xy, yx, yy turn octant coordinates into map coordinates.
+void CRCastLight(CRFOV *fov, CRLight *light, int row, float start, float end, int xx, int xy, int yx, int yy) {
+    if (start < end)
+        return;
+    int radius = light->map_radius;
+    float new_start = 0.0f;
+    for (int j = row; j <= radius; j++) {
+        int dx = -j - 1;
+        int dy = -j;
+        int blocked = 0;
+        while (dx <= 0) {
+            dx++;
+            int x = light->map_x + dx * xx + dy * xy;
+            int y = light->map_y + dx * yx + dy * yy;
+            float left_slope = (dx - 0.5f) / (dy + 0.5f);
+            float right_slope = (dx + 0.5f) / (dy - 0.5f);
+            if (start < right_slope)
+                continue;
+            else if (end > left_slope)
+                break;
+            int on_grid = x >= 0 && y >= 0 && x < fov->width && y < fov->height;
+            if (on_grid && dx * dx + dy * dy <= radius * radius)
+                CRLightCell(fov, light, x, y, dx, dy);
+            int opaque = !on_grid || fov->opacity[x + y * fov->width];
+            if (blocked) {
+                if (opaque) {
+                    new_start = right_slope;
+                    continue;
+                }
+                blocked = 0;
+                start = new_start;
+            } else if (opaque && j < radius) {
+                blocked = 1;
+                CRCastLight(fov, light, j + 1, start, left_slope, xx, xy, yx, yy);
+                new_start = right_slope;
+            }
+        }
+        if (blocked)
+            break;
+    }
+}
+void CRComputeLight(CRFOV *fov, CRLight *light) {
+    static const int multipliers[4][8] = {
+        {1, 0, 0, -1, -1, 0, 0, 1},
+        {0, 1, -1, 0, 0, -1, 1, 0},
+        {0, 1, 1, 0, 0, -1, -1, 0},
+        {1, 0, 0, 1, -1, 0, 0, -1}
+    };
+    int side = 2 * light->map_radius + 1;
+    memset(light->map, 0, side * side);
+    int x = light->map_x;
+    int y = light->map_y;
+    if (x < 0 || y < 0 || x >= fov->width || y >= fov->height)
+        return;
+    CRLightCell(fov, light, x, y, 0, 0);
+    for (int octant = 0; octant < 8; octant++) {
+        CRCastLight(fov, light, 1, 1.0f, 0.0f, multipliers[0][octant], multipliers[1][octant],
+                multipliers[2][octant], multipliers[3][octant]);
+    }
+}
+// Get every dirty light ready to be cast. Allocation happens here so casting can run on any thread.
+// Returns the number of lights that need casting.
+int CRPrepareLights(CRFOV *fov) {
+    int count = 0;
+    for (int i = 0; i < fov->light_count; i++) {
+        CRLight *light = &fov->lights[i];
+        if (!light->dirty)
+            continue;
+        // clear wherever the light used to be
+        if (light->map != 0)
+            CRDirtyFOVArea(fov, light->map_x, light->map_y, light->map_radius);
+        if (!light->active) {
+            CRFree(light->map);
+            light->map = 0;
+            light->dirty = 0;
+            continue;
+        }
+        if (light->map == 0 || light->map_radius != light->radius) {
+            int side = 2 * light->radius + 1;
+            CRFree(light->map);
+            light->map = CRAlloc(side * side, MEMORYFOV);
+        }
+        light->map_x = light->position.x;
+        light->map_y = light->position.y;
+        light->map_radius = light->radius;
+        CRDirtyFOVArea(fov, light->map_x, light->map_y, light->map_radius);
+        count++;
+    }
+    return count;
+}
+// Rebuild the dirty area of the mask, each cell taking the brightest light that reaches it
+void CRComposeFOV(CRFOV *fov) {
+    if (!fov->dirty)
+        return;
+    CRMask *mask = &cr_config->masks[fov->mask_index];
+    int left = fov->dirty_left < 0 ? 0 : fov->dirty_left;
+    int top = fov->dirty_top < 0 ? 0 : fov->dirty_top;
+    int right = fov->dirty_right >= fov->width ? fov->width - 1 : fov->dirty_right;
+    int bottom = fov->dirty_bottom >= fov->height ? fov->height - 1 : fov->dirty_bottom;
+    for (int y = top; y <= bottom; y++)
+        memset(&mask->grid[left + y * mask->width], 0, right - left + 1);
+    for (int i = 0; i < fov->light_count; i++) {
+        CRLight *light = &fov->lights[i];
+        if (!light->active || light->map == 0)
+            continue;
+        int radius = light->map_radius;
+        int side = 2 * radius + 1;
+        int x0 = light->map_x - radius < left ? left : light->map_x - radius;
+        int y0 = light->map_y - radius < top ? top : light->map_y - radius;
+        int x1 = light->map_x + radius > right ? right : light->map_x + radius;
+        int y1 = light->map_y + radius > bottom ? bottom : light->map_y + radius;
+        for (int y = y0; y <= y1; y++) {
+            uint8_t *row = &light->map[(y - light->map_y + radius) * side + radius - light->map_x];
+            uint8_t *out = &mask->grid[y * mask->width];
+            for (int x = x0; x <= x1; x++) {
+                if (row[x] > out[x])
+                    out[x] = row[x];
+            }
+        }
+    }
+    CRUpdateMaskBlocks(mask, left, top, right, bottom);
+    CRMarkMaskAreaDirty(fov->mask_index, left, top, right, bottom);
+    fov->dirty = 0;
+}
+void CRUpdateFOV(size_t fov_index) {
+    CRFOV *fov = &cr_config->fovs[fov_index];
+    CRPrepareLights(fov);
+    for (int i = 0; i < fov->light_count; i++) {
+        CRLight *light = &fov->lights[i];
+        if (!light->dirty)
+            continue;
+        CRComputeLight(fov, light);
+        light->dirty = 0;
+    }
+    CRComposeFOV(fov);
+}
+#if THREADS
+typedef struct {
+    CRFOV *fov;
+    size_t next_light;
+} CRFOVJob;
+void *CRFOVWorker(void *arg) {
+    CRFOVJob *job = arg;
+    CRFOV *fov = job->fov;
+    // lights are handed out one at a time, so a few large lights don't stall a whole thread
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next_light, 1, __ATOMIC_RELAXED);
+        if (i >= fov->light_count)
+            break;
+        CRLight *light = &fov->lights[i];
+        if (!light->dirty)
+            continue;
+        CRComputeLight(fov, light);
+        light->dirty = 0;
+    }
+    return 0;
+}
+#endif
+void CRUpdateFOVThreaded(size_t fov_index, int thread_count) {
+#if THREADS
+    CRFOV *fov = &cr_config->fovs[fov_index];
+    int count = CRPrepareLights(fov);
+    if (thread_count > count)
+        thread_count = count;
+    if (thread_count <= 1) {
+        CRUpdateFOV(fov_index);
+        return;
+    }
+    CRFOVJob job = {fov, 0};
+    pthread_t *threads = CRFrameAlloc(sizeof(pthread_t) * (thread_count - 1));
+    // a thread that fails to start just leaves more lights for the rest
+    int started = 0;
+    for (int i = 0; i < thread_count - 1; i++) {
+        if (pthread_create(&threads[started], 0, CRFOVWorker, &job) == 0)
+            started++;
+    }
+    // the calling thread works too
+    CRFOVWorker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], 0);
+    CRComposeFOV(fov);
+#else
+    CRUpdateFOV(fov_index);
+#endif
+}
+
+// Palettes
+// Palette layers draw through this shader. The red channel of the vertex color is the index into
+// the palette, so text, tilemaps and the background rectangle all resolve their colors on the GPU.
+const char *cr_palette_shader_code =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "uniform sampler2D palette;\n"
+    "uniform float paletteRow;\n"
+    "uniform vec4 tint;\n"
+    "uniform int sdf;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    vec4 texel = texture(texture0, fragTexCoord);\n"
+    "    if (sdf != 0) {\n"
+    "        float distance = texel.a - 0.5;\n"
+    "        float change = length(vec2(dFdx(distance), dFdy(distance)));\n"
+    "        texel = vec4(1.0, 1.0, 1.0, smoothstep(-change, change, distance));\n"
+    "    }\n"
+    "    float index = floor(fragColor.r*255.0 + 0.5);\n"
+    "    vec2 uv = vec2((index + 0.5)/" TOSTRING(PALETTESIZE) ".0, (paletteRow + 0.5)/" TOSTRING(MAXPALETTES) ".0);\n"
+    "    vec4 color = texture(palette, uv);\n"
+    "    finalColor = texel*vec4(color.rgb, color.a*fragColor.a)*tint;\n"
+    "}\n";
+
+// raylib forgets textures set with SetShaderValueTexture every time the batch is flushed, which
+// happens constantly while a layer switches between its font and the background rectangles.
+// Textures the shaders sample for the whole layer are bound to fixed slots above the batch's own.
+void CRBindShaderTexture(Shader shader, const char *name, Texture2D texture, int slot) {
+    rlActiveTextureSlot(slot);
+    rlEnableTexture(texture.id);
+    rlActiveTextureSlot(0);
+    SetShaderValue(shader, GetShaderLocation(shader, name), &slot, SHADER_UNIFORM_INT);
+}
+void CRInitPaletteTexture() {
+#if !TERMINAL
+    // headless contexts have no GPU, they look colors up in the palettes themselves
+    if (cr_config->headless)
+        return;
+    Image image = GenImageColor(PALETTESIZE, MAXPALETTES, BLANK);
+    cr_config->palette_texture = LoadTextureFromImage(image);
+    CRTrackTexture(MEMORYPALETTES, cr_config->palette_texture);
+    UnloadImage(image);
+    SetTextureFilter(cr_config->palette_texture, TEXTURE_FILTER_POINT);
+    cr_config->palette_shader = LoadShaderFromMemory(0, cr_palette_shader_code);
+#endif
+}
+// The color an index shows right now, with the cycling range rotated by the current offset
+Color CRPaletteEntry(CRPalette *palette, uint8_t index) {
+    int offset = index - palette->cycle_start;
+    if (palette->cycle_length > 1 && offset >= 0 && offset < palette->cycle_length) {
+        int from = palette->cycle_start + (offset + palette->cycle_offset) % palette->cycle_length;
+        if (from < PALETTESIZE)
+            return palette->colors[from];
+    }
+    return palette->colors[index];
+}
+void CRUploadPalette(size_t palette) {
+#if !TERMINAL
+    if (!cr_config->headless) {
+        CRPalette *pal = &cr_config->palettes[palette];
+        Color row[PALETTESIZE];
+        for (int i = 0; i < PALETTESIZE; i++)
+            row[i] = CRPaletteEntry(pal, i);
+        Rectangle rect = {0, palette, PALETTESIZE, 1};
+        UpdateTextureRec(cr_config->palette_texture, rect, row);
+    }
+#endif
+    cr_config->redraw = 1;
+}
+size_t CRNewPalette(Color *colors, size_t count) {
+    size_t index = cr_config->palette_count;
+    if (index == MAXPALETTES)
+        return MAXPALETTES; // TODO out of palettes error
+    if (index == 0)
+        CRInitPaletteTexture();
+    cr_config->palettes = CRGrow(cr_config->palettes, &cr_config->palette_capacity, index, sizeof(CRPalette), MEMORYPALETTES);
+    CRPalette *palette = &cr_config->palettes[index];
+    if (count > PALETTESIZE)
+        count = PALETTESIZE;
+    for (size_t i = 0; i < PALETTESIZE; i++)
+        palette->colors[i] = i < count ? colors[i] : BLANK;
+    palette->cycle_start = 0;
+    palette->cycle_length = 0;
+    palette->cycle_speed = 0.0f;
+    palette->cycle_offset = 0;
+    cr_config->palette_count++;
+    CRUploadPalette(index);
+    return index;
+}
+void CRSetPaletteColor(size_t palette, uint8_t index, Color color) {
+    if (palette >= cr_config->palette_count)
+        return; // TODO out of bounds error
+    cr_config->palettes[palette].colors[index] = color;
+    CRUploadPalette(palette);
+}
+void CRSetPaletteCycle(size_t palette, uint8_t start, uint8_t length, float speed) {
+    if (palette >= cr_config->palette_count)
+        return; // TODO out of bounds error
+    CRPalette *pal = &cr_config->palettes[palette];
+    pal->cycle_start = start;
+    pal->cycle_length = length;
+    pal->cycle_speed = speed;
+    pal->cycle_offset = 0;
+    CRUploadPalette(palette);
+}
+void CRSetLayerPalette(CRLayer *layer, size_t palette) {
+    if (palette >= cr_config->palette_count)
+        return; // TODO out of bounds error
+    layer->palette_index = palette;
+    cr_config->redraw = 1;
+}
+void CRSetGlobalPalette(int palette) {
+    if (palette >= (int) cr_config->palette_count)
+        return; // TODO out of bounds error
+    cr_config->palette_override = palette;
+    cr_config->redraw = 1;
+}
+void CRSetPaletteTint(Color tint) {
+    cr_config->palette_tint = tint;
+    cr_config->redraw = 1;
+}
+Color CRPaletteColor(uint8_t index) {
+    return (Color) {index, 0, 0, 255};
+}
+void CRUpdatePalettes() {
+    // only palettes whose rotation actually moved get re-uploaded
+    double time = CRGetTime();
+    for (size_t i = 0; i < cr_config->palette_count; i++) {
+        CRPalette *palette = &cr_config->palettes[i];
+        if (palette->cycle_speed == 0.0f || palette->cycle_length < 2)
+            continue;
+        int offset = (int) (time * palette->cycle_speed) % palette->cycle_length;
+        if (offset < 0)
+            offset += palette->cycle_length;
+        if (offset == palette->cycle_offset)
+            continue;
+        palette->cycle_offset = offset;
+        CRUploadPalette(i);
+    }
+}
+int CRLayerUsesSDF(CRLayer *layer) {
+    // text layers drawing with a font rather than a tilemap or glyph atlas
+    if ((layer->flags & 0b10001) != 0 || layer->tile_index >= cr_config->font_count)
+        return 0;
+    return cr_config->font_flags[layer->tile_index] & 0b1;
+}
+void CRBeginPaletteMode(CRLayer *layer) {
+#if !TERMINAL
+    if (cr_config->palette_count == 0 || cr_config->headless)
+        return;
+    Shader shader = cr_config->palette_shader;
+    float row = cr_config->palette_override >= 0 ? cr_config->palette_override : layer->palette_index;
+    Color tint_color = cr_config->palette_tint;
+    float tint[4] = {tint_color.r/255.0f, tint_color.g/255.0f, tint_color.b/255.0f, tint_color.a/255.0f};
+    SetShaderValue(shader, GetShaderLocation(shader, "paletteRow"), &row, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(shader, GetShaderLocation(shader, "tint"), tint, SHADER_UNIFORM_VEC4);
+    int sdf = CRLayerUsesSDF(layer);
+    SetShaderValue(shader, GetShaderLocation(shader, "sdf"), &sdf, SHADER_UNIFORM_INT);
+    BeginShaderMode(shader);
+    CRBindShaderTexture(shader, "palette", cr_config->palette_texture, PALETTESLOT);
+#endif
+}
+void CREndPaletteMode() {
+#if !TERMINAL
+    if (cr_config->palette_count == 0 || cr_config->headless)
+        return;
+    EndShaderMode();
+#endif
+}
+
 // Entities
 CREntity CRNewEntity(CRTile tile, Vector2 position) {
     CREntity entity;
     entity.tile = tile;
     entity.position = position;
+    entity.previous_position = position;
+    entity.visual_position = position;
+    entity.tween = -1;
     entity.next = 0;
     entity.prev = 0;
     return entity;
 }
+// Moving or retiling an entity through these asks for a redraw, writing its fields directly doesn't
+void CRMoveEntity(CREntity *entity, Vector2 position) {
+    entity->position = position;
+    cr_config->redraw = 1;
+}
+void CRSetEntityTile(CREntity *entity, CRTile tile) {
+    entity->tile = tile;
+    cr_config->redraw = 1;
+}
 void CRAddEntity(CREntity *entity) {
     if (cr_config->world_layer_count == 0)
         return;// TODO layer doesn't exist to write to
     CRAddEntityToLayer(0, entity);
 }
+// The layer whose list holds the entity, or 0. Found from the head of its list, since entities
+// don't keep a pointer back to their layer.
+CRLayer *CREntityLayer(CREntity *entity) {
+    CREntity *head = entity;
+    while (head->prev != 0)
+        head = head->prev;
+    for (size_t i = 0; i < cr_config->world_layer_count; i++) {
+        if (cr_config->world_layers[i].entities.head == head)
+            return &cr_config->world_layers[i];
+    }
+    for (size_t i = 0; i < cr_config->ui_layer_count; i++) {
+        if (cr_config->ui_layers[i].entities.head == head)
+            return &cr_config->ui_layers[i];
+    }
+    return 0;
+}
 void CRAddEntityToLayer(CRLayer *layer, CREntity *entity) {
     if (layer == 0) {
         if (cr_config->world_layer_count == 0)
             return;
         layer = &cr_config->world_layers[0];
     }
+    if (layer->entities.tail == entity)
+        return; // already last on this layer
     // Remove entity from its current position
-    CREntity *next = entity->next;
-    CREntity *prev = entity->prev;
-    if (next != 0) {
-        next->prev = prev;
-        next = 0;
-    }
-    if (prev != 0) {
-        prev->next = next;
-        prev = 0;
-    }
-    // No entities in the layer
-    if (layer->entities.head == 0) {
-        layer->entities.head = entity;
-        layer->entities.tail = entity;
-    } else if (layer->entities.tail == entity) {
-        return;
-    }  else { // entity exists on layer
+    CRLayer *current = CREntityLayer(entity);
+    if (current != 0) {
+        // a tween doesn't follow the entity onto another layer
+        if (current != layer)
+            CRCancelTween(entity);
+        UnlinkEntity(&current->entities, entity);
+    }
+    entity->prev = layer->entities.tail;
+    entity->next = 0;
+    if (layer->entities.tail != 0)
         layer->entities.tail->next = entity;
-        layer->entities.tail = entity;
+    else
+        layer->entities.head = entity;
+    layer->entities.tail = entity;
+    cr_config->redraw = 1;
+}
+// Take the entity off the layer and drop its tween, after which it can be freed
+void CRRemoveEntity(CRLayer *layer, CREntity *entity) {
+    if (layer == 0) {
+        if (cr_config->world_layer_count == 0)
+            return;
+        layer = &cr_config->world_layers[0];
     }
+    if (CREntityLayer(entity) != layer)
+        return; // TODO entity isn't on this layer error
+    CRCancelTween(entity);
+    UnlinkEntity(&layer->entities, entity);
+    cr_config->redraw = 1;
 }
 
-// Tiles
-CRTile CRDefaultTileConfig(int index) {
-    CRTile tile;
-    tile.index.i = index;
-    tile.shift = (Vector2) {0, 0};
-    tile.foreground = cr_config->default_foreground;
-    tile.background = cr_config->default_background;
-    tile.visibility = cr_config->default_visibility;
-    return tile;
+// Tweens
+// Tweens slide an entity's drawn position to its new cell over time while its logical position,
+// which masks and occupancy use, moves at once. They're kept as parallel arrays so every tween
+// advances in the same few tight loops, and finished ones are dropped in a single compaction pass.
+void CRGrowTweens(CRTweens *tweens) {
+    if (tweens->count < tweens->capacity)
+        return;
+    size_t capacity = tweens->capacity < 16 ? 16 : tweens->capacity * 2;
+    tweens->entities = CRRealloc(tweens->entities, sizeof(CREntity *) * capacity, MEMORYANIMATION);
+    tweens->from_x = CRRealloc(tweens->from_x, sizeof(float) * capacity, MEMORYANIMATION);
+    tweens->from_y = CRRealloc(tweens->from_y, sizeof(float) * capacity, MEMORYANIMATION);
+    tweens->to_x = CRRealloc(tweens->to_x, sizeof(float) * capacity, MEMORYANIMATION);
+    tweens->to_y = CRRealloc(tweens->to_y, sizeof(float) * capacity, MEMORYANIMATION);
+    tweens->elapsed = CRRealloc(tweens->elapsed, sizeof(float) * capacity, MEMORYANIMATION);
+    tweens->duration = CRRealloc(tweens->duration, sizeof(float) * capacity, MEMORYANIMATION);
+    tweens->progress = CRRealloc(tweens->progress, sizeof(float) * capacity, MEMORYANIMATION);
+    tweens->easing = CRRealloc(tweens->easing, sizeof(uint8_t) * capacity, MEMORYANIMATION);
+    tweens->capacity = capacity;
 }
-CRTile CRCTile(char *string) {
-    CRTile tile = CRDefaultTileConfig(0);
-    for (int i = 0; i <= 4; i++) {
-        if (string[i] == 0)
-            break;
-        tile.index.c[i] = string[i];
+void CRTweenEntity(CREntity *entity, Vector2 to, float duration, uint8_t easing) {
+    CRTweens *tweens = &cr_config->tweens;
+    Vector2 from = CREntityDrawPosition(entity);
+    entity->position = to;
+    entity->previous_position = to;
+    cr_config->redraw = 1;
+    if (duration <= 0.0f) {
+        CRCancelTween(entity);
+        return;
     }
-    return tile;
+    if (tweens->count == 0)
+        tweens->last_time = CRGetTime();
+    size_t index = entity->tween;
+    if (entity->tween < 0) {
+        CRGrowTweens(tweens);
+        index = tweens->count;
+        tweens->count++;
+        entity->tween = index;
+    }
+    tweens->entities[index] = entity;
+    tweens->from_x[index] = from.x;
+    tweens->from_y[index] = from.y;
+    tweens->to_x[index] = to.x;
+    tweens->to_y[index] = to.y;
+    tweens->elapsed[index] = 0.0f;
+    tweens->duration[index] = duration;
+    tweens->easing[index] = easing;
+    entity->visual_position = from;
 }
-CRTile CRITile(int index) {
-    CRTile tile = CRDefaultTileConfig(index);
-    return tile;
+void CRCancelTween(CREntity *entity) {
+    if (entity->tween < 0)
+        return;
+    // dropped now rather than in the finished pass, so the tweens never point at a removed entity
+    CRTweens *tweens = &cr_config->tweens;
+    size_t index = entity->tween;
+    size_t last = tweens->count - 1;
+    if (index != last) {
+        tweens->entities[index] = tweens->entities[last];
+        tweens->from_x[index] = tweens->from_x[last];
+        tweens->from_y[index] = tweens->from_y[last];
+        tweens->to_x[index] = tweens->to_x[last];
+        tweens->to_y[index] = tweens->to_y[last];
+        tweens->elapsed[index] = tweens->elapsed[last];
+        tweens->duration[index] = tweens->duration[last];
+        tweens->easing[index] = tweens->easing[last];
+        tweens->entities[index]->tween = index;
+    }
+    tweens->count--;
+    entity->tween = -1;
+    entity->visual_position = entity->position;
+    cr_config->redraw = 1;
 }
-void CRSetGridTile(CRTile *grid, CRTile tile, Vector2 position, int width, int height) {
-    int x = position.x;
-    int y = position.y;
-    if (x > width || y > height)
-        return; // TODO return out of bounds error
-    grid[x + y * width] = tile;
+float CREase(uint8_t easing, float t) {
+    switch (easing) {
+        case EASEIN:
+            return t * t;
+        case EASEOUT:
+            return t * (2.0f - t);
+        case EASEINOUT:
+            return t < 0.5f ? 2.0f * t * t : -1.0f + (4.0f - 2.0f * t) * t;
+        default:
+            return t;
+    }
 }
-void CRSetLayerTile(CRLayer *layer, CRTile tile, Vector2 position) {
-    int width = layer->width;
-    int height = layer->height;
-    CRSetGridTile(layer->grid, tile, position, width, height);
+void CRUpdateTweens(float delta) {
+    CRTweens *tweens = &cr_config->tweens;
+    size_t count = tweens->count;
+    float *restrict elapsed = tweens->elapsed;
+    float *restrict duration = tweens->duration;
+    float *restrict progress = tweens->progress;
+    for (size_t i = 0; i < count; i++) {
+        elapsed[i] += delta;
+        float t = elapsed[i] / duration[i];
+        progress[i] = t < 1.0f ? t : 1.0f;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (tweens->easing[i] != EASELINEAR)
+            progress[i] = CREase(tweens->easing[i], progress[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        CREntity *entity = tweens->entities[i];
+        entity->visual_position.x = tweens->from_x[i] + (tweens->to_x[i] - tweens->from_x[i]) * progress[i];
+        entity->visual_position.y = tweens->from_y[i] + (tweens->to_y[i] - tweens->from_y[i]) * progress[i];
+    }
+    // drop the finished tweens, sliding the rest down over them
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        CREntity *entity = tweens->entities[i];
+        if (elapsed[i] >= duration[i]) {
+            entity->tween = -1;
+            continue;
+        }
+        if (kept != i) {
+            tweens->entities[kept] = entity;
+            tweens->from_x[kept] = tweens->from_x[i];
+            tweens->from_y[kept] = tweens->from_y[i];
+            tweens->to_x[kept] = tweens->to_x[i];
+            tweens->to_y[kept] = tweens->to_y[i];
+            elapsed[kept] = elapsed[i];
+            duration[kept] = duration[i];
+            tweens->easing[kept] = tweens->easing[i];
+            entity->tween = kept;
+        }
+        kept++;
+    }
+    tweens->count = kept;
+    // tweens that just finished still need their last position drawn
+    if (count > 0)
+        cr_config->redraw = 1;
 }
-void CRSetLayerTileChar(CRLayer *layer, char *string, Vector2 position) {
-    CRTile tile = CRCTile(string);
-    CRSetLayerTile(layer, tile, position);
+void CRRunTweens() {
+    double now = CRGetTime();
+    CRUpdateTweens(now - cr_config->tweens.last_time);
+    cr_config->tweens.last_time = now;
 }
-void CRSetLayerTileIndex(CRLayer *layer, int index, Vector2 position) {
+void CRUnloadTweens() {
+    CRTweens *tweens = &cr_config->tweens;
+    CRFree(tweens->entities);
+    CRFree(tweens->from_x);
+    CRFree(tweens->from_y);
+    CRFree(tweens->to_x);
+    CRFree(tweens->to_y);
+    CRFree(tweens->elapsed);
+    CRFree(tweens->duration);
+    CRFree(tweens->progress);
+    CRFree(tweens->easing);
+    *tweens = (CRTweens) {0};
+}
+
+// Animated Tiles
+// An animated tile's index is ANIMATEDTILE with the animation's number in the low bits. The frame
+// every animation is showing is worked out once per frame, so animated cells cost nothing until
+// drawn, and layers cached on the GPU never need re-uploading: the shader looks the frame up in a
+// small table texture with one column per animation.
+size_t CRNewTileAnimation(CRTileIndex *frames, float *durations, size_t frame_count) {
+    size_t index = cr_config->tile_animation_count;
+    cr_config->tile_animations = CRGrow(cr_config->tile_animations, &cr_config->tile_animation_capacity,
+            index, sizeof(CRTileAnimation), MEMORYANIMATION);
+    cr_config->tile_animation_count++;
+    CRTileAnimation *animation = &cr_config->tile_animations[index];
+    animation->frames = CRAlloc(sizeof(CRTileIndex) * frame_count, MEMORYANIMATION);
+    animation->durations = CRAlloc(sizeof(float) * frame_count, MEMORYANIMATION);
+    animation->frame_count = frame_count;
+    animation->length = 0.0f;
+    animation->current = 0;
+    for (size_t i = 0; i < frame_count; i++) {
+        animation->frames[i] = frames[i];
+        animation->durations[i] = durations[i];
+        animation->length += durations[i];
+    }
+    // the table needs a column for it
+    cr_config->tile_animation_table_stale = 1;
+    return index;
+}
+CRTile CRAnimatedTile(size_t animation) {
+    CRTile tile = CRDefaultTileConfig(ANIMATEDTILE | (int32_t) animation);
+    return tile;
+}
+int CRIsAnimatedTile(CRTileIndex index) {
+    return ((uint32_t) index.i & 0xFF000000) == ANIMATEDTILE;
+}
+CRTileIndex CRTileAnimationFrame(CRTileIndex index) {
+    size_t animation = index.i & 0xFFFF;
+    if (animation >= cr_config->tile_animation_count) {
+        CRTileIndex empty = {0};
+        return empty;
+    }
+    CRTileAnimation *anim = &cr_config->tile_animations[animation];
+    return anim->frames[anim->current];
+}
+void CRUploadTileAnimations() {
+#if !TERMINAL
+    size_t count = cr_config->tile_animation_count;
+    if (cr_config->tile_animation_table_stale) {
+        if (cr_config->tile_animation_texture.id != 0) {
+            CRUntrackTexture(MEMORYANIMATION, cr_config->tile_animation_texture);
+            UnloadTexture(cr_config->tile_animation_texture);
+        }
+        // row 0 is the frame as a tilemap index, row 1 the frame's character mapped to one
+        Image image = GenImageColor(count, 2, BLANK);
+        cr_config->tile_animation_texture = LoadTextureFromImage(image);
+        CRTrackTexture(MEMORYANIMATION, cr_config->tile_animation_texture);
+        UnloadImage(image);
+        SetTextureFilter(cr_config->tile_animation_texture, TEXTURE_FILTER_POINT);
+        cr_config->tile_animation_table_stale = 0;
+    }
+    Color *table = CRFrameAlloc(sizeof(Color) * count * 2);
+    for (size_t i = 0; i < count; i++) {
+        CRTileAnimation *animation = &cr_config->tile_animations[i];
+        CRTileIndex frame = animation->frames[animation->current];
+        int index = frame.i;
+        int char_index = index != 0 ? CRCharToIndex(frame.c) : 0;
+        table[i] = (Color) {index & 0xFF, (index >> 8) & 0xFF, 0, 255};
+        table[i + count] = (Color) {char_index & 0xFF, (char_index >> 8) & 0xFF, 0, 255};
+    }
+    UpdateTexture(cr_config->tile_animation_texture, table);
+#endif
+}
+void CRUpdateTileAnimations(double time) {
+    int changed = cr_config->tile_animation_table_stale;
+    for (size_t i = 0; i < cr_config->tile_animation_count; i++) {
+        CRTileAnimation *animation = &cr_config->tile_animations[i];
+        if (animation->frame_count < 2 || animation->length <= 0.0f)
+            continue;
+        float t = fmod(time, animation->length);
+        size_t frame = 0;
+        while (frame < animation->frame_count - 1 && t >= animation->durations[frame]) {
+            t -= animation->durations[frame];
+            frame++;
+        }
+        if (frame == animation->current)
+            continue;
+        animation->current = frame;
+        changed = 1;
+    }
+    if (!changed)
+        return;
+    cr_config->redraw = 1;
+    if (!cr_config->headless)
+        CRUploadTileAnimations();
+}
+void CRUnloadTileAnimations() {
+    for (size_t i = 0; i < cr_config->tile_animation_count; i++) {
+        CRFree(cr_config->tile_animations[i].frames);
+        CRFree(cr_config->tile_animations[i].durations);
+    }
+    CRFree(cr_config->tile_animations);
+#if !TERMINAL
+    if (cr_config->tile_animation_texture.id != 0) {
+        CRUntrackTexture(MEMORYANIMATION, cr_config->tile_animation_texture);
+        UnloadTexture(cr_config->tile_animation_texture);
+    }
+#endif
+}
+
+// Command Queue
+// Other threads can't touch CRGA state directly, so they queue changes here and CRLoop applies them
+// in order before drawing. The queue is a bounded ring where producers claim a slot by bumping the
+// tail, and each slot's sequence number says whether it's free, being written, or ready to read.
+// Producers name the context they're feeding rather than setting it as their own, since nothing
+// else in CRGA is safe to call on a context another thread is drawing.
+// Region tiles come straight from the context's allocator, which has to be safe to call from any
+// thread. They aren't counted in its memory stats, which only the drawing thread may touch.
+CRTile *CRAllocRegionTiles(CRConfig *config, size_t count) {
+    CRAllocator *allocator = &config->allocator;
+    return allocator->allocate(allocator->user, sizeof(CRTile) * count);
+}
+void CRFreeRegionTiles(CRConfig *config, CRTile *tiles) {
+    if (tiles != 0)
+        config->allocator.deallocate(config->allocator.user, tiles);
+}
+int CRNewCommandQueue(size_t capacity) {
+    CRCommandQueue *queue = &cr_config->commands;
+    if (queue->slots != 0)
+        return 0; // TODO queue already exists error
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+    queue->slots = CRAlloc(sizeof(CRCommandSlot) * size, MEMORYOTHER);
+    if (queue->slots == 0)
+        return 0;
+    for (size_t i = 0; i < size; i++)
+        queue->slots[i].sequence = i;
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    return 1;
+}
+void CRUnloadCommandQueue() {
+    CRCommand command;
+    // region commands own their tiles
+    while (CRNextCommand(&command)) {
+        if (command.type == COMMANDREGION)
+            CRFreeRegionTiles(cr_config, command.region.tiles);
+    }
+    CRFree(cr_config->commands.slots);
+    cr_config->commands.slots = 0;
+}
+// Safe from any thread. Returns 0 if the queue is full or doesn't exist.
+int CRQueueCommand(CRConfig *config, CRCommand command) {
+    CRCommandQueue *queue = &config->commands;
+    if (queue->slots == 0)
+        return 0;
+    CRCommandSlot *slot;
+#if THREADS
+    size_t position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &queue->slots[position & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&queue->tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            return 0; // full, the consumer hasn't freed this slot yet
+        } else {
+            position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->command = command;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+#else
+    size_t position = queue->tail;
+    slot = &queue->slots[position & queue->mask];
+    if (slot->sequence != position)
+        return 0;
+    queue->tail++;
+    slot->command = command;
+    slot->sequence = position + 1;
+#endif
+    return 1;
+}
+// Only the thread running CRLoop reads commands
+int CRNextCommand(CRCommand *command) {
+    CRCommandQueue *queue = &cr_config->commands;
+    if (queue->slots == 0)
+        return 0;
+    size_t position = queue->head;
+    CRCommandSlot *slot = &queue->slots[position & queue->mask];
+#if THREADS
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1)
+        return 0;
+#else
+    if (slot->sequence != position + 1)
+        return 0;
+#endif
+    *command = slot->command;
+    queue->head = position + 1;
+    // free the slot for the producer that wraps around to it
+#if THREADS
+    __atomic_store_n(&slot->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+#else
+    slot->sequence = position + queue->mask + 1;
+#endif
+    return 1;
+}
+CRLayer *CRCommandLayer(CRCommand *command) {
+    if (command->ui)
+        return command->layer < cr_config->ui_layer_count ? &cr_config->ui_layers[command->layer] : 0;
+    return command->layer < cr_config->world_layer_count ? &cr_config->world_layers[command->layer] : 0;
+}
+void CRApplyCommand(CRCommand *command) {
+    CRLayer *layer = CRCommandLayer(command);
+    switch (command->type) {
+        case COMMANDTILE:
+            if (layer != 0)
+                CRSetLayerTile(layer, command->tile, command->position);
+            break;
+        case COMMANDREGION:
+            if (layer != 0) {
+                for (int y = 0; y < command->region.height; y++) {
+                    for (int x = 0; x < command->region.width; x++) {
+                        Vector2 position = {command->position.x + x, command->position.y + y};
+                        CRSetLayerTile(layer, command->region.tiles[x + y * command->region.width], position);
+                    }
+                }
+            }
+            CRFreeRegionTiles(cr_config, command->region.tiles);
+            break;
+        case COMMANDMASK:
+            if (command->mask.index < cr_config->mask_count)
+                CRSetMaskValue(command->mask.index, command->position, command->mask.value);
+            break;
+        case COMMANDADDENTITY:
+            if (layer != 0)
+                CRAddEntityToLayer(layer, command->entity);
+            break;
+        case COMMANDMOVEENTITY:
+            CRMoveEntity(command->entity, command->position);
+            break;
+    }
+}
+void CRApplyCommands() {
+    // only what was queued before now, so busy producers can't hold up the frame
+#if THREADS
+    size_t end = __atomic_load_n(&cr_config->commands.tail, __ATOMIC_ACQUIRE);
+#else
+    size_t end = cr_config->commands.tail;
+#endif
+    CRCommand command;
+    while (cr_config->commands.head != end && CRNextCommand(&command))
+        CRApplyCommand(&command);
+}
+int CRQueueLayerTile(CRConfig *config, uint8_t ui, size_t layer, CRTile tile, Vector2 position) {
+    CRCommand command;
+    command.type = COMMANDTILE;
+    command.ui = ui;
+    command.layer = layer;
+    command.position = position;
+    command.tile = tile;
+    return CRQueueCommand(config, command);
+}
+// The tiles are copied, width * height of them row by row
+int CRQueueLayerRegion(CRConfig *config, uint8_t ui, size_t layer, Vector2 top_left, int width, int height, const CRTile *tiles) {
+    CRCommand command;
+    command.type = COMMANDREGION;
+    command.ui = ui;
+    command.layer = layer;
+    command.position = top_left;
+    command.region.tiles = CRAllocRegionTiles(config, width * height);
+    if (command.region.tiles == 0)
+        return 0;
+    memcpy(command.region.tiles, tiles, sizeof(CRTile) * width * height);
+    command.region.width = width;
+    command.region.height = height;
+    if (CRQueueCommand(config, command))
+        return 1;
+    CRFreeRegionTiles(config, command.region.tiles);
+    return 0;
+}
+int CRQueueMaskValue(CRConfig *config, size_t mask, Vector2 position, uint8_t value) {
+    CRCommand command;
+    command.type = COMMANDMASK;
+    command.ui = 0;
+    command.layer = 0;
+    command.position = position;
+    command.mask.index = mask;
+    command.mask.value = value;
+    return CRQueueCommand(config, command);
+}
+int CRQueueAddEntity(CRConfig *config, uint8_t ui, size_t layer, CREntity *entity) {
+    CRCommand command;
+    command.type = COMMANDADDENTITY;
+    command.ui = ui;
+    command.layer = layer;
+    command.entity = entity;
+    return CRQueueCommand(config, command);
+}
+int CRQueueMoveEntity(CRConfig *config, CREntity *entity, Vector2 position) {
+    CRCommand command;
+    command.type = COMMANDMOVEENTITY;
+    command.ui = 0;
+    command.layer = 0;
+    command.position = position;
+    command.entity = entity;
+    return CRQueueCommand(config, command);
+}
+
+// Tiles
+CRTile CRDefaultTileConfig(int index) {
+    CRTile tile;
+    tile.index.i = index;
+    tile.shift = (Vector2) {0, 0};
+    tile.foreground = cr_config->default_foreground;
+    tile.background = cr_config->default_background;
+    tile.visibility = cr_config->default_visibility;
+    return tile;
+}
+CRTile CRCTile(char *string) {
+    CRTile tile = CRDefaultTileConfig(0);
+    for (int i = 0; i <= 4; i++) {
+        if (string[i] == 0)
+            break;
+        tile.index.c[i] = string[i];
+    }
+    return tile;
+}
+CRTile CRITile(int index) {
+    CRTile tile = CRDefaultTileConfig(index);
+    return tile;
+}
+void CRSetGridTile(CRTile *grid, CRTile tile, Vector2 position, int width, int height) {
+    int x = position.x;
+    int y = position.y;
+    if (x > width || y > height)
+        return; // TODO return out of bounds error
+    grid[x + y * width] = tile;
+}
+void CRSetLayerTile(CRLayer *layer, CRTile tile, Vector2 position) {
+    int width = layer->width;
+    int height = layer->height;
+    int x = position.x;
+    int y = position.y;
+    if (x < 0 || y < 0 || x >= width || y >= height)
+        return; // TODO return out of bounds error
+    int grid_row = LayerRow(layer, y);
+    // setting a tile to what it already is changes nothing on screen
+    if (SameTile(&layer->grid[x + grid_row * width], &tile))
+        return;
+    CRSetGridTile(layer->grid, tile, (Vector2) {x, grid_row}, width, height);
+    uint64_t *word = &layer->occupancy[grid_row * layer->occupancy_words + x / 64];
+    uint64_t bit = (uint64_t) 1 << (x % 64);
+    if (tile.index.i != 0)
+        *word |= bit;
+    else
+        *word &= ~bit;
+    CRMarkLayerDirty(layer, y, y);
+}
+void CRClearGridRow(CRLayer *layer, int grid_row) {
+    // only the occupied tiles need clearing
+    CRTile zero = {0};
+    uint64_t *words = &layer->occupancy[grid_row * layer->occupancy_words];
+    for (int w = 0; w < layer->occupancy_words; w++) {
+        uint64_t bits = words[w];
+        while (bits) {
+            int col = w * 64 + CountTrailingZeros(bits);
+            layer->grid[col + grid_row * layer->width] = zero;
+            bits &= bits - 1;
+        }
+        words[w] = 0;
+    }
+}
+void CRClearLayer(CRLayer *layer) {
+    for (int row = 0; row < layer->height; row++)
+        CRClearGridRow(layer, row);
+    CRMarkLayerDirty(layer, 0, layer->height - 1);
+}
+// Move the layer's tiles up by lines, or down when it's negative. The rows that scroll off one edge
+// come back in on the other cleared, so only they are touched and the rest stay where they are.
+void CRScrollLayer(CRLayer *layer, int lines) {
+    int height = layer->height;
+    if (lines == 0)
+        return;
+    if (lines >= height || lines <= -height) {
+        CRClearLayer(layer);
+        return;
+    }
+    int top = lines > 0 ? 0 : height + lines;
+    int count = lines > 0 ? lines : -lines;
+    for (int row = top; row < top + count; row++)
+        CRClearGridRow(layer, LayerRow(layer, row));
+    layer->scroll_row = (layer->scroll_row + lines + height) % height;
+    // Only the cleared rows, now on the other edge, hold anything new. The data texture is stored
+    // by grid row and the shader applies the scroll, but the mask values packed into it are by layer
+    // row, and occlusion is by screen row, so those see every row move.
+    int cleared = lines > 0 ? height - count : 0;
+    if (layer->mask_count > 0)
+        CRMarkLayerDirty(layer, 0, height - 1);
+    else
+        CRMarkLayerDirty(layer, cleared, cleared + count - 1);
+    if (CRIsWorldLayer(layer))
+        CRMarkOcclusionDirty(0, height - 1);
+}
+void CRSetLayerTileChar(CRLayer *layer, char *string, Vector2 position) {
+    CRTile tile = CRCTile(string);
+    CRSetLayerTile(layer, tile, position);
+}
+void CRSetLayerTileIndex(CRLayer *layer, int index, Vector2 position) {
     CRTile tile = CRITile(index);
     CRSetLayerTile(layer, tile, position);
 }
@@ -629,11 +3302,14 @@ void CRSetWorldLayerTile(int index, CRTile tile, Vector2 position) {
 void CRSetUILayerTile(int index, CRTile tile, Vector2 position) {
     if (cr_config->ui_layer_count < index)
         return; // TODO return out of bounds error
-    CRSetLayerTile(cr_config->world_layers + index, tile, position);
+    CRSetLayerTile(cr_config->ui_layers + index, tile, position);
 }
 
 // Draw Tiles
 int CRCharToIndex(char *character) {
+    CRBundleAssoc *entry = CRFindBundleAssoc(character);
+    if (entry != 0)
+        return entry->index;
     // Convert string to index
     int assoc_index = character[0];
     // use index to access value in array
@@ -664,16 +3340,169 @@ int PreDrawTile(CRTileIndex index, uint8_t mask, Color *foreground_color, Color
     transparency *= mask_multiplier;
     foreground_color->a = transparency;
 
-    if (foreground_color->a == 0 && foreground_color->a == 0)
+    if (foreground_color->a == 0 && background_color->a == 0)
         return 1;
 
-    for (int i = 0; i <= 4; i++)
+    for (int i = 0; i < 4; i++)
         string_out[i] = index.c[i];
+    string_out[4] = '\0';
 
     return 0;
 }
+// Draw kernels
+// Every way of drawing a tile gets its own copy of the per-tile body, generated by DRAWKERNEL with
+// the mode folded in as constants, so nothing about the layer is checked once per tile. The
+// foreground functions draw whatever sits on top of the tile's background.
+#define DRAWBACKGROUND 0b1
+#define DRAWOUTLINE 0b10
+#define DRAWMASKED 0b100
+#define DRAWVARIANTS 8
+#define DRAWDEFAULT (DRAWMASKED | DRAWBACKGROUND | (GRID_OUTLINE ? DRAWOUTLINE : 0))
+#define DRAWKERNEL(name, draw_foreground, masked, outlined, backed) \
+    void name(void *source, CRTile *tile, float tile_size, Vector2 position, uint8_t mask) { \
+        CRTile frame; \
+        if (CRIsAnimatedTile(tile->index)) { \
+            frame = *tile; \
+            frame.index = CRTileAnimationFrame(tile->index); \
+            tile = &frame; \
+        } \
+        if (tile->index.i == 0) \
+            return; \
+        Color tile_color = tile->background; \
+        Color text_color = tile->foreground; \
+        if (masked) { \
+            float mask_multiplier = (float) mask/255.0f; \
+            tile_color.a = tile_color.a * mask_multiplier; \
+            text_color.a = text_color.a * mask_multiplier; \
+        } \
+        if (text_color.a == 0 && tile_color.a == 0) \
+            return; \
+        if (backed) \
+            DrawRectangle(position.x, position.y, tile_size, tile_size, tile_color); \
+        if (outlined) \
+            DrawRectangleLines(position.x, position.y, tile_size, tile_size, RED); \
+        draw_foreground(source, tile, tile_size, position, text_color); \
+    }
+// one kernel for each combination of DRAWMASKED, DRAWOUTLINE and DRAWBACKGROUND, indexed by them
+#define DRAWKERNELS(name, draw_foreground) \
+    DRAWKERNEL(name##0, draw_foreground, 0, 0, 0) \
+    DRAWKERNEL(name##1, draw_foreground, 0, 0, 1) \
+    DRAWKERNEL(name##2, draw_foreground, 0, 1, 0) \
+    DRAWKERNEL(name##3, draw_foreground, 0, 1, 1) \
+    DRAWKERNEL(name##4, draw_foreground, 1, 0, 0) \
+    DRAWKERNEL(name##5, draw_foreground, 1, 0, 1) \
+    DRAWKERNEL(name##6, draw_foreground, 1, 1, 0) \
+    DRAWKERNEL(name##7, draw_foreground, 1, 1, 1) \
+    CRDrawTileKernel name[DRAWVARIANTS] = {name##0, name##1, name##2, name##3, \
+        name##4, name##5, name##6, name##7};
+
+static inline void CRTileString(CRTile *tile, char string_out[5]) {
+    for (int i = 0; i < 4; i++)
+        string_out[i] = tile->index.c[i];
+    string_out[4] = '\0';
+}
+static inline void CRDrawFontForeground(void *source, CRTile *tile, float tile_size, Vector2 position, Color color) {
+    Font *font = source;
+    char string_out[5];
+    CRTileString(tile, string_out);
+    position = CenterTextEx(position, *font, tile_size, cr_config->font_size, string_out);
+    position = ShiftPosition(position, tile->shift);
+    DrawTextEx(*font, string_out, position, cr_config->font_size, 0, color);
+}
+static inline void CRDrawDefaultFontForeground(void *source, CRTile *tile, float tile_size, Vector2 position, Color color) {
+    char string_out[5];
+    CRTileString(tile, string_out);
+    position = CenterText(position, tile_size, cr_config->font_size, string_out);
+    position = ShiftPosition(position, tile->shift);
+    DrawText(string_out, position.x, position.y, cr_config->font_size, color);
+}
+static inline void CRDrawGlyphForeground(void *source, CRTile *tile, float tile_size, Vector2 position, Color color) {
+    CRGlyphAtlas *atlas = source;
+    char string_out[5];
+    CRTileString(tile, string_out);
+    int bytes = 0;
+    CRGlyphSlot *glyph = CRGetGlyph(atlas, GetCodepoint(string_out, &bytes));
+    if (glyph == 0)
+        return;
+    // centered in the tile the same way CenterTextEx centers a font's text
+    float scale = cr_config->font_size / atlas->size;
+    position = ShiftPosition(position, tile->shift);
+    Rectangle dest;
+    dest.x = position.x + tile_size/2.0f - glyph->advance_x*scale/2.0f + glyph->offset_x*scale;
+    dest.y = position.y + tile_size/2.0f - cr_config->font_size/2.0f + glyph->offset_y*scale;
+    dest.width = glyph->rec.width * scale;
+    dest.height = glyph->rec.height * scale;
+    DrawTexturePro(atlas->pages[glyph->page], glyph->rec, dest, (Vector2) {0, 0}, 0.0f, color);
+}
+static inline void CRDrawTilemapTile(CRTilemap *tilemap, int index, CRTile *tile, float tile_size, Vector2 position, Color color) {
+    position = ShiftPosition(position, tile->shift);
+    Rectangle rect = TileIndexRec(tilemap, index);
+    Rectangle dest;
+    dest.x = position.x;
+    dest.y = position.y;
+    dest.width = tile_size;
+    dest.height = tile_size;
+    Vector2 origin = {0.0,0.0};
+    DrawTexturePro(tilemap->texture, rect, dest, origin, 0.0f, color);
+}
+static inline void CRDrawTilemapForeground(void *source, CRTile *tile, float tile_size, Vector2 position, Color color) {
+    CRDrawTilemapTile(source, tile->index.i, tile, tile_size, position, color);
+}
+static inline void CRDrawMappedTilemapForeground(void *source, CRTile *tile, float tile_size, Vector2 position, Color color) {
+    CRDrawTilemapTile(source, CRCharToIndex(tile->index.c), tile, tile_size, position, color);
+}
+static inline void CRDrawNoForeground(void *source, CRTile *tile, float tile_size, Vector2 position, Color color) {
+    // TODO handle the problem of no tilemap
+}
+DRAWKERNELS(cr_font_kernels, CRDrawFontForeground)
+DRAWKERNELS(cr_default_font_kernels, CRDrawDefaultFontForeground)
+DRAWKERNELS(cr_glyph_kernels, CRDrawGlyphForeground)
+DRAWKERNELS(cr_tilemap_kernels, CRDrawTilemapForeground)
+DRAWKERNELS(cr_mapped_tilemap_kernels, CRDrawMappedTilemapForeground)
+DRAWKERNELS(cr_background_kernels, CRDrawNoForeground)
+void CRSkipTile(void *source, CRTile *tile, float tile_size, Vector2 position, uint8_t mask) {
+}
+
+void CRSelectDrawKernel(CRLayer *layer) {
+    int variant = 0;
+    if (layer->mask_count > 0)
+        variant |= DRAWMASKED;
+    if ((layer->flags & 0b100000) || GRID_OUTLINE)
+        variant |= DRAWOUTLINE;
+    if ((layer->flags & 0b1000000) == 0)
+        variant |= DRAWBACKGROUND;
+    if ((layer->flags & 0b10001) == 0b10000) {
+        layer->draw_tile = cr_glyph_kernels[variant];
+        layer->draw_missing = CRSkipTile;
+    } else if ((layer->flags & 0b1) == 0) {
+        layer->draw_tile = cr_font_kernels[variant];
+        layer->draw_missing = cr_default_font_kernels[variant];
+    } else if (layer->flags & 0b10) {
+        layer->draw_tile = cr_mapped_tilemap_kernels[variant];
+        layer->draw_missing = cr_background_kernels[variant];
+    } else {
+        layer->draw_tile = cr_tilemap_kernels[variant];
+        layer->draw_missing = cr_background_kernels[variant];
+    }
+}
+// The font, glyph atlas or tilemap the layer's kernel draws from, or 0 if it isn't loaded
+void *CRLayerDrawSource(CRLayer *layer) {
+    size_t index = layer->tile_index;
+    if ((layer->flags & 0b10001) == 0b10000)
+        return cr_config->glyph_atlas_count > index ? &cr_config->glyph_atlases[index] : 0;
+    if ((layer->flags & 0b1) == 0)
+        return cr_config->font_count > index ? &cr_config->fonts[index] : 0;
+    return cr_config->tilemap_count > index ? &cr_config->tilemaps[index] : 0;
+}
+
 void CRDrawTile(CRTile *tile, uint8_t tilemap_flags, size_t index, float tile_size, Vector2 position, uint8_t mask) {
 #if TERMINAL
+    CRTile frame;
+    if (CRIsAnimatedTile(tile->index)) {
+        frame = *tile;
+        frame.index = CRTileAnimationFrame(tile->index);
+        tile = &frame;
+    }
     Color tile_color = tile->background;
     Color text_color = tile->foreground;
     char string_out[5];
@@ -682,7 +3511,10 @@ void CRDrawTile(CRTile *tile, uint8_t tilemap_flags, size_t index, float tile_si
     
     CRTermDrawTile(tile, position, mask);
 #else
-    if ((tilemap_flags & 0b1) == 0) {
+    if ((tilemap_flags & 0b10001) == 0b10000) {
+        if (cr_config->glyph_atlas_count > index)
+            CRDrawTileGlyph(tile, &cr_config->glyph_atlases[index], tile_size, position, mask);
+    } else if ((tilemap_flags & 0b1) == 0) {
         if (cr_config->font_count > index){
             CRDrawTileChar(tile, &cr_config->fonts[index], tile_size, position, mask);
         } else {
@@ -699,87 +3531,821 @@ void CRDrawTile(CRTile *tile, uint8_t tilemap_flags, size_t index, float tile_si
 #endif
 }
 void CRDrawTileChar(CRTile *tile, Font *font, float tile_size, Vector2 position, uint8_t mask) {
-    Color tile_color = tile->background;
-    Color text_color = tile->foreground;
-    char string_out[5];
-    if (PreDrawTile(tile->index, mask, &text_color, &tile_color, string_out))
-        return;
+    CRDrawTileKernel *kernels = font != 0 ? cr_font_kernels : cr_default_font_kernels;
+    kernels[DRAWDEFAULT](font, tile, tile_size, position, mask);
+}
+void CRDrawTileImage(CRTile *tile, CRTilemap *tilemap, int char_index, float tile_size, Vector2 position, uint8_t mask) {
+    CRDrawTileKernel *kernels = char_index ? cr_mapped_tilemap_kernels : cr_tilemap_kernels;
+    if (tilemap == 0)
+        kernels = cr_background_kernels;
+    kernels[DRAWDEFAULT](tilemap, tile, tile_size, position, mask);
+}
+void CRDrawTileGlyph(CRTile *tile, CRGlyphAtlas *atlas, float tile_size, Vector2 position, uint8_t mask) {
+    cr_glyph_kernels[DRAWDEFAULT](atlas, tile, tile_size, position, mask);
+}
+// Shader layers draw as a single quad. The fragment shader finds the cell under the fragment, reads
+// its tile index, mask and colors from the layer's data texture, and samples the tilemap itself.
+const char *cr_layer_shader_code =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "uniform sampler2D tilemap;\n"
+    "uniform sampler2D animations;\n"
+    "uniform int charMapped;\n"
+    "uniform vec2 layerSize;\n"
+    "uniform vec2 tileSize;\n"
+    "uniform vec2 tilemapSize;\n"
+    "uniform vec4 tint;\n"
+    "uniform int scrollRow;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    vec2 grid = fragTexCoord*vec2(layerSize.x, layerSize.y*3.0);\n"
+    "    ivec2 cell = ivec2(floor(grid));\n"
+    "    vec2 local = fract(grid);\n"
+    // rows are stored where they sit in the layer's grid, which scrolling turns into a ring
+    "    cell.y = (cell.y + scrollRow) % int(layerSize.y);\n"
+    "    vec4 data = texelFetch(texture0, cell, 0);\n"
+    "    if (data.a == 0.0) discard;\n"
+    "    vec4 foreground = texelFetch(texture0, cell + ivec2(0, int(layerSize.y)), 0);\n"
+    "    vec4 background = texelFetch(texture0, cell + ivec2(0, 2*int(layerSize.y)), 0);\n"
+    "    int index = int(data.r*255.0 + 0.5) + int(data.g*255.0 + 0.5)*256;\n"
+    // animated tiles are marked with an alpha of 254 and hold the animation instead of the tile
+    "    if (data.a < 0.999) {\n"
+    "        vec4 frame = texelFetch(animations, ivec2(index, charMapped), 0);\n"
+    "        index = int(frame.r*255.0 + 0.5) + int(frame.g*255.0 + 0.5)*256;\n"
+    "    }\n"
+    "    index -= 1;\n"
+    "    int columns = max(int(tilemapSize.x/tileSize.x), 1);\n"
+    "    vec2 origin = vec2(index % columns, index / columns)*tileSize;\n"
+    "    vec4 color = texture(tilemap, (origin + local*tileSize)/tilemapSize)*foreground;\n"
+    "    vec4 result = vec4(mix(background.rgb, color.rgb, color.a), background.a + color.a*(1.0 - background.a));\n"
+    "    finalColor = vec4(result.rgb, result.a*data.b)*tint;\n"
+    "}\n";
 
-    DrawRectangle(position.x, position.y, tile_size, tile_size, tile_color);
-#if GRID_OUTLINE
-    DrawRectangleLines(position.x, position.y, tile_size, tile_size, RED);
+// Pack a row of the layer into the data texture, at the row of the grid it's stored in
+void CRPackLayerRow(CRLayer *layer, int row) {
+    int width = layer->width;
+    int height = layer->height;
+    int stored = LayerRow(layer, row);
+    Color *index_row = &layer->data[stored * width];
+    Color *foreground_row = &layer->data[(stored + height) * width];
+    Color *background_row = &layer->data[(stored + 2 * height) * width];
+    CRTile *grid_row = &layer->grid[stored * width];
+    for (int col = 0; col < width; col++) {
+        CRTile *tile = &grid_row[col];
+        int index = tile->index.i;
+        uint8_t alpha = index == 0 ? 0 : 255;
+        if (CRIsAnimatedTile(tile->index)) {
+            index &= 0xFFFF;
+            alpha = 254;
+        } else if (index != 0 && (layer->flags & 0b10)) {
+            index = CRCharToIndex(tile->index.c);
+        }
+        uint8_t mask = CRMaskTile(layer, (Vector2){col, row}, 0b01);
+        index_row[col] = (Color) {index & 0xFF, (index >> 8) & 0xFF, mask, alpha};
+        foreground_row[col] = tile->foreground;
+        background_row[col] = tile->background;
+    }
+}
+void CRUploadLayerRows(CRLayer *layer, int top, int rows) {
+#if !TERMINAL
+    int width = layer->width;
+    int height = layer->height;
+    for (int part = 0; part < 3; part++) {
+        Rectangle rect = {0, top + part * height, width, rows};
+        UpdateTextureRec(layer->data_texture, rect, &layer->data[(top + part * height) * width]);
+    }
 #endif
-    Vector2 shift = tile->shift;
-    if (font != 0) {
-        position = CenterTextEx(position, *font, tile_size, string_out);
-        position = ShiftPosition(position, shift);
-        DrawTextEx(*font, string_out, position, 24, 0, text_color);
-    } else {
-        position = CenterText(position, tile_size, string_out);
-        position = ShiftPosition(position, shift);
-        DrawText(string_out, position.x, position.y, 24, text_color);
+}
+void CRUploadLayerData(CRLayer *layer) {
+#if !TERMINAL
+    int width = layer->width;
+    int height = layer->height;
+    if (layer->data == 0) {
+        layer->data = CRAlloc(sizeof(Color) * width * height * 3, MEMORYLAYERS);
+        Image image = GenImageColor(width, height * 3, BLANK);
+        layer->data_texture = LoadTextureFromImage(image);
+        CRTrackTexture(MEMORYLAYERS, layer->data_texture);
+        UnloadImage(image);
+        SetTextureFilter(layer->data_texture, TEXTURE_FILTER_POINT);
+        layer->dirty_top = 0;
+        layer->dirty_bottom = height - 1;
     }
+    if (layer->dirty_top < 0)
+        return;
+    int top = layer->dirty_top;
+    int rows = layer->dirty_bottom - top + 1;
+    for (int row = top; row <= layer->dirty_bottom; row++)
+        CRPackLayerRow(layer, row);
+    // the dirty rows are stored from LayerRow(top) on, wrapping past the last row to the first
+    int start = LayerRow(layer, top);
+    int first = height - start < rows ? height - start : rows;
+    CRUploadLayerRows(layer, start, first);
+    if (first < rows)
+        CRUploadLayerRows(layer, 0, rows - first);
+    layer->dirty_top = -1;
+    layer->dirty_bottom = -1;
+#endif
 }
-void CRDrawTileImage(CRTile *tile, CRTilemap *tilemap, int char_index, float tile_size, Vector2 position, uint8_t mask) {
-    Color tile_color = tile->background;
-    Color foreground_color = tile->foreground;
-    char string_out[5];
-    if (PreDrawTile(tile->index, mask, &foreground_color, &tile_color, string_out))
-        return;
-
-    DrawRectangle(position.x, position.y, tile_size, tile_size, tile->background);
-#if GRID_OUTLINE
-    DrawRectangleLines(position.x, position.y, tile_size, tile_size, RED);
-#endif
-    Vector2 shift = tile->shift;
-    int index = tile->index.i;
-    if (char_index) {
-        index = CRCharToIndex(tile->index.c);
-    }
-    if (tilemap != 0) {
-        position = ShiftPosition(position, shift);
-        Rectangle rect = TileIndexRec(tilemap, index);
-        Rectangle dest;
-        dest.x = position.x;
-        dest.y = position.y;
-        dest.width = tile_size;
-        dest.height = tile_size;
-        Vector2 origin = {0.0,0.0};
-        DrawTexturePro(tilemap->texture, rect, dest, origin, 0.0f, foreground_color);
-    } else {
-        // TODO handle the problem of no tilemap
+void CRDrawShaderLayer(CRLayer *layer) {
+#if !TERMINAL
+    CRTilemap *tilemap = &cr_config->tilemaps[layer->tile_index];
+    if (cr_config->layer_shader.id == 0)
+        cr_config->layer_shader = LoadShaderFromMemory(0, cr_layer_shader_code);
+    CRUploadLayerData(layer);
+
+    Shader shader = cr_config->layer_shader;
+    float layer_size[2] = {layer->width, layer->height};
+    float tile_size[2] = {tilemap->width, tilemap->height};
+    float tilemap_size[2] = {tilemap->texture.width, tilemap->texture.height};
+    Color tint_color = cr_config->palette_tint;
+    float tint[4] = {tint_color.r/255.0f, tint_color.g/255.0f, tint_color.b/255.0f, tint_color.a/255.0f};
+    SetShaderValue(shader, GetShaderLocation(shader, "layerSize"), layer_size, SHADER_UNIFORM_VEC2);
+    SetShaderValue(shader, GetShaderLocation(shader, "tileSize"), tile_size, SHADER_UNIFORM_VEC2);
+    SetShaderValue(shader, GetShaderLocation(shader, "tilemapSize"), tilemap_size, SHADER_UNIFORM_VEC2);
+    SetShaderValue(shader, GetShaderLocation(shader, "tint"), tint, SHADER_UNIFORM_VEC4);
+    int char_mapped = (layer->flags & 0b10) != 0;
+    SetShaderValue(shader, GetShaderLocation(shader, "charMapped"), &char_mapped, SHADER_UNIFORM_INT);
+    int scroll_row = layer->scroll_row;
+    SetShaderValue(shader, GetShaderLocation(shader, "scrollRow"), &scroll_row, SHADER_UNIFORM_INT);
+
+    BeginShaderMode(shader);
+    CRBindShaderTexture(shader, "tilemap", tilemap->texture, TILEMAPSLOT);
+    CRBindShaderTexture(shader, "animations", cr_config->tile_animation_texture, ANIMATIONSLOT);
+    Rectangle source = {0, 0, layer->width, layer->height};
+    Rectangle dest = {0, 0, layer->width * cr_config->tile_size, layer->height * cr_config->tile_size};
+    DrawTexturePro(layer->data_texture, source, dest, (Vector2) {0, 0}, 0.0f, WHITE);
+    EndShaderMode();
+#endif
+}
+void CRUpdateOcclusion() {
+    int width = 0;
+    int height = 0;
+    for (int i = 0; i < cr_config->world_layer_count; i++) {
+        if (cr_config->world_layers[i].width > width)
+            width = cr_config->world_layers[i].width;
+        if (cr_config->world_layers[i].height > height)
+            height = cr_config->world_layers[i].height;
+    }
+    int top = cr_config->occlusion_top;
+    int bottom = cr_config->occlusion_bottom;
+    if (cr_config->occlusion == 0 || width != cr_config->occlusion_width || height != cr_config->occlusion_height) {
+        CRFree(cr_config->occlusion);
+        cr_config->occlusion = CRAlloc(width * height, MEMORYLAYERS);
+        cr_config->occlusion_width = width;
+        cr_config->occlusion_height = height;
+        top = 0;
+        bottom = height - 1;
+    }
+    if (bottom >= height)
+        bottom = height - 1;
+    cr_config->occlusion_top = -1;
+    cr_config->occlusion_bottom = -1;
+    if (top > bottom)
+        return;
+    // only the dirty rows are rebuilt, every layer is looked at for each of them
+    memset(&cr_config->occlusion[top * width], 0, (bottom - top + 1) * width);
+    // Work down from the top layer, the first tile to cover a cell completely claims it:
+    // a solid background that no mask thins out. The bottom layer has nothing beneath it to cover.
+    for (int i = cr_config->world_layer_count - 1; i > 0; i--) {
+        CRLayer *layer = &cr_config->world_layers[i];
+        // a layer that doesn't draw its backgrounds, or draws nothing at all, covers nothing
+        if ((layer->flags & 0b1000000) || (CRLayerDrawSource(layer) == 0 && layer->draw_missing == CRSkipTile))
+            continue;
+        int layer_bottom = bottom < layer->height ? bottom : layer->height - 1;
+        for (int row = top; row <= layer_bottom; row++) {
+            uint8_t *occlusion = &cr_config->occlusion[row * width];
+            int grid_row = LayerRow(layer, row);
+            uint64_t *words = &layer->occupancy[grid_row * layer->occupancy_words];
+            for (int w = 0; w < layer->occupancy_words; w++) {
+                uint64_t bits = words[w];
+                while (bits) {
+                    int col = w * 64 + CountTrailingZeros(bits);
+                    bits &= bits - 1;
+                    CRTile *tile = &layer->grid[col + grid_row * layer->width];
+                    if (occlusion[col] != 0 || tile->background.a != 255)
+                        continue;
+                    if (layer->mask_count > 0 && CRMaskTile(layer, (Vector2){col, row}, 0b01) != 255)
+                        continue;
+                    occlusion[col] = i + 1;
+                }
+            }
+        }
     }
 }
 void CRDrawLayer(CRLayer *layer) {
     float tile_size = cr_config->tile_size;
-    for (int row = 0; row < layer->height; row++) {
-        for (int col = 0; col < layer->width; col++) {
-            CRTile *tile = &layer->grid[col + row * layer->width];
-            uint8_t mask = CRMaskTile(layer, (Vector2){col, row}, 0b01);
+    // World layers skip the tiles a layer above them covers. The index is offset by one to match
+    // the occlusion grid, and is 0 for any other layer.
+    size_t occlusion_index = 0;
+    if (cr_config->occlusion_top < 0 && CRIsWorldLayer(layer))
+        occlusion_index = layer - cr_config->world_layers + 1;
+    int palette = (layer->flags & 0b100) != 0;
+    // shader layers need a tilemap to sample, text layers fall back to drawing tile by tile
+    int shader = (layer->flags & 0b1001) == 0b1001 && cr_config->tilemap_count > layer->tile_index;
+#if TERMINAL
+    shader = 0;
+#endif
+    if (shader)
+        CRDrawShaderLayer(layer);
+    // the palette shader handles SDF fonts itself
+    int sdf = !palette && CRLayerUsesSDF(layer);
 #if TERMINAL
-            CRDrawTile(tile, layer->flags, layer->tile_index, tile_size,
-                    (Vector2) {col, row}, mask);
+    sdf = 0;
+#endif
+    if (palette)
+        CRBeginPaletteMode(layer);
+    if (sdf)
+        BeginShaderMode(cr_config->sdf_shader);
+#if !TERMINAL
+    if (layer->draw_tile == 0)
+        CRSelectDrawKernel(layer);
+    void *source = CRLayerDrawSource(layer);
+    CRDrawTileKernel draw_tile = source != 0 ? layer->draw_tile : layer->draw_missing;
+#endif
+    // Walk the layer a block at a time. Hidden blocks are skipped outright, and fully visible
+    // blocks don't need their mask looked up tile by tile.
+    int blocks_w = (layer->width + MASKBLOCK - 1) / MASKBLOCK;
+    int blocks_h = (layer->height + MASKBLOCK - 1) / MASKBLOCK;
+    if (!shader && layer->mask_count > 0)
+        CRLayerMaskBlocks(layer);
+    // Only occupied tiles are visited, MASKBLOCK bits of the occupancy bitmap at a time.
+    uint64_t block_row = ((uint64_t) 1 << MASKBLOCK) - 1;
+    for (int by = 0; !shader && by < blocks_h; by++) {
+        int row_end = (by + 1) * MASKBLOCK > layer->height ? layer->height : (by + 1) * MASKBLOCK;
+        for (int bx = 0; bx < blocks_w; bx++) {
+            int word = bx * MASKBLOCK / 64;
+            int shift = bx * MASKBLOCK % 64;
+            uint64_t block_bits = 0;
+            for (int row = by * MASKBLOCK; row < row_end; row++)
+                block_bits |= layer->occupancy[LayerRow(layer, row) * layer->occupancy_words + word] >> shift;
+            if ((block_bits & block_row) == 0)
+                continue;
+            uint8_t state = BLOCKVISIBLE;
+            if (layer->mask_count > 0)
+                state = layer->mask_blocks[bx + by * blocks_w];
+            if (state == BLOCKHIDDEN)
+                continue;
+            for (int row = by * MASKBLOCK; row < row_end; row++) {
+                int grid_row = LayerRow(layer, row);
+                uint64_t bits = (layer->occupancy[grid_row * layer->occupancy_words + word] >> shift) & block_row;
+                while (bits) {
+                    int col = bx * MASKBLOCK + CountTrailingZeros(bits);
+                    bits &= bits - 1;
+                    CRTile *tile = &layer->grid[col + grid_row * layer->width];
+                    if (occlusion_index && tile->visibility == 255 &&
+                            cr_config->occlusion[col + row * cr_config->occlusion_width] > occlusion_index)
+                        continue;
+                    uint8_t mask = 255;
+                    if (state == BLOCKMIXED)
+                        mask = CRMaskTile(layer, (Vector2){col, row}, 0b01);
+#if TERMINAL
+                    CRDrawTile(tile, layer->flags, layer->tile_index, tile_size,
+                            (Vector2) {col, row}, mask);
 #else
-            CRDrawTile(tile, layer->flags, layer->tile_index, tile_size,
-                    (Vector2) {tile_size * col, tile_size * row}, mask);
+                    draw_tile(source, tile, tile_size, (Vector2) {tile_size * col, tile_size * row}, mask);
 #endif
+                }
+            }
         }
     }
-    if (layer->entities.head == 0)
-        return;
     CREntity *itr = layer->entities.head;
     while (itr != 0) {
         CRTile *tile = &itr->tile;
-        Vector2 position = itr->position;
-        uint8_t mask = CRMaskTile(layer, position, 0b10);
+        uint8_t mask = CRMaskTile(layer, itr->position, 0b10);
+        Vector2 position = CREntityDrawPosition(itr);
 #if TERMINAL
+        CRDrawTile(tile, layer->flags, layer->tile_index, tile_size, position, mask);
 #else
         position.x *= tile_size;
         position.y *= tile_size;
+        draw_tile(source, tile, tile_size, position, mask);
 #endif
-        CRDrawTile(tile, layer->flags, layer->tile_index, tile_size, position, mask);
         itr = itr->next;
     }
+    CRDrawParticles(layer);
+    if (palette)
+        CREndPaletteMode();
+    if (sdf)
+        EndShaderMode();
+}
+
+// Particles
+// A particle pool belongs to a layer and never grows, so emitting and expiring particles never
+// allocates. Particles are kept as parallel arrays, moved in one tight pass, compacted when they
+// expire, and drawn after the layer's entities so a pool's particles batch into one draw per texture.
+void CRNewParticles(CRLayer *layer, size_t capacity) {
+    CRUnloadParticles(layer);
+    CRParticles *particles = CRAlloc(sizeof(CRParticles), MEMORYANIMATION);
+    particles->x = CRAlloc(sizeof(float) * capacity, MEMORYANIMATION);
+    particles->y = CRAlloc(sizeof(float) * capacity, MEMORYANIMATION);
+    particles->vx = CRAlloc(sizeof(float) * capacity, MEMORYANIMATION);
+    particles->vy = CRAlloc(sizeof(float) * capacity, MEMORYANIMATION);
+    particles->life = CRAlloc(sizeof(float) * capacity, MEMORYANIMATION);
+    particles->lifetime = CRAlloc(sizeof(float) * capacity, MEMORYANIMATION);
+    particles->tiles = CRAlloc(sizeof(CRTileIndex) * capacity, MEMORYANIMATION);
+    particles->colors = CRAlloc(sizeof(Color) * capacity, MEMORYANIMATION);
+    particles->count = 0;
+    particles->capacity = capacity;
+    particles->acceleration = (Vector2) {0, 0};
+    particles->emitters = 0;
+    particles->emitter_count = 0;
+    particles->emitter_capacity = 0;
+    particles->random = 0x9E3779B9u;
+    layer->particles = particles;
+}
+void CRUnloadParticles(CRLayer *layer) {
+    CRParticles *particles = layer->particles;
+    if (particles == 0)
+        return;
+    CRFree(particles->x);
+    CRFree(particles->y);
+    CRFree(particles->vx);
+    CRFree(particles->vy);
+    CRFree(particles->life);
+    CRFree(particles->lifetime);
+    CRFree(particles->tiles);
+    CRFree(particles->colors);
+    CRFree(particles->emitters);
+    CRFree(particles);
+    layer->particles = 0;
+}
+CREmitter CRNewEmitter(CRTileIndex tile, Color color, Vector2 position) {
+    CREmitter emitter;
+    emitter.position = position;
+    emitter.velocity = (Vector2) {0, 0};
+    emitter.velocity_spread = (Vector2) {1, 1};
+    emitter.tile = tile;
+    emitter.color = color;
+    emitter.lifetime = 1.0f;
+    emitter.lifetime_spread = 0.0f;
+    emitter.rate = 0.0f;
+    emitter.accumulator = 0.0f;
+    emitter.active = 1;
+    return emitter;
+}
+size_t CRAddEmitter(CRLayer *layer, CREmitter emitter) {
+    CRParticles *particles = layer->particles;
+    if (particles == 0)
+        return (size_t) -1; // TODO layer has no particles error
+    size_t index = particles->emitter_count;
+    particles->emitters = CRGrow(particles->emitters, &particles->emitter_capacity, index, sizeof(CREmitter), MEMORYANIMATION);
+    particles->emitters[index] = emitter;
+    particles->emitter_count++;
+    return index;
+}
+CREmitter *CRGetEmitter(CRLayer *layer, size_t emitter) {
+    CRParticles *particles = layer->particles;
+    if (particles == 0 || emitter >= particles->emitter_count)
+        return 0; // TODO out of bounds error
+    return &particles->emitters[emitter];
+}
+// -1 to 1
+float CRParticleRandom(CRParticles *particles) {
+    // xorshift, cheaper than rand and the same on every platform
+    uint32_t x = particles->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    particles->random = x;
+    return (x >> 8) * (2.0f / 16777216.0f) - 1.0f;
+}
+void CREmitParticle(CRLayer *layer, Vector2 position, Vector2 velocity, CRTileIndex tile, Color color, float lifetime) {
+    CRParticles *particles = layer->particles;
+    if (particles == 0 || particles->count == particles->capacity || lifetime <= 0.0f)
+        return; // the pool is full, the particle is dropped
+    size_t i = particles->count;
+    particles->x[i] = position.x;
+    particles->y[i] = position.y;
+    particles->vx[i] = velocity.x;
+    particles->vy[i] = velocity.y;
+    particles->life[i] = lifetime;
+    particles->lifetime[i] = lifetime;
+    particles->tiles[i] = tile;
+    particles->colors[i] = color;
+    particles->count++;
+}
+void CREmitParticles(CRLayer *layer, size_t emitter_index, int count) {
+    CRParticles *particles = layer->particles;
+    if (particles == 0 || emitter_index >= particles->emitter_count)
+        return; // TODO out of bounds error
+    CREmitter *emitter = &particles->emitters[emitter_index];
+    for (int n = 0; n < count; n++) {
+        Vector2 velocity = {
+            emitter->velocity.x + emitter->velocity_spread.x * CRParticleRandom(particles),
+            emitter->velocity.y + emitter->velocity_spread.y * CRParticleRandom(particles)
+        };
+        float lifetime = emitter->lifetime + emitter->lifetime_spread * CRParticleRandom(particles);
+        CREmitParticle(layer, emitter->position, velocity, emitter->tile, emitter->color, lifetime);
+    }
+}
+void CRUpdateParticles(CRLayer *layer, float delta) {
+    CRParticles *particles = layer->particles;
+    for (size_t e = 0; e < particles->emitter_count; e++) {
+        CREmitter *emitter = &particles->emitters[e];
+        if (!emitter->active || emitter->rate <= 0.0f)
+            continue;
+        emitter->accumulator += emitter->rate * delta;
+        int count = emitter->accumulator;
+        emitter->accumulator -= count;
+        CREmitParticles(layer, e, count);
+    }
+
+    size_t count = particles->count;
+    float *restrict x = particles->x;
+    float *restrict y = particles->y;
+    float *restrict vx = particles->vx;
+    float *restrict vy = particles->vy;
+    float *restrict life = particles->life;
+    float ax = particles->acceleration.x * delta;
+    float ay = particles->acceleration.y * delta;
+    for (size_t i = 0; i < count; i++) {
+        vx[i] += ax;
+        vy[i] += ay;
+        x[i] += vx[i] * delta;
+        y[i] += vy[i] * delta;
+        life[i] -= delta;
+    }
+    // drop the expired particles, sliding the rest down over them
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (life[i] <= 0.0f)
+            continue;
+        if (kept != i) {
+            x[kept] = x[i];
+            y[kept] = y[i];
+            vx[kept] = vx[i];
+            vy[kept] = vy[i];
+            life[kept] = life[i];
+            particles->lifetime[kept] = particles->lifetime[i];
+            particles->tiles[kept] = particles->tiles[i];
+            particles->colors[kept] = particles->colors[i];
+        }
+        kept++;
+    }
+    particles->count = kept;
+    if (count > 0)
+        cr_config->redraw = 1;
+}
+void CRUpdateLayerParticles(CRLayer *layers, size_t count, float delta) {
+    for (size_t i = 0; i < count; i++) {
+        if (layers[i].particles != 0)
+            CRUpdateParticles(&layers[i], delta);
+    }
+}
+// the most time one particle update covers
+#define PARTICLEMAXSTEP 0.1f
+void CRRunParticles() {
+    double now = CRGetTime();
+    // the first update after a pause shouldn't move everything at once
+    float delta = cr_config->particle_time < 0 ? 0.0f : now - cr_config->particle_time;
+    cr_config->particle_time = now;
+    // nor the first after a slow frame, the same way fixed updates drop a backlog they can't catch up
+    if (delta > PARTICLEMAXSTEP)
+        delta = PARTICLEMAXSTEP;
+    CRUpdateLayerParticles(cr_config->world_layers, cr_config->world_layer_count, delta);
+    CRUpdateLayerParticles(cr_config->ui_layers, cr_config->ui_layer_count, delta);
+}
+void CRDrawParticles(CRLayer *layer) {
+    CRParticles *particles = layer->particles;
+    if (particles == 0 || particles->count == 0)
+        return;
+#if TERMINAL
+    for (size_t i = 0; i < particles->count; i++) {
+        CRTile tile = CRDefaultTileConfig(0);
+        tile.index = particles->tiles[i];
+        tile.foreground = particles->colors[i];
+        tile.background = TRANSPARENT;
+        CRTermDrawTile(&tile, (Vector2) {(int) particles->x[i], (int) particles->y[i]}, 255);
+    }
+#else
+    float tile_size = cr_config->tile_size;
+    int tilemap = (layer->flags & 0b1) && cr_config->tilemap_count > layer->tile_index;
+    int atlas = (layer->flags & 0b10001) == 0b10000 && cr_config->glyph_atlas_count > layer->tile_index;
+    Font font = GetFontDefault();
+    if (!tilemap && !atlas && cr_config->font_count > layer->tile_index)
+        font = cr_config->fonts[layer->tile_index];
+    for (size_t i = 0; i < particles->count; i++) {
+        // fade out over the particle's life
+        Color color = particles->colors[i];
+        color.a = color.a * (particles->life[i] / particles->lifetime[i]);
+        Vector2 position = {particles->x[i] * tile_size, particles->y[i] * tile_size};
+        CRTileIndex index = particles->tiles[i];
+        if (tilemap) {
+            CRTilemap *map = &cr_config->tilemaps[layer->tile_index];
+            int tile_index = (layer->flags & 0b10) ? CRCharToIndex(index.c) : index.i;
+            Rectangle dest = {position.x, position.y, tile_size, tile_size};
+            DrawTexturePro(map->texture, TileIndexRec(map, tile_index), dest, (Vector2) {0, 0}, 0.0f, color);
+        } else if (atlas) {
+            CRTile tile = CRDefaultTileConfig(0);
+            tile.index = index;
+            tile.foreground = color;
+            tile.background = TRANSPARENT;
+            CRDrawTileGlyph(&tile, &cr_config->glyph_atlases[layer->tile_index], tile_size, position, 255);
+        } else {
+            char string[5] = {index.c[0], index.c[1], index.c[2], index.c[3], 0};
+            position = CenterTextEx(position, font, tile_size, cr_config->font_size, string);
+            int bytes = 0;
+            DrawTextCodepoint(font, GetCodepoint(string, &bytes), position, cr_config->font_size, color);
+        }
+    }
+#endif
+}
+
+// Scrollback
+// Lines are kept compacted in the scrollback and only the ones in view are tiles on the layer.
+// Moving the view scrolls the layer's ring and decodes just the lines that came into view.
+void CRNewScrollback(CRLayer *layer, size_t max_lines) {
+    CRUnloadScrollback(layer);
+    CRScrollback *scrollback = CRCalloc(1, sizeof(CRScrollback), MEMORYLAYERS);
+    scrollback->max_lines = max_lines;
+    scrollback->follow = 1;
+    layer->scrollback = scrollback;
+}
+void CRUnloadScrollback(CRLayer *layer) {
+    CRScrollback *scrollback = layer->scrollback;
+    if (scrollback == 0)
+        return;
+    CRFree(scrollback->data);
+    CRFree(scrollback->starts);
+    CRFree(scrollback);
+    layer->scrollback = 0;
+}
+size_t CRScrollbackLineCount(CRLayer *layer) {
+    if (layer->scrollback == 0)
+        return 0;
+    return layer->scrollback->line_count;
+}
+void CRScrollbackReserve(CRScrollback *scrollback, size_t size) {
+    while (scrollback->data_size + size > scrollback->data_capacity)
+        scrollback->data = CRGrow(scrollback->data, &scrollback->data_capacity, scrollback->data_capacity,
+                1, MEMORYLAYERS);
+}
+void CRDropScrollbackLine(CRScrollback *scrollback) {
+    scrollback->first++;
+    scrollback->line_count--;
+    scrollback->shown--;
+    if (scrollback->view > 0)
+        scrollback->view--;
+    if (scrollback->first < scrollback->line_count)
+        return;
+    // at least half of starts are dropped lines now, move the kept ones to the front
+    size_t offset = scrollback->data_size;
+    if (scrollback->line_count > 0)
+        offset = scrollback->starts[scrollback->first];
+    memmove(scrollback->data, scrollback->data + offset, scrollback->data_size - offset);
+    scrollback->data_size -= offset;
+    for (size_t i = 0; i < scrollback->line_count; i++)
+        scrollback->starts[i] = scrollback->starts[scrollback->first + i] - offset;
+    scrollback->first = 0;
+}
+// Decode a line onto the row of the layer it's shown on, leaving the row empty if there's no such line
+void CRShowScrollbackLine(CRLayer *layer, long line) {
+    CRScrollback *scrollback = layer->scrollback;
+    int row = line - scrollback->shown;
+    CRClearGridRow(layer, LayerRow(layer, row));
+    CRMarkLayerDirty(layer, row, row);
+    if (line < 0 || line >= (long) scrollback->line_count)
+        return;
+    const unsigned char *cursor = scrollback->data + scrollback->starts[scrollback->first + line];
+    uint16_t cells;
+    ReadBytes(&cursor, &cells, sizeof(uint16_t));
+    CRTile tile = CRDefaultTileConfig(0);
+    for (int col = 0; col < cells;) {
+        uint16_t run;
+        ReadBytes(&cursor, &run, sizeof(uint16_t));
+        ReadBytes(&cursor, &tile.foreground, sizeof(Color));
+        ReadBytes(&cursor, &tile.background, sizeof(Color));
+        for (int end = col + run; col < end; col++) {
+            ReadBytes(&cursor, &tile.index, sizeof(CRTileIndex));
+            if (col < layer->width)
+                CRSetLayerTile(layer, tile, (Vector2) {col, row});
+        }
+    }
+}
+// Bring the layer's rows up to date with the lines from the view down
+void CRShowScrollbackView(CRLayer *layer) {
+    CRScrollback *scrollback = layer->scrollback;
+    long height = layer->height;
+    long shift = scrollback->view - scrollback->shown;
+    if (!scrollback->materialized || shift >= height || shift <= -height) {
+        scrollback->shown = scrollback->view;
+        scrollback->materialized = 1;
+        for (long row = 0; row < height; row++)
+            CRShowScrollbackLine(layer, scrollback->view + row);
+        return;
+    }
+    if (shift == 0)
+        return;
+    CRScrollLayer(layer, shift);
+    scrollback->shown = scrollback->view;
+    long first = shift > 0 ? scrollback->view + height - shift : scrollback->view;
+    for (long line = first; line < first + labs(shift); line++)
+        CRShowScrollbackLine(layer, line);
+}
+void CRAddScrollbackLine(CRLayer *layer, CRTile *tiles, int count) {
+    CRScrollback *scrollback = layer->scrollback;
+    if (scrollback == 0)
+        return; // TODO no scrollback error
+    while (count > 0 && tiles[count - 1].index.i == 0)
+        count--;
+    if (count > UINT16_MAX)
+        count = UINT16_MAX;
+    size_t line = scrollback->first + scrollback->line_count;
+    scrollback->starts = CRGrow(scrollback->starts, &scrollback->line_capacity, line, sizeof(size_t), MEMORYLAYERS);
+    scrollback->starts[line] = scrollback->data_size;
+    uint16_t cells = count;
+    CRScrollbackReserve(scrollback, sizeof(uint16_t));
+    unsigned char *cursor = scrollback->data + scrollback->data_size;
+    WriteBytes(&cursor, &cells, sizeof(uint16_t));
+    scrollback->data_size += sizeof(uint16_t);
+    // cells sharing their colors are written as one run
+    for (int i = 0; i < count;) {
+        int end = i + 1;
+        while (end < count && memcmp(&tiles[end].foreground, &tiles[i].foreground, sizeof(Color)) == 0 &&
+                memcmp(&tiles[end].background, &tiles[i].background, sizeof(Color)) == 0)
+            end++;
+        uint16_t run = end - i;
+        CRScrollbackReserve(scrollback, sizeof(uint16_t) + 2 * sizeof(Color) + run * sizeof(CRTileIndex));
+        cursor = scrollback->data + scrollback->data_size;
+        WriteBytes(&cursor, &run, sizeof(uint16_t));
+        WriteBytes(&cursor, &tiles[i].foreground, sizeof(Color));
+        WriteBytes(&cursor, &tiles[i].background, sizeof(Color));
+        for (; i < end; i++)
+            WriteBytes(&cursor, &tiles[i].index, sizeof(CRTileIndex));
+        scrollback->data_size = cursor - scrollback->data;
+    }
+    scrollback->line_count++;
+    if (scrollback->max_lines > 0 && scrollback->line_count > scrollback->max_lines)
+        CRDropScrollbackLine(scrollback);
+    // a line landing among the ones already on the layer is drawn straight away
+    long added = scrollback->line_count - 1;
+    if (scrollback->materialized && added >= scrollback->shown && added < scrollback->shown + layer->height)
+        CRShowScrollbackLine(layer, added);
+    if (scrollback->follow)
+        CRFollowScrollback(layer);
+    else
+        CRShowScrollbackView(layer);
+}
+void CRAddScrollbackText(CRLayer *layer, char *text, Color foreground, Color background) {
+    // a line for every line of the text, one codepoint per tile
+    int length = strlen(text);
+    CRTile *tiles = CRFrameAlloc(sizeof(CRTile) * (length + 1));
+    int count = 0;
+    for (int i = 0; i <= length;) {
+        if (i == length || text[i] == '\n') {
+            CRAddScrollbackLine(layer, tiles, count);
+            count = 0;
+            i++;
+            continue;
+        }
+        int bytes = 0;
+        GetCodepoint(&text[i], &bytes);
+        if (bytes <= 0)
+            bytes = 1;
+        char character[5] = {0};
+        for (int b = 0; b < bytes && b < 4; b++)
+            character[b] = text[i + b];
+        i += bytes;
+        tiles[count] = CRCTile(character);
+        tiles[count].foreground = foreground;
+        tiles[count].background = background;
+        count++;
+    }
+}
+// Put line at the top of the layer, kept between the oldest line and the newest line at the bottom.
+// Scrolling to the bottom follows the newest line again.
+void CRSetScrollbackView(CRLayer *layer, long line) {
+    CRScrollback *scrollback = layer->scrollback;
+    if (scrollback == 0)
+        return; // TODO no scrollback error
+    long bottom = (long) scrollback->line_count - layer->height;
+    if (bottom < 0)
+        bottom = 0;
+    if (line > bottom)
+        line = bottom;
+    if (line < 0)
+        line = 0;
+    scrollback->view = line;
+    scrollback->follow = line == bottom;
+    CRShowScrollbackView(layer);
+}
+void CRScrollScrollback(CRLayer *layer, long lines) {
+    if (layer->scrollback == 0)
+        return; // TODO no scrollback error
+    CRSetScrollbackView(layer, layer->scrollback->view + lines);
+}
+void CRFollowScrollback(CRLayer *layer) {
+    CRSetScrollbackView(layer, LONG_MAX);
+}
+
+// Cell Rendering
+// Headless contexts draw into a grid of cells, the same way terminal rendering places a tile per
+// character cell, so the result can be sent anywhere a terminal's contents could go.
+CRCell *CRGetCells() {
+    return cr_config->cells;
+}
+CRCell *CRGetCell(Vector2 position) {
+    if (position.x < 0 || position.x >= cr_config->cell_width ||
+            position.y < 0 || position.y >= cr_config->cell_height)
+        return 0;
+    return &cr_config->cells[(int) position.x + (int) position.y * cr_config->cell_width];
+}
+void CRCellDrawTile(CRTile *tile, Vector2 position, uint8_t mask) {
+    if (cr_config->terminal_camera) {
+        Camera2D *camera = CRGetMainCamera();
+        position.x += camera->target.x + camera->offset.x;
+        position.y += camera->target.y + camera->offset.y;
+    }
+    CRCell *cell = CRGetCell(position);
+    if (cell == 0)
+        return;
+    CRTileIndex index = tile->index;
+    if (CRIsAnimatedTile(index))
+        index = CRTileAnimationFrame(index);
+    Color foreground = tile->foreground;
+    Color background = tile->background;
+    char string_out[5];
+    if (PreDrawTile(index, mask, &foreground, &background, string_out))
+        return;
+    // a tile without a background lets the cell's show through
+    if (background.a != 0)
+        cell->background = background;
+    if (foreground.a != 0) {
+        cell->index = index;
+        cell->foreground = foreground;
+    }
+}
+// The palette a palette layer's cells look their colors up in, or 0 to draw the colors as they are
+CRPalette *CRCellPalette(CRLayer *layer) {
+    if ((layer->flags & 0b100) == 0)
+        return 0;
+    size_t row = cr_config->palette_override >= 0 ? (size_t) cr_config->palette_override : layer->palette_index;
+    return row < cr_config->palette_count ? &cr_config->palettes[row] : 0;
+}
+// What the palette shader does on the GPU: red is the index, alpha and the palette tint still apply
+Color CRResolvePaletteColor(CRPalette *palette, Color color) {
+    Color resolved = CRPaletteEntry(palette, color.r);
+    Color tint = cr_config->palette_tint;
+    resolved.r = resolved.r * tint.r / 255;
+    resolved.g = resolved.g * tint.g / 255;
+    resolved.b = resolved.b * tint.b / 255;
+    resolved.a = resolved.a * color.a / 255 * tint.a / 255;
+    return resolved;
+}
+void CRCellDrawPaletteTile(CRPalette *palette, CRTile *tile, Vector2 position, uint8_t mask) {
+    if (palette == 0) {
+        CRCellDrawTile(tile, position, mask);
+        return;
+    }
+    CRTile resolved = *tile;
+    resolved.foreground = CRResolvePaletteColor(palette, tile->foreground);
+    resolved.background = CRResolvePaletteColor(palette, tile->background);
+    CRCellDrawTile(&resolved, position, mask);
+}
+void CRDrawLayerCells(CRLayer *layer) {
+    CRPalette *palette = CRCellPalette(layer);
+    for (int row = 0; row < layer->height; row++) {
+        int grid_row = LayerRow(layer, row);
+        for (int word = 0; word < layer->occupancy_words; word++) {
+            uint64_t bits = layer->occupancy[grid_row * layer->occupancy_words + word];
+            while (bits) {
+                int col = word * 64 + CountTrailingZeros(bits);
+                bits &= bits - 1;
+                uint8_t mask = layer->mask_count > 0 ? CRMaskTile(layer, (Vector2){col, row}, 0b01) : 255;
+                CRCellDrawPaletteTile(palette, &layer->grid[col + grid_row * layer->width], (Vector2) {col, row}, mask);
+            }
+        }
+    }
+    for (CREntity *entity = layer->entities.head; entity != 0; entity = entity->next)
+        CRCellDrawPaletteTile(palette, &entity->tile, CREntityDrawPosition(entity), CRMaskTile(layer, entity->position, 0b10));
+    CRParticles *particles = layer->particles;
+    for (size_t i = 0; particles != 0 && i < particles->count; i++) {
+        CRTile tile = CRDefaultTileConfig(0);
+        tile.index = particles->tiles[i];
+        tile.foreground = particles->colors[i];
+        tile.background = TRANSPARENT;
+        CRCellDrawPaletteTile(palette, &tile, (Vector2) {(int) particles->x[i], (int) particles->y[i]}, 255);
+    }
+}
+void CRDrawCells() {
+    CRCell blank;
+    blank.index.i = 0;
+    blank.foreground = cr_config->default_foreground;
+    blank.background = cr_config->background_color;
+    for (int i = 0; i < cr_config->cell_width * cr_config->cell_height; i++)
+        cr_config->cells[i] = blank;
+    cr_config->terminal_camera = 1;
+    for (int i = 0; i < cr_config->world_layer_count; i++)
+        CRDrawLayerCells(&cr_config->world_layers[i]);
+    if (cr_config->world_draw != 0)
+        (*cr_config->world_draw)();
+    cr_config->terminal_camera = 0;
+    for (int i = 0; i < cr_config->ui_layer_count; i++)
+        CRDrawLayerCells(&cr_config->ui_layers[i]);
+    if (cr_config->ui_draw != 0)
+        (*cr_config->ui_draw)();
 }
 
 // Camera functions
@@ -893,9 +4459,197 @@ void CRDrawTextString(CRLayer *layer, char *text, Color tile_color, Color text_c
 #if TERMINAL
 
 #else
-    DrawTextBoxed(font, layer, text, rec, 24, 2.0f, word_wrap, text_color);
+    // layouts are cached by font index, a font that isn't one of the context's is laid out every time
+    if (font != 0 && (font < cr_config->fonts || font >= cr_config->fonts + cr_config->font_count)) {
+        DrawTextBoxed(font, layer, text, rec, cr_config->font_size, 2.0f, word_wrap, text_color);
+        return;
+    }
+    int font_index = font != 0 ? font - cr_config->fonts : -1;
+    CRTextLayout *layout = CRGetTextLayout(font_index, text, rec, cr_config->font_size, 2.0f, word_wrap);
+    CRDrawTextLayout(layout, start, text_color);
 #endif
 }
+// Layouts are found through an open addressing table of layout index + 1, 0 for an empty slot,
+// probed linearly from the layout's hash. It's kept at most half full.
+size_t CRFindTextLayoutSlot(size_t index) {
+    size_t mask = cr_config->text_layout_slot_count - 1;
+    size_t slot = cr_config->text_layouts[index].hash & mask;
+    while (cr_config->text_layout_slots[slot] != index + 1)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+void CRInsertTextLayoutSlot(size_t index) {
+    size_t mask = cr_config->text_layout_slot_count - 1;
+    size_t slot = cr_config->text_layouts[index].hash & mask;
+    while (cr_config->text_layout_slots[slot] != 0)
+        slot = (slot + 1) & mask;
+    cr_config->text_layout_slots[slot] = index + 1;
+}
+void CRRemoveTextLayoutSlot(size_t slot) {
+    // later entries of the same run shift back into the hole, so lookups never stop short of them
+    size_t *slots = cr_config->text_layout_slots;
+    size_t mask = cr_config->text_layout_slot_count - 1;
+    size_t next = slot;
+    for (;;) {
+        next = (next + 1) & mask;
+        if (slots[next] == 0)
+            break;
+        size_t home = cr_config->text_layouts[slots[next] - 1].hash & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            slots[slot] = slots[next];
+            slot = next;
+        }
+    }
+    slots[slot] = 0;
+}
+void CRGrowTextLayoutSlots(size_t count) {
+    if (count * 2 <= cr_config->text_layout_slot_count)
+        return;
+    size_t slot_count = cr_config->text_layout_slot_count < 16 ? 16 : cr_config->text_layout_slot_count * 2;
+    CRFree(cr_config->text_layout_slots);
+    cr_config->text_layout_slots = CRCalloc(slot_count, sizeof(size_t), MEMORYTEXT);
+    cr_config->text_layout_slot_count = slot_count;
+    for (size_t i = 0; i < cr_config->text_layout_count; i++)
+        CRInsertTextLayoutSlot(i);
+}
+void CREvictTextLayout(size_t index) {
+    CRTextLayout *layout = &cr_config->text_layouts[index];
+    cr_config->text_cache_bytes -= layout->bytes;
+    CRFree(layout->text);
+    CRFree(layout->glyphs);
+    CRRemoveTextLayoutSlot(CRFindTextLayoutSlot(index));
+    cr_config->text_layout_count--;
+    size_t last = cr_config->text_layout_count;
+    if (index == last)
+        return;
+    cr_config->text_layout_slots[CRFindTextLayoutSlot(last)] = index + 1;
+    cr_config->text_layouts[index] = cr_config->text_layouts[last];
+}
+// Drop the least recently used layouts until the cache fits, but never the one at keep.
+// Returns where the layout at keep ended up.
+size_t CRTrimTextCache(size_t keep) {
+    while (cr_config->text_cache_bytes > cr_config->text_cache_budget && cr_config->text_layout_count > 1) {
+        size_t oldest = keep == 0 ? 1 : 0;
+        for (size_t i = 0; i < cr_config->text_layout_count; i++) {
+            if (i != keep && cr_config->text_layouts[i].last_used < cr_config->text_layouts[oldest].last_used)
+                oldest = i;
+        }
+        CREvictTextLayout(oldest);
+        // the last layout moved into the evicted slot
+        if (keep == cr_config->text_layout_count)
+            keep = oldest;
+    }
+    return keep;
+}
+// font is an index into the context's fonts, -1 for raylib's default font
+CRTextLayout *CRGetTextLayout(int font, const char *text, Rectangle rec, float font_size, float spacing, int word_wrap) {
+    size_t length = strlen(text);
+    uint64_t hash = HashBytes(0xcbf29ce484222325ULL, text, length);
+    hash = HashBytes(hash, &font, sizeof(font));
+    hash = HashBytes(hash, &rec.width, sizeof(rec.width));
+    hash = HashBytes(hash, &rec.height, sizeof(rec.height));
+    hash = HashBytes(hash, &font_size, sizeof(font_size));
+    hash = HashBytes(hash, &spacing, sizeof(spacing));
+    hash = HashBytes(hash, &word_wrap, sizeof(word_wrap));
+    size_t mask = cr_config->text_layout_slot_count - 1;
+    for (size_t slot = hash & mask; cr_config->text_layout_slot_count > 0 && cr_config->text_layout_slots[slot] != 0;
+            slot = (slot + 1) & mask) {
+        CRTextLayout *layout = &cr_config->text_layouts[cr_config->text_layout_slots[slot] - 1];
+        if (layout->hash != hash || layout->font != font || layout->width != rec.width ||
+                layout->height != rec.height || layout->font_size != font_size ||
+                layout->spacing != spacing || layout->word_wrap != word_wrap || strcmp(layout->text, text) != 0)
+            continue;
+        layout->last_used = cr_config->frame;
+        return layout;
+    }
+
+    size_t index = cr_config->text_layout_count;
+    cr_config->text_layouts = CRGrow(cr_config->text_layouts, &cr_config->text_layout_capacity, index, sizeof(CRTextLayout), MEMORYTEXT);
+    CRGrowTextLayoutSlots(index + 1);
+    cr_config->text_layout_count++;
+    CRTextLayout *layout = &cr_config->text_layouts[index];
+    layout->hash = hash;
+    layout->text = CRAlloc(length + 1, MEMORYTEXT);
+    memcpy(layout->text, text, length + 1);
+    layout->font = font;
+    layout->width = rec.width;
+    layout->height = rec.height;
+    layout->font_size = font_size;
+    layout->spacing = spacing;
+    layout->word_wrap = word_wrap;
+    layout->last_used = cr_config->frame;
+    CRInsertTextLayoutSlot(index);
+
+    Font draw_font = font >= 0 && font < cr_config->font_count ? cr_config->fonts[font] : GetFontDefault();
+    // lay out into scratch space, then keep only as many placements as there are glyphs
+    CRGlyphPlacement *glyphs = CRFrameAlloc(sizeof(CRGlyphPlacement) * (length + 1));
+    layout->glyph_count = LayoutTextBoxed(&draw_font, text, rec, font_size, spacing, word_wrap, glyphs);
+    layout->glyphs = CRAlloc(sizeof(CRGlyphPlacement) * layout->glyph_count, MEMORYTEXT);
+    memcpy(layout->glyphs, glyphs, sizeof(CRGlyphPlacement) * layout->glyph_count);
+    layout->bytes = length + 1 + sizeof(CRGlyphPlacement) * layout->glyph_count;
+    cr_config->text_cache_bytes += layout->bytes;
+
+    return &cr_config->text_layouts[CRTrimTextCache(index)];
+}
+void CRDrawTextLayout(CRTextLayout *layout, Vector2 position, Color tint) {
+    Font font = layout->font >= 0 && layout->font < cr_config->font_count ? cr_config->fonts[layout->font] : GetFontDefault();
+    DrawGlyphPlacements(&font, layout->glyphs, layout->glyph_count, position, tint);
+}
+void CRSetTextCacheBudget(size_t bytes) {
+    cr_config->text_cache_budget = bytes;
+    CRTrimTextCache((size_t) -1);
+}
+void CRLayoutTextTiles(CRLayer *layer, const char *text, Vector2 top_left, int width, int height, int word_wrap, Color foreground, Color background) {
+    // one codepoint per tile, wrapping on whole words when word_wrap is set
+    int length = strlen(text);
+    int col = 0;
+    int row = 0;
+    for (int i = 0; i < length && row < height;) {
+        if (text[i] == '\n') {
+            col = 0;
+            row++;
+            i++;
+            continue;
+        }
+        if (word_wrap && text[i] != ' ' && col > 0) {
+            // count the codepoints in the word, and move it to the next line if it doesn't fit
+            int word = 0;
+            for (int j = i; j < length && text[j] != ' ' && text[j] != '\n'; word++) {
+                int bytes = 0;
+                GetCodepoint(&text[j], &bytes);
+                j += bytes > 0 ? bytes : 1;
+            }
+            if (col + word > width && word <= width) {
+                col = 0;
+                row++;
+                continue;
+            }
+        }
+        if (col >= width) {
+            col = 0;
+            row++;
+            if (word_wrap && text[i] == ' ') {
+                i++;
+                continue;
+            }
+            if (row >= height)
+                break;
+        }
+        int bytes = 0;
+        GetCodepoint(&text[i], &bytes);
+        if (bytes <= 0)
+            bytes = 1;
+        char character[5] = {0};
+        for (int b = 0; b < bytes && b < 4; b++)
+            character[b] = text[i + b];
+        i += bytes;
+        CRTile tile = CRCTile(character);
+        tile.foreground = foreground;
+        tile.background = background;
+        CRSetLayerTile(layer, tile, (Vector2) {top_left.x + col, top_left.y + row});
+        col++;
+    }
+}
 
 // Window Information
 Vector2 CRCameraOffset() {
@@ -919,45 +4673,1354 @@ Vector2 CRScreenSize() {
     return size;
 }
 
-// Terminal rendering
+// Recording
+// A recording is the magic and version, then a record per drawn frame: whether it's a keyframe, its
+// stored and decoded sizes, the seconds since recording started, then the frame compressed with
+// CompressData (or as is, when the stored and decoded sizes match). A keyframe holds the whole
+// scene. Every other frame holds only the tiles, mask cells, entities and camera that changed, as
+// runs of a starting cell, a count and that many values. Records are self-contained, so a recording
+// cut short by a crash still plays up to where it stopped.
+#define RECORDMAGIC 0x52475243 // "CRGR"
+#define RECORDVERSION 2
+// Records come from files and sockets, so anything bigger than these is refused as corrupt
+#define RECORDMAXFRAME (64 << 20)
+#define RECORDMAXLAYERS 256
+#define RECORDMAXSIDE 4096
+// cells across every layer a replay draws into, so many large layers can't add up past it
+#define RECORDMAXCELLS (RECORDMAXSIDE * RECORDMAXSIDE)
+// a tile's index, shift, foreground, background and visibility, without CRTile's padding
+#define RECORDTILEBYTES 21
+#define RECORDENTITYBYTES (sizeof(Vector2) + RECORDTILEBYTES)
+void CRFreeCapture(CRCapture *capture) {
+    for (size_t i = 0; i < capture->layer_count; i++) {
+        CRFree(capture->layers[i].tiles);
+        CRFree(capture->layers[i].entities);
+    }
+    CRFree(capture->layers);
+    for (size_t i = 0; i < capture->mask_count; i++)
+        CRFree(capture->masks[i].grid);
+    CRFree(capture->masks);
+    CRFreeBundle(&capture->encoded);
+    *capture = (CRCapture) {0};
+}
+CRLayer *CRCaptureLayer(size_t index) {
+    if (index < cr_config->world_layer_count)
+        return &cr_config->world_layers[index];
+    return &cr_config->ui_layers[index - cr_config->world_layer_count];
+}
+// Whether the scene still has the layers and masks the capture last saw
+int CRCaptureMatches(CRCapture *capture) {
+    if (capture->world_layer_count != cr_config->world_layer_count ||
+            capture->layer_count != cr_config->world_layer_count + cr_config->ui_layer_count ||
+            capture->mask_count != cr_config->mask_count)
+        return 0;
+    for (size_t i = 0; i < capture->layer_count; i++) {
+        CRLayer *layer = CRCaptureLayer(i);
+        if (capture->layers[i].width != layer->width || capture->layers[i].height != layer->height)
+            return 0;
+    }
+    for (size_t i = 0; i < capture->mask_count; i++) {
+        if (capture->masks[i].width != cr_config->masks[i].width || capture->masks[i].height != cr_config->masks[i].height)
+            return 0;
+    }
+    return 1;
+}
+// Size the capture to the scene, for a keyframe
+void CRCaptureResize(CRCapture *capture) {
+    size_t layer_count = cr_config->world_layer_count + cr_config->ui_layer_count;
+    for (size_t i = layer_count; i < capture->layer_count; i++) {
+        CRFree(capture->layers[i].tiles);
+        CRFree(capture->layers[i].entities);
+    }
+    capture->layers = CRRealloc(capture->layers, sizeof(CRCapturedLayer) * (layer_count + 1), MEMORYOTHER);
+    for (size_t i = capture->layer_count; i < layer_count; i++)
+        capture->layers[i] = (CRCapturedLayer) {0};
+    for (size_t i = 0; i < layer_count; i++) {
+        CRCapturedLayer *captured = &capture->layers[i];
+        CRLayer *layer = CRCaptureLayer(i);
+        if (captured->tiles != 0 && captured->width == layer->width && captured->height == layer->height)
+            continue;
+        CRFree(captured->tiles);
+        captured->tiles = CRAlloc(RECORDTILEBYTES * layer->width * layer->height, MEMORYOTHER);
+        captured->width = layer->width;
+        captured->height = layer->height;
+    }
+    capture->world_layer_count = cr_config->world_layer_count;
+    capture->layer_count = layer_count;
+    for (size_t i = cr_config->mask_count; i < capture->mask_count; i++)
+        CRFree(capture->masks[i].grid);
+    capture->masks = CRRealloc(capture->masks, sizeof(CRCapturedMask) * (cr_config->mask_count + 1), MEMORYOTHER);
+    for (size_t i = capture->mask_count; i < cr_config->mask_count; i++)
+        capture->masks[i] = (CRCapturedMask) {0};
+    for (size_t i = 0; i < cr_config->mask_count; i++) {
+        CRCapturedMask *captured = &capture->masks[i];
+        CRMask *mask = &cr_config->masks[i];
+        if (captured->grid != 0 && captured->width == mask->width && captured->height == mask->height)
+            continue;
+        CRFree(captured->grid);
+        captured->grid = CRAlloc(mask->width * mask->height, MEMORYOTHER);
+        captured->width = mask->width;
+        captured->height = mask->height;
+    }
+    capture->mask_count = cr_config->mask_count;
+}
+// Write the runs of cells in current that differ from previous, or all of them for a keyframe, and
+// bring previous up to date. The runs end with a count of 0.
+void CRCaptureRuns(CRBundle *out, void *current, void *previous, size_t cell_size, size_t count, int keyframe) {
+    unsigned char *now = current;
+    unsigned char *before = previous;
+    size_t i = 0;
+    while (i < count) {
+        if (!keyframe && memcmp(now + i * cell_size, before + i * cell_size, cell_size) == 0) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < count && (keyframe || memcmp(now + i * cell_size, before + i * cell_size, cell_size) != 0))
+            i++;
+        uint32_t run[2] = {start, i - start};
+        CRBundleWrite(out, run, sizeof(run));
+        CRBundleWrite(out, now + start * cell_size, (i - start) * cell_size);
+        memcpy(before + start * cell_size, now + start * cell_size, (i - start) * cell_size);
+    }
+    uint32_t end[2] = {0, 0};
+    CRBundleWrite(out, end, sizeof(end));
+}
+// Tiles are written field by field, so the padding in CRTile never gets compared or recorded
+void CRPackRecordTile(unsigned char *out, CRTile *tile) {
+    WriteBytes(&out, &tile->index, sizeof(CRTileIndex));
+    WriteBytes(&out, &tile->shift, sizeof(Vector2));
+    WriteBytes(&out, &tile->foreground, sizeof(Color));
+    WriteBytes(&out, &tile->background, sizeof(Color));
+    WriteBytes(&out, &tile->visibility, 1);
+}
+int CRReadRecordTile(const unsigned char **cursor, const unsigned char *end, CRTile *tile) {
+    return ReadBytesChecked(cursor, end, &tile->index, sizeof(CRTileIndex)) &&
+        ReadBytesChecked(cursor, end, &tile->shift, sizeof(Vector2)) &&
+        ReadBytesChecked(cursor, end, &tile->foreground, sizeof(Color)) &&
+        ReadBytesChecked(cursor, end, &tile->background, sizeof(Color)) &&
+        ReadBytesChecked(cursor, end, &tile->visibility, 1);
+}
+// Encode the current context's scene into capture->encoded. Frames where the layers or masks were
+// added or resized become keyframes. Returns whether it was a keyframe.
+int CRCaptureFrame(CRCapture *capture, int keyframe) {
+    if (capture->encoded.capacity == 0)
+        capture->start_time = CRGetTime();
+    if (!CRCaptureMatches(capture)) {
+        keyframe = 1;
+        CRCaptureResize(capture);
+    }
+    CRBundle *out = &capture->encoded;
+    out->size = 0;
+    uint8_t key = keyframe;
+    uint32_t counts[3] = {capture->frame, capture->world_layer_count, capture->layer_count - capture->world_layer_count};
+    CRBundleWrite(out, &key, 1);
+    CRBundleWrite(out, counts, sizeof(counts));
+    CRBundleWrite(out, &cr_config->main_camera, sizeof(Camera2D));
+    for (size_t i = 0; i < capture->layer_count; i++) {
+        CRCapturedLayer *captured = &capture->layers[i];
+        CRLayer *layer = CRCaptureLayer(i);
+        int32_t size[2] = {layer->width, layer->height};
+        uint32_t settings[5] = {layer->flags, layer->tile_index, layer->palette_index, layer->mask_count, layer->scroll_row};
+        CRBundleWrite(out, size, sizeof(size));
+        CRBundleWrite(out, &layer->position, sizeof(Vector2));
+        CRBundleWrite(out, settings, sizeof(settings));
+        for (size_t m = 0; m < layer->mask_count; m++) {
+            uint32_t mask_index = layer->mask_indexes[m];
+            CRBundleWrite(out, &mask_index, sizeof(uint32_t));
+        }
+        size_t cells = layer->width * layer->height;
+        unsigned char *packed = CRFrameAlloc(RECORDTILEBYTES * cells);
+        for (size_t k = 0; k < cells; k++)
+            CRPackRecordTile(packed + k * RECORDTILEBYTES, &layer->grid[k]);
+        CRCaptureRuns(out, packed, captured->tiles, RECORDTILEBYTES, cells, keyframe);
+        // entities are small enough to send whole whenever any of them change
+        size_t count = 0;
+        int changed = keyframe;
+        for (CREntity *entity = layer->entities.head; entity != 0; entity = entity->next) {
+            captured->entities = CRGrow(captured->entities, &captured->entity_capacity, count,
+                    sizeof(CRCapturedEntity), MEMORYOTHER);
+            CRCapturedEntity now;
+            now.position = CREntityDrawPosition(entity);
+            now.tile = entity->tile;
+            // the tile's padding isn't copied reliably, so it's compared a field at a time
+            CRCapturedEntity *before = &captured->entities[count];
+            if (count >= captured->entity_count || memcmp(&now.position, &before->position, sizeof(Vector2)) != 0 ||
+                    !SameTile(&now.tile, &before->tile))
+                changed = 1;
+            captured->entities[count++] = now;
+        }
+        if (count != captured->entity_count)
+            changed = 1;
+        captured->entity_count = count;
+        uint32_t entities[2] = {changed, changed ? count : 0};
+        CRBundleWrite(out, entities, sizeof(entities));
+        for (size_t e = 0; changed && e < count; e++) {
+            unsigned char tile[RECORDTILEBYTES];
+            CRPackRecordTile(tile, &captured->entities[e].tile);
+            CRBundleWrite(out, &captured->entities[e].position, sizeof(Vector2));
+            CRBundleWrite(out, tile, RECORDTILEBYTES);
+        }
+    }
+    uint32_t mask_count = capture->mask_count;
+    CRBundleWrite(out, &mask_count, sizeof(uint32_t));
+    for (size_t i = 0; i < capture->mask_count; i++) {
+        CRMask *mask = &cr_config->masks[i];
+        int32_t size[2] = {mask->width, mask->height};
+        uint32_t flags = mask->flags;
+        CRBundleWrite(out, size, sizeof(size));
+        CRBundleWrite(out, &mask->position, sizeof(Vector2));
+        CRBundleWrite(out, &flags, sizeof(uint32_t));
+        CRCaptureRuns(out, mask->grid, capture->masks[i].grid, 1, mask->width * mask->height, keyframe);
+    }
+    capture->frame++;
+    return keyframe;
+}
+// Decode a frame encoded by CRCaptureFrame into the current context, adding layers and masks it
+// lacks. Everything is checked as it's read, and anything out of bounds fails the frame.
+#define RECORDREAD(data, size) if (!ReadBytesChecked(&cursor, end, data, size)) return 0
+int CRDecodeCapturedFrame(CRReplay *replay, const unsigned char *data, size_t size) {
+    const unsigned char *cursor = data;
+    const unsigned char *end = data + size;
+    uint8_t keyframe;
+    uint32_t counts[3];
+    Camera2D camera;
+    RECORDREAD(&keyframe, 1);
+    RECORDREAD(counts, sizeof(counts));
+    RECORDREAD(&camera, sizeof(Camera2D));
+    if (counts[1] > RECORDMAXLAYERS || counts[2] > RECORDMAXLAYERS)
+        return 0;
+    cr_config->main_camera = camera;
+    while (cr_config->world_layer_count < counts[1])
+        CRAppendWorldLayer(CRInitLayer());
+    while (cr_config->ui_layer_count < counts[2])
+        CRAppendUILayer(CRInitLayer());
+    // every layer of the context counts, not just this frame's, since the others keep their size
+    uint64_t total_cells = 0;
+    for (size_t i = 0; i < cr_config->world_layer_count; i++)
+        total_cells += (uint64_t) cr_config->world_layers[i].width * cr_config->world_layers[i].height;
+    for (size_t i = 0; i < cr_config->ui_layer_count; i++)
+        total_cells += (uint64_t) cr_config->ui_layers[i].width * cr_config->ui_layers[i].height;
+    size_t layer_count = counts[1] + counts[2];
+    replay->world_layer_count = counts[1];
+    if (replay->layer_count < layer_count) {
+        replay->layers = CRRealloc(replay->layers, sizeof(CRReplayLayer) * layer_count, MEMORYOTHER);
+        for (size_t i = replay->layer_count; i < layer_count; i++)
+            replay->layers[i] = (CRReplayLayer) {0};
+        replay->layer_count = layer_count;
+    }
+    for (size_t i = 0; i < layer_count; i++) {
+        CRLayer *layer = i < counts[1] ? &cr_config->world_layers[i] : &cr_config->ui_layers[i - counts[1]];
+        int32_t layer_size[2];
+        Vector2 position;
+        uint32_t settings[5];
+        RECORDREAD(layer_size, sizeof(layer_size));
+        RECORDREAD(&position, sizeof(Vector2));
+        RECORDREAD(settings, sizeof(settings));
+        if (layer_size[0] <= 0 || layer_size[1] <= 0 || layer_size[0] > RECORDMAXSIDE || layer_size[1] > RECORDMAXSIDE)
+            return 0;
+        if (settings[3] > MAXLAYERMASKS || settings[4] >= (uint32_t) layer_size[1])
+            return 0;
+        if (layer->width != layer_size[0] || layer->height != layer_size[1]) {
+            total_cells -= (uint64_t) layer->width * layer->height;
+            total_cells += (uint64_t) layer_size[0] * layer_size[1];
+            if (total_cells > RECORDMAXCELLS)
+                return 0;
+            layer->width = layer_size[0];
+            layer->height = layer_size[1];
+            if (!CRInitGrid(layer))
+                return 0;
+        }
+        if (layer->position.x != position.x || layer->position.y != position.y)
+            CRSetLayerPosition(layer, position);
+        if (layer->flags != settings[0])
+            CRSetLayerFlags(layer, settings[0]);
+        layer->tile_index = settings[1];
+        layer->palette_index = settings[2] < MAXPALETTES ? settings[2] : 0;
+        // the masks may not have been read yet, CRApplyCapturedFrame drops any that don't exist
+        for (size_t m = 0; m < settings[3]; m++) {
+            uint32_t mask_index;
+            RECORDREAD(&mask_index, sizeof(uint32_t));
+            if (m >= layer->mask_count || layer->mask_indexes[m] != mask_index)
+                CRMarkMaskBlocksDirty(layer, 0, 0, layer->width - 1, layer->height - 1);
+            layer->mask_indexes[m] = mask_index;
+        }
+        if (layer->mask_count != settings[3])
+            CRMarkMaskBlocksDirty(layer, 0, 0, layer->width - 1, layer->height - 1);
+        layer->mask_count = settings[3];
+        CRSelectDrawKernel(layer);
+        // tiles are recorded in the order the grid stores them, so a scroll only records the rows it cleared
+        if (layer->scroll_row != settings[4]) {
+            layer->scroll_row = settings[4];
+            CRMarkLayerDirty(layer, 0, layer->height - 1);
+        }
+        uint64_t cells = (uint64_t) layer->width * layer->height;
+        uint32_t run[2];
+        for (;;) {
+            RECORDREAD(run, sizeof(run));
+            if (run[1] == 0)
+                break;
+            if ((uint64_t) run[0] + run[1] > cells)
+                return 0;
+            for (uint32_t k = run[0]; k < run[0] + run[1]; k++) {
+                CRTile tile = {0};
+                if (!CRReadRecordTile(&cursor, end, &tile))
+                    return 0;
+                int row = (int) (k / layer->width) - layer->scroll_row;
+                if (row < 0)
+                    row += layer->height;
+                CRSetLayerTile(layer, tile, (Vector2) {k % layer->width, row});
+            }
+        }
+        uint32_t entities[2];
+        RECORDREAD(entities, sizeof(entities));
+        if (!entities[0])
+            continue;
+        if (entities[1] > (size_t) (end - cursor) / RECORDENTITYBYTES)
+            return 0;
+        // every entity on a replayed layer is the replay's, so the list is rebuilt from scratch
+        CRReplayLayer *replayed = &replay->layers[i];
+        if (replayed->entity_capacity < entities[1]) {
+            replayed->entities = CRRealloc(replayed->entities, sizeof(CREntity) * entities[1], MEMORYOTHER);
+            replayed->entity_capacity = entities[1];
+        }
+        replayed->entity_count = entities[1];
+        layer->entities.head = 0;
+        layer->entities.tail = 0;
+        for (size_t e = 0; e < replayed->entity_count; e++) {
+            Vector2 position;
+            CRTile tile = {0};
+            ReadBytes(&cursor, &position, sizeof(Vector2));
+            CRReadRecordTile(&cursor, end, &tile);
+            replayed->entities[e] = CRNewEntity(tile, position);
+            CRAddEntityToLayer(layer, &replayed->entities[e]);
+        }
+    }
+    uint32_t mask_count;
+    RECORDREAD(&mask_count, sizeof(uint32_t));
+    for (size_t i = 0; i < mask_count; i++) {
+        int32_t mask_size[2];
+        Vector2 position;
+        uint32_t flags;
+        RECORDREAD(mask_size, sizeof(mask_size));
+        RECORDREAD(&position, sizeof(Vector2));
+        RECORDREAD(&flags, sizeof(uint32_t));
+        if (mask_size[0] <= 0 || mask_size[1] <= 0 || mask_size[0] > RECORDMAXSIDE || mask_size[1] > RECORDMAXSIDE)
+            return 0;
+        if (i > cr_config->mask_count)
+            return 0;
+        if (i == cr_config->mask_count)
+            CRNewMask(mask_size[0], mask_size[1], flags, position);
+        CRMask *mask = &cr_config->masks[i];
+        if (mask->width != mask_size[0] || mask->height != mask_size[1])
+            return 0;
+        if (mask->position.x != position.x || mask->position.y != position.y)
+            CRMoveMask(i, position);
+        mask->flags = flags;
+        uint64_t cells = (uint64_t) mask->width * mask->height;
+        uint32_t run[2];
+        for (;;) {
+            RECORDREAD(run, sizeof(run));
+            if (run[1] == 0)
+                break;
+            if ((uint64_t) run[0] + run[1] > cells || run[1] > (size_t) (end - cursor))
+                return 0;
+            for (uint32_t k = run[0]; k < run[0] + run[1]; k++) {
+                uint8_t value;
+                ReadBytes(&cursor, &value, 1);
+                CRSetMaskValue(i, (Vector2) {k % mask->width, k / mask->width}, value);
+            }
+        }
+    }
+    return cursor == end;
+}
+#undef RECORDREAD
+// Apply a frame encoded by CRCaptureFrame. A frame that fails part way leaves what it applied so far,
+// but never a layer pointing at a mask that doesn't exist.
+int CRApplyCapturedFrame(CRReplay *replay, const unsigned char *data, size_t size) {
+    int applied = CRDecodeCapturedFrame(replay, data, size);
+    CRLayer *layer_lists[2] = {cr_config->world_layers, cr_config->ui_layers};
+    size_t layer_counts[2] = {cr_config->world_layer_count, cr_config->ui_layer_count};
+    for (int list = 0; list < 2; list++) {
+        for (size_t i = 0; i < layer_counts[list]; i++) {
+            CRLayer *layer = &layer_lists[list][i];
+            size_t kept = 0;
+            for (size_t m = 0; m < layer->mask_count; m++) {
+                if (layer->mask_indexes[m] < cr_config->mask_count)
+                    layer->mask_indexes[kept++] = layer->mask_indexes[m];
+            }
+            if (kept != layer->mask_count) {
+                layer->mask_count = kept;
+                CRSelectDrawKernel(layer);
+                CRMarkMaskBlocksDirty(layer, 0, 0, layer->width - 1, layer->height - 1);
+            }
+        }
+    }
+    cr_config->redraw = 1;
+    return applied;
+}
+int CRStartRecording(const char *path, int keyframe_interval) {
+    if (cr_config->recorder != 0)
+        return 0; // TODO already recording error
+    FILE *file = fopen(path, "wb");
+    if (file == 0)
+        return 0; // TODO file error
+    uint32_t header[2] = {RECORDMAGIC, RECORDVERSION};
+    fwrite(header, sizeof(header), 1, file);
+    CRRecorder *recorder = CRCalloc(1, sizeof(CRRecorder), MEMORYOTHER);
+    recorder->file = file;
+    recorder->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    recorder->since_keyframe = 0;
+    cr_config->recorder = recorder;
+    return 1;
+}
+// The frame compressed, or 0 if compressing it didn't make it any smaller and it's stored as is.
+// Free with MemFree.
+unsigned char *CRCompressFrame(CRBundle *frame, int *stored_size) {
+    unsigned char *stored = CompressData(frame->data, frame->size, stored_size);
+    if (stored != 0 && *stored_size < frame->size)
+        return stored;
+    if (stored != 0)
+        MemFree(stored);
+    *stored_size = frame->size;
+    return 0;
+}
+// Called by CRDrawFrame after every frame it draws
+void CRRecordFrame(CRRecorder *recorder) {
+    int keyframe = recorder->capture.frame == 0 || recorder->since_keyframe >= recorder->keyframe_interval;
+    keyframe = CRCaptureFrame(&recorder->capture, keyframe);
+    recorder->since_keyframe = keyframe ? 1 : recorder->since_keyframe + 1;
+    CRBundle *frame = &recorder->capture.encoded;
+    int stored_size = 0;
+    unsigned char *stored = CRCompressFrame(frame, &stored_size);
+    uint32_t header[3] = {keyframe, stored_size, frame->size};
+    double time = CRGetTime() - recorder->capture.start_time;
+    fwrite(header, sizeof(header), 1, recorder->file);
+    fwrite(&time, sizeof(double), 1, recorder->file);
+    fwrite(stored != 0 ? stored : frame->data, stored_size, 1, recorder->file);
+    if (stored != 0)
+        MemFree(stored);
+    // a crash loses at most the frames since the last keyframe
+    if (keyframe)
+        fflush(recorder->file);
+}
+void CRStopRecording() {
+    CRRecorder *recorder = cr_config->recorder;
+    if (recorder == 0)
+        return;
+    fclose(recorder->file);
+    CRFreeCapture(&recorder->capture);
+    CRFree(recorder);
+    cr_config->recorder = 0;
+}
+// Plays a recording into the current context. Only the record headers are read up front, so
+// opening is quick however long the recording is.
+CRReplay *CROpenReplay(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == 0)
+        return 0; // TODO file error
+    uint32_t header[2];
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != RECORDMAGIC || header[1] != RECORDVERSION) {
+        fclose(file);
+        return 0; // TODO not a recording error
+    }
+    CRReplay *replay = CRCalloc(1, sizeof(CRReplay), MEMORYOTHER);
+    replay->file = file;
+    replay->current = -1;
+    uint32_t record[3];
+    double time;
+    while (fread(record, sizeof(record), 1, file) == 1 && fread(&time, sizeof(double), 1, file) == 1) {
+        replay->records = CRGrow(replay->records, &replay->record_capacity, replay->record_count,
+                sizeof(CRReplayRecord), MEMORYOTHER);
+        CRReplayRecord *entry = &replay->records[replay->record_count];
+        entry->keyframe = record[0];
+        entry->stored_size = record[1];
+        entry->size = record[2];
+        entry->time = time;
+        entry->offset = ftell(file);
+        if (entry->stored_size > RECORDMAXFRAME || entry->size > RECORDMAXFRAME)
+            break; // TODO corrupt recording error
+        if (fseek(file, entry->stored_size, SEEK_CUR) != 0)
+            break;
+        replay->record_count++;
+    }
+    // a record the recording was cut off in the middle of
+    if (replay->record_count > 0) {
+        CRReplayRecord *last = &replay->records[replay->record_count - 1];
+        fseek(file, 0, SEEK_END);
+        if (last->offset + last->stored_size > ftell(file))
+            replay->record_count--;
+    }
+    return replay;
+}
+void CRCloseReplay(CRReplay *replay) {
+    // take the replay's entities back off the layers before they're freed
+    for (size_t i = 0; i < replay->layer_count; i++) {
+        if (replay->layers[i].entity_count == 0)
+            continue;
+        // laid out the way the recording split them, the context may have more world layers
+        size_t world = replay->world_layer_count;
+        if (i >= world && i - world >= cr_config->ui_layer_count)
+            continue;
+        CRLayer *layer = i < world ? &cr_config->world_layers[i] : &cr_config->ui_layers[i - world];
+        layer->entities.head = 0;
+        layer->entities.tail = 0;
+    }
+    for (size_t i = 0; i < replay->layer_count; i++)
+        CRFree(replay->layers[i].entities);
+    CRFree(replay->layers);
+    CRFree(replay->records);
+    CRFree(replay->buffer);
+    if (replay->file != 0)
+        fclose(replay->file);
+    CRFree(replay);
+}
+// Apply a frame as it's stored in a record, compressed unless its stored size is its size
+int CRApplyStoredFrame(CRReplay *replay, const unsigned char *stored, size_t stored_size, size_t size) {
+    if (stored_size > RECORDMAXFRAME || size > RECORDMAXFRAME)
+        return 0; // TODO corrupt recording error
+    if (stored_size == size)
+        return CRApplyCapturedFrame(replay, stored, size);
+    int frame_size = 0;
+    unsigned char *frame = DecompressData(stored, stored_size, &frame_size);
+    if (frame == 0 || frame_size != size) {
+        if (frame != 0)
+            MemFree(frame);
+        return 0; // TODO corrupt recording error
+    }
+    int applied = CRApplyCapturedFrame(replay, frame, size);
+    MemFree(frame);
+    return applied;
+}
+int CRReplayApply(CRReplay *replay, size_t index) {
+    CRReplayRecord *record = &replay->records[index];
+    if (replay->buffer_capacity < record->stored_size) {
+        replay->buffer = CRRealloc(replay->buffer, record->stored_size, MEMORYOTHER);
+        replay->buffer_capacity = record->stored_size;
+    }
+    fseek(replay->file, record->offset, SEEK_SET);
+    if (fread(replay->buffer, record->stored_size, 1, replay->file) != 1)
+        return 0;
+    return CRApplyStoredFrame(replay, replay->buffer, record->stored_size, record->size);
+}
+// Show the frame at index, starting from the keyframe before it unless it's just ahead
+int CRReplayFrame(CRReplay *replay, size_t index) {
+    if (index >= replay->record_count)
+        return 0;
+    size_t from = index;
+    while (from > 0 && !replay->records[from].keyframe)
+        from--;
+    if (replay->current >= (long) from && replay->current < (long) index)
+        from = replay->current + 1;
+    for (size_t i = from; i <= index; i++) {
+        if (!CRReplayApply(replay, i))
+            return 0;
+    }
+    replay->current = index;
+    replay->time = replay->records[index].time;
+    return 1;
+}
+int CRReplayNext(CRReplay *replay) {
+    return CRReplayFrame(replay, replay->current + 1);
+}
+// Move the playback clock on, showing the last frame recorded by then. Scale seconds to change the
+// speed. Returns the number of frames moved past.
+int CRReplayAdvance(CRReplay *replay, double seconds) {
+    double time = replay->time + seconds;
+    long index = replay->current;
+    while (index + 1 < (long) replay->record_count && replay->records[index + 1].time <= time)
+        index++;
+    int moved = index - replay->current;
+    if (moved > 0)
+        CRReplayFrame(replay, index);
+    replay->time = time;
+    return moved;
+}
+size_t CRReplayFrameCount(CRReplay *replay) {
+    return replay->record_count;
+}
+
+// Spectator Streaming
+// A stream publishes every drawn frame to whoever connects, as the same records a recording holds.
+// Each frame is encoded once into a reference counted buffer that every subscriber's queue points
+// at. Sockets never block: a subscriber that can't keep up has its queue dropped and waits for the
+// next keyframe, so the game never waits on a slow spectator. Addresses starting with / or . are
+// Unix sockets, anything else is a TCP [host:]port.
+#if !_WIN32
+int CRSocket(const char *address, int listening) {
+    int fd = -1;
+    if (address[0] == '/' || address[0] == '.') {
+        struct sockaddr_un local = {0};
+        local.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(local.sun_path))
+            return -1; // TODO path too long error
+        strcpy(local.sun_path, address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (listening)
+            unlink(address);
+        int result = listening ? bind(fd, (struct sockaddr *) &local, sizeof(local)) :
+            connect(fd, (struct sockaddr *) &local, sizeof(local));
+        if (result != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        char host[256] = {0};
+        const char *port = strrchr(address, ':');
+        if (port != 0) {
+            size_t length = port - address < sizeof(host) - 1 ? port - address : sizeof(host) - 1;
+            memcpy(host, address, length);
+            port++;
+        } else {
+            port = address;
+        }
+        struct addrinfo hints = {0};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        struct addrinfo *addresses;
+        if (getaddrinfo(host[0] != 0 ? host : 0, port, &hints, &addresses) != 0)
+            return -1; // TODO address error
+        for (struct addrinfo *option = addresses; option != 0; option = option->ai_next) {
+            fd = socket(option->ai_family, option->ai_socktype, option->ai_protocol);
+            if (fd < 0)
+                continue;
+            int reuse = 1;
+            if (listening)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            int result = listening ? bind(fd, option->ai_addr, option->ai_addrlen) :
+                connect(fd, option->ai_addr, option->ai_addrlen);
+            if (result == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addresses);
+        if (fd < 0)
+            return -1;
+    }
+    if (listening && listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int no_signal = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_signal, sizeof(no_signal));
+#endif
+    return fd;
+}
+int CRStartStream(const char *address, int keyframe_interval) {
+    if (cr_config->stream != 0)
+        return 0; // TODO already streaming error
+    int fd = CRSocket(address, 1);
+    if (fd < 0)
+        return 0; // TODO socket error
+    CRStream *stream = CRCalloc(1, sizeof(CRStream), MEMORYOTHER);
+    stream->listen_fd = fd;
+    if (address[0] == '/' || address[0] == '.')
+        snprintf(stream->path, sizeof(stream->path), "%s", address);
+    stream->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    stream->force_keyframe = 1;
+    cr_config->stream = stream;
+    return 1;
+}
+void CRReleaseStreamBuffer(CRStreamBuffer *buffer) {
+    if (--buffer->references == 0)
+        CRFree(buffer);
+}
+// Drop everything queued for the subscriber but what it's partway through sending
+void CRDropSubscriberQueue(CRSubscriber *subscriber) {
+    size_t keep = subscriber->sent > 0 ? 1 : 0;
+    for (size_t i = keep; i < subscriber->count; i++)
+        CRReleaseStreamBuffer(subscriber->queue[(subscriber->head + i) % STREAMQUEUE]);
+    subscriber->count = keep;
+}
+void CRStopStream() {
+    CRStream *stream = cr_config->stream;
+    if (stream == 0)
+        return;
+    for (size_t i = 0; i < stream->subscriber_count; i++) {
+        CRSubscriber *subscriber = &stream->subscribers[i];
+        subscriber->sent = 0;
+        CRDropSubscriberQueue(subscriber);
+        close(subscriber->fd);
+    }
+    CRFree(stream->subscribers);
+    close(stream->listen_fd);
+    if (stream->path[0] != 0)
+        unlink(stream->path);
+    CRFreeCapture(&stream->capture);
+    CRFree(stream);
+    cr_config->stream = 0;
+}
+void CRAcceptSubscribers(CRStream *stream) {
+    for (;;) {
+        int fd = accept(stream->listen_fd, 0, 0);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+        int no_signal = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_signal, sizeof(no_signal));
+#endif
+        stream->subscribers = CRGrow(stream->subscribers, &stream->subscriber_capacity, stream->subscriber_count,
+                sizeof(CRSubscriber), MEMORYOTHER);
+        CRSubscriber *subscriber = &stream->subscribers[stream->subscriber_count++];
+        memset(subscriber, 0, sizeof(CRSubscriber));
+        subscriber->fd = fd;
+        // deltas are useless without the keyframe before them
+        subscriber->waiting_keyframe = 1;
+        stream->force_keyframe = 1;
+    }
+}
+// Send as much of the queue as the socket takes without blocking
+void CRFlushSubscriber(CRSubscriber *subscriber) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    while (subscriber->count > 0) {
+        CRStreamBuffer *buffer = subscriber->queue[subscriber->head];
+        ssize_t sent = send(subscriber->fd, buffer->data + subscriber->sent, buffer->size - subscriber->sent, flags);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                subscriber->closed = 1;
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        subscriber->sent += sent;
+        if (subscriber->sent < buffer->size)
+            return;
+        CRReleaseStreamBuffer(buffer);
+        subscriber->head = (subscriber->head + 1) % STREAMQUEUE;
+        subscriber->count--;
+        subscriber->sent = 0;
+    }
+}
+void CRFlushSubscribers(CRStream *stream) {
+    for (size_t i = 0; i < stream->subscriber_count; ) {
+        CRSubscriber *subscriber = &stream->subscribers[i];
+        CRFlushSubscriber(subscriber);
+        if (!subscriber->closed) {
+            i++;
+            continue;
+        }
+        subscriber->sent = 0;
+        CRDropSubscriberQueue(subscriber);
+        close(subscriber->fd);
+        stream->subscribers[i] = stream->subscribers[--stream->subscriber_count];
+    }
+}
+// Called by CRDrawFrame every pass, drawn or not, so spectators are let in and frames already
+// queued keep going out while render on demand sits idle
+void CRServiceStream(CRStream *stream) {
+    size_t subscriber_count = stream->subscriber_count;
+    CRAcceptSubscribers(stream);
+    // a spectator that just connected needs a keyframe, and frames are only encoded when drawn
+    if (stream->subscriber_count > subscriber_count)
+        cr_config->redraw = 1;
+    CRFlushSubscribers(stream);
+}
+// Called by CRDrawFrame after every frame it draws
+void CRStreamFrame(CRStream *stream) {
+    if (stream->subscriber_count == 0) {
+        // nobody saw the frames in between, so the next one has to start over
+        stream->force_keyframe = 1;
+        return;
+    }
+    int keyframe = stream->force_keyframe || stream->since_keyframe >= stream->keyframe_interval;
+    keyframe = CRCaptureFrame(&stream->capture, keyframe);
+    stream->since_keyframe = keyframe ? 1 : stream->since_keyframe + 1;
+    stream->force_keyframe = 0;
+    CRBundle *frame = &stream->capture.encoded;
+    int stored_size = 0;
+    unsigned char *stored = CRCompressFrame(frame, &stored_size);
+    uint32_t header[3] = {keyframe, stored_size, frame->size};
+    double time = CRGetTime() - stream->capture.start_time;
+    size_t size = sizeof(header) + sizeof(double) + stored_size;
+    CRStreamBuffer *buffer = CRAlloc(sizeof(CRStreamBuffer) + size, MEMORYOTHER);
+    buffer->references = 1;
+    buffer->size = size;
+    memcpy(buffer->data, header, sizeof(header));
+    memcpy(buffer->data + sizeof(header), &time, sizeof(double));
+    memcpy(buffer->data + sizeof(header) + sizeof(double), stored != 0 ? stored : frame->data, stored_size);
+    if (stored != 0)
+        MemFree(stored);
+    for (size_t i = 0; i < stream->subscriber_count; i++) {
+        CRSubscriber *subscriber = &stream->subscribers[i];
+        if (keyframe)
+            subscriber->waiting_keyframe = 0;
+        if (subscriber->waiting_keyframe)
+            continue;
+        if (subscriber->count == STREAMQUEUE) {
+            // too far behind, skip ahead to the next keyframe
+            CRDropSubscriberQueue(subscriber);
+            subscriber->waiting_keyframe = 1;
+            stream->force_keyframe = 1;
+            continue;
+        }
+        buffer->references++;
+        subscriber->queue[(subscriber->head + subscriber->count) % STREAMQUEUE] = buffer;
+        subscriber->count++;
+    }
+    CRReleaseStreamBuffer(buffer);
+    CRFlushSubscribers(stream);
+}
+// Watch a stream, applying its frames to the current context
+CRViewer *CRConnectStream(const char *address) {
+    int fd = CRSocket(address, 0);
+    if (fd < 0)
+        return 0; // TODO connection error
+    CRViewer *viewer = CRCalloc(1, sizeof(CRViewer), MEMORYOTHER);
+    viewer->fd = fd;
+    viewer->replay = CRCalloc(1, sizeof(CRReplay), MEMORYOTHER);
+    viewer->replay->current = -1;
+    return viewer;
+}
+// Read what's arrived and apply every whole frame. Returns the number of frames applied.
+int CRUpdateViewer(CRViewer *viewer) {
+    int applied = 0;
+    for (;;) {
+        if (viewer->capacity - viewer->size < 4096) {
+            // room for the biggest frame there can be, which gets applied before reading any more
+            if (viewer->capacity >= 2 * RECORDMAXFRAME)
+                break;
+            viewer->capacity = viewer->capacity == 0 ? 65536 : viewer->capacity * 2;
+            viewer->buffer = CRRealloc(viewer->buffer, viewer->capacity, MEMORYOTHER);
+        }
+        ssize_t size = recv(viewer->fd, viewer->buffer + viewer->size, viewer->capacity - viewer->size, 0);
+        if (size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            viewer->closed = 1;
+        if (size <= 0)
+            break;
+        viewer->size += size;
+    }
+    size_t offset = 0;
+    uint32_t header[3];
+    size_t header_size = sizeof(header) + sizeof(double);
+    while (viewer->size - offset >= header_size) {
+        memcpy(header, viewer->buffer + offset, sizeof(header));
+        if (header[1] > RECORDMAXFRAME || header[2] > RECORDMAXFRAME) {
+            // nothing after a frame this size can be trusted to line up
+            viewer->closed = 1;
+            offset = viewer->size;
+            break; // TODO corrupt stream error
+        }
+        if (viewer->size - offset < header_size + header[1])
+            break;
+        if (CRApplyStoredFrame(viewer->replay, viewer->buffer + offset + header_size, header[1], header[2]))
+            applied++;
+        offset += header_size + header[1];
+    }
+    memmove(viewer->buffer, viewer->buffer + offset, viewer->size - offset);
+    viewer->size -= offset;
+    return applied;
+}
+void CRCloseViewer(CRViewer *viewer) {
+    close(viewer->fd);
+    CRCloseReplay(viewer->replay);
+    CRFree(viewer->buffer);
+    CRFree(viewer);
+}
+#endif
+
+// Input
+// Terminal input arrives as bytes, with arrows and function keys spelled out as escape sequences.
+// All of it is decoded once per frame into a ring of events, in the order it was typed, and a count
+// of presses per key, so asking about a key costs nothing and keys arriving together aren't lost.
+// Terminals don't report releases, so a key is only ever pressed, never held.
+void CRPushInputEvent(int key, int codepoint) {
+    CRInput *input = &cr_config->input;
+    if (input->count == INPUTEVENTS)
+        return; // TODO input overflow, more than INPUTEVENTS keys in one frame
+    CRInputEvent *event = &input->events[(input->head + input->count) % INPUTEVENTS];
+    event->key = key;
+    event->codepoint = codepoint;
+    input->count++;
+    if (key <= 0 || key >= TERMKEYCOUNT)
+        return;
+    if (input->presses[key] == 0)
+        input->pressed_keys[input->pressed_count++] = key;
+    if (input->presses[key] < 255)
+        input->presses[key]++;
+}
+// Keys sent as ESC [ number ~
+int CRTildeKey(int number) {
+    switch (number) {
+        case 1: case 7: return TERMKEYHOME;
+        case 2: return TERMKEYINSERT;
+        case 3: return TERMKEYDELETE;
+        case 4: case 8: return TERMKEYEND;
+        case 5: return TERMKEYPAGEUP;
+        case 6: return TERMKEYPAGEDOWN;
+    }
+    if (number >= 11 && number <= 15)
+        return TERMKEYF1 + number - 11;
+    if (number >= 17 && number <= 21)
+        return TERMKEYF1 + 5 + number - 17;
+    if (number == 23 || number == 24)
+        return TERMKEYF1 + 10 + number - 23;
+    return 0;
+}
+// Decode the key at the start of data. Returns the bytes it took, or 0 if it's cut off.
+size_t CRDecodeInput(const unsigned char *data, size_t size) {
+    unsigned char c = data[0];
+    if (c == 27) {
+        // escape at the end could be the start of a sequence split across reads, it waits to see
+        if (size == 1)
+            return 0;
+        if (data[1] != '[' && data[1] != 'O') {
+            CRPushInputEvent(27, 0);
+            return 1;
+        }
+        size_t i = 2;
+        int number = 0;
+        int parameters = 0;
+        // modifiers come after a ; and are ignored
+        while (i < size && ((data[i] >= '0' && data[i] <= '9') || data[i] == ';')) {
+            if (data[i] == ';')
+                parameters++;
+            else if (parameters == 0 && number <= 99)
+                number = number * 10 + data[i] - '0'; // past any key code, a long run can't overflow
+            i++;
+        }
+        if (i == size)
+            return 0;
+        int key = 0;
+        switch (data[i]) {
+            case 'A': key = TERMKEYUP; break;
+            case 'B': key = TERMKEYDOWN; break;
+            case 'C': key = TERMKEYRIGHT; break;
+            case 'D': key = TERMKEYLEFT; break;
+            case 'H': key = TERMKEYHOME; break;
+            case 'F': key = TERMKEYEND; break;
+            case 'P': key = TERMKEYF1; break;
+            case 'Q': key = TERMKEYF1 + 1; break;
+            case 'R': key = TERMKEYF1 + 2; break;
+            case 'S': key = TERMKEYF1 + 3; break;
+            case '~': key = CRTildeKey(number); break;
+        }
+        // sequences that aren't keys are skipped whole
+        if (key != 0)
+            CRPushInputEvent(key, 0);
+        return i + 1;
+    }
+    if (c < 0x80) {
+        CRPushInputEvent(c, c >= ' ' && c != 127 ? c : 0);
+        return 1;
+    }
+    int length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    // a stray continuation byte
+    if (length == 1)
+        return 1;
+    if (size < length)
+        return 0;
+    int codepoint = c & (0x7F >> length);
+    for (int i = 1; i < length; i++) {
+        // not UTF-8 after all, skip the byte that started it
+        if ((data[i] & 0xC0) != 0x80)
+            return 1;
+        codepoint = (codepoint << 6) | (data[i] & 0x3F);
+    }
+    CRPushInputEvent(0, codepoint);
+    return length;
+}
+// Decode input bytes into the current context's events. A sequence cut off at the end waits for the
+// rest to be fed.
+void CRFeedInput(const char *bytes, size_t count) {
+    CRInput *input = &cr_config->input;
+    input->partial_age = 0;
+    size_t size = input->partial_size + count;
+    unsigned char *data = CRFrameAlloc(size);
+    memcpy(data, input->partial, input->partial_size);
+    memcpy(data + input->partial_size, bytes, count);
+    size_t used = 0;
+    while (used < size) {
+        size_t length = CRDecodeInput(data + used, size - used);
+        if (length == 0)
+            break;
+        used += length;
+    }
+    input->partial_size = size - used;
+    // longer than any key, so it's garbage
+    if (input->partial_size > sizeof(input->partial))
+        input->partial_size = 0;
+    memcpy(input->partial, data + used, input->partial_size);
+}
+// Called once a frame after input is fed. A key still cut off a whole frame after it arrived isn't
+// getting the rest of it, so a lone escape is the escape key and anything else is dropped.
+void CRFlushInput() {
+    CRInput *input = &cr_config->input;
+    if (input->partial_size == 0 || input->partial_age++ == 0)
+        return;
+    if (input->partial_size == 1 && input->partial[0] == 27)
+        CRPushInputEvent(27, 0);
+    input->partial_size = 0;
+}
+// Take the oldest event this frame, for text entry. Returns 0 when there are none left.
+int CRNextInputEvent(CRInputEvent *event) {
+    CRInput *input = &cr_config->input;
+    if (input->count == 0)
+        return 0;
+    *event = input->events[input->head];
+    input->head = (input->head + 1) % INPUTEVENTS;
+    input->count--;
+    return 1;
+}
+int CRTerminalKeyPresses(int key) {
+    if (key <= 0 || key >= TERMKEYCOUNT)
+        return 0;
+    return cr_config->input.presses[key];
+}
+int CRIsTerminalKeyPressed(int key) {
+    return CRTerminalKeyPresses(key) > 0;
+}
+// Forget this frame's input, only the keys pressed are cleared. With an update callback this runs
+// after each update step instead of each frame, so a press is seen by pre_draw and the one step
+// after it, and a frame that runs no steps keeps its presses for the next.
+void CREndInputFrame() {
+    CRInput *input = &cr_config->input;
+    for (size_t i = 0; i < input->pressed_count; i++)
+        input->presses[input->pressed_keys[i]] = 0;
+    input->pressed_count = 0;
+    input->head = 0;
+    input->count = 0;
+}
 #if TERMINAL
-int close_terminal = 0;
+// Drain everything typed since the last frame, a read at a time instead of a call per key
+void CRPollTerminalInput() {
+    char buffer[256];
+    ssize_t size;
+    while ((size = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0)
+        CRFeedInput(buffer, size);
+}
+#endif
+
+// Terminal Server
+// Serves many terminals from one process, each session drawing its own headless context. Input
+// from every session is read on one epoll loop, and each tick the sessions are shared out across a
+// thread pool that draws their frames and encodes only the cells that changed. A session whose
+// terminal is slow to read, or that was sent a frame less than frame_interval ago, skips encoding
+// and its next frame covers everything drawn since.
+#if SERVER
+void CRServerWork(CRServer *server);
+void *CRServerWorker(void *arg) {
+    CRServer *server = arg;
+    size_t generation = 0;
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (server->generation == generation && !server->stopping)
+            pthread_cond_wait(&server->start, &server->lock);
+        if (server->stopping)
+            break;
+        generation = server->generation;
+        pthread_mutex_unlock(&server->lock);
+        CRServerWork(server);
+        pthread_mutex_lock(&server->lock);
+        if (--server->busy == 0)
+            pthread_cond_signal(&server->done);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return 0;
+}
+CRServer *CRNewServer(CRConfig *assets, int width, int height, int thread_count) {
+    CRServer *server = CRCalloc(1, sizeof(CRServer), MEMORYOTHER);
+    if (server == 0)
+        return 0;
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd < 0) {
+        CRFree(server);
+        return 0; // TODO epoll error
+    }
+    server->assets = assets;
+    server->width = width;
+    server->height = height;
+    server->frame_interval = 1.0 / 30.0;
+    pthread_mutex_init(&server->lock, 0);
+    pthread_cond_init(&server->start, 0);
+    pthread_cond_init(&server->done, 0);
+    int workers = thread_count > 1 ? thread_count - 1 : 0;
+    if (workers > 0)
+        server->threads = CRAlloc(sizeof(pthread_t) * workers, MEMORYOTHER);
+    if (server->threads == 0)
+        workers = 0;
+    // only the workers that started are counted, the tick waits on and joins exactly those
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&server->threads[server->thread_count], 0, CRServerWorker, server) == 0)
+            server->thread_count++;
+    }
+    return server;
+}
+void CRFreeServer(CRServer *server) {
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->start);
+    pthread_mutex_unlock(&server->lock);
+    for (int i = 0; i < server->thread_count; i++)
+        pthread_join(server->threads[i], 0);
+    while (server->session_count > 0)
+        CRServerCloseSession(server, server->sessions[server->session_count - 1]);
+    CRFree(server->sessions);
+    CRFree(server->threads);
+    close(server->epoll_fd);
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->start);
+    pthread_cond_destroy(&server->done);
+    CRFree(server);
+}
+void CRSetServerCallbacks(CRServer *server, void (*open)(CRSession *session),
+        void (*input)(CRSession *session, const char *bytes, size_t count), void (*close)(CRSession *session)) {
+    server->open = open;
+    server->input = input;
+    server->close = close;
+}
+void CRSetServerFrameRate(CRServer *server, double frames_per_second) {
+    server->frame_interval = frames_per_second > 0 ? 1.0 / frames_per_second : 0;
+}
+// Serve a terminal already connected to fd, a socket or a pty. The server closes fd with the session.
+CRSession *CRServerAddSession(CRServer *server, int fd) {
+    CRSession *session = CRCalloc(1, sizeof(CRSession), MEMORYOTHER);
+    if (session == 0)
+        return 0;
+    session->fd = fd;
+    session->pty_slave = -1;
+    session->full_redraw = 1;
+    session->last_frame = -1;
+    session->context = CRNewContext(server->assets, server->width, server->height);
+    session->shown = CRCalloc(server->width * server->height, sizeof(CRCell), MEMORYOTHER);
+    // a full frame is the most one encode can write, and encoding never grows the buffer
+    session->output = CRAlloc(TERMFRAMEBYTES + TERMCELLBYTES * server->width * server->height, MEMORYOTHER);
+    if (session->context == 0 || session->shown == 0 || session->output == 0) {
+        if (session->context != 0)
+            CRFreeContext(session->context);
+        CRFree(session->shown);
+        CRFree(session->output);
+        CRFree(session);
+        return 0;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    int no_signal = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_signal, sizeof(no_signal));
+#endif
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    server->sessions = CRGrow(server->sessions, &server->session_capacity, server->session_count,
+            sizeof(CRSession *), MEMORYOTHER);
+    server->sessions[server->session_count++] = session;
+    if (server->open != 0) {
+        CRConfig *previous = CRGetConfig();
+        CRSetConfig(session->context);
+        (*server->open)(session);
+        CRSetConfig(previous);
+    }
+    return session;
+}
+// A session on a new pseudo-terminal, for trying the server locally: attach to pty_name with
+// something like `screen`, or open it and read the frames directly.
+CRSession *CRServerOpenPty(CRServer *server) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0)
+        return 0; // TODO pty error
+    if (grantpt(master) != 0 || unlockpt(master) != 0) {
+        close(master);
+        return 0;
+    }
+    char *name = ptsname(master);
+    int slave = name != 0 ? open(name, O_RDWR | O_NOCTTY | O_CLOEXEC) : -1;
+    if (slave < 0) {
+        close(master);
+        return 0;
+    }
+    // pass escape codes and keys through untouched
+    struct termios settings;
+    tcgetattr(slave, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(slave, TCSANOW, &settings);
+    CRSession *session = CRServerAddSession(server, master);
+    if (session == 0) {
+        close(slave);
+        close(master);
+        return 0;
+    }
+    session->pty_slave = slave;
+    snprintf(session->pty_name, sizeof(session->pty_name), "%s", name);
+    return session;
+}
+void CRServerCloseSession(CRServer *server, CRSession *session) {
+    for (size_t i = 0; i < server->session_count; i++) {
+        if (server->sessions[i] != session)
+            continue;
+        server->sessions[i] = server->sessions[--server->session_count];
+        break;
+    }
+    if (server->close != 0) {
+        CRConfig *previous = CRGetConfig();
+        CRSetConfig(session->context);
+        (*server->close)(session);
+        CRSetConfig(previous);
+    }
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, session->fd, 0);
+    close(session->fd);
+    if (session->pty_slave >= 0)
+        close(session->pty_slave);
+    CRFreeContext(session->context);
+    CRFree(session->shown);
+    CRFree(session->output);
+    CRFree(session);
+}
+// Send as much of the pending output as the terminal will take without blocking
+void CRServerFlush(CRSession *session) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    while (session->output_sent < session->output_size) {
+        // a player hanging up mustn't SIGPIPE the whole server, ptys aren't sockets and don't raise it
+        ssize_t written = send(session->fd, session->output + session->output_sent,
+                session->output_size - session->output_sent, flags);
+        if (written < 0 && errno == ENOTSOCK)
+            written = write(session->fd, session->output + session->output_sent,
+                    session->output_size - session->output_sent);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                session->closed = 1;
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        session->output_sent += written;
+    }
+}
+void CRServerFrame(CRServer *server, CRSession *session) {
+    if (session->closed)
+        return;
+    CRSetConfig(session->context);
+    CRServerFlush(session);
+    if (CRDrawFrame())
+        session->dirty = 1;
+    if (!session->dirty || session->output_sent < session->output_size)
+        return;
+    if (session->last_frame >= 0 && server->tick_time - session->last_frame < server->frame_interval)
+        return;
+    session->output_size = TermEncodeDiff(session->shown, session->context->cells, server->width, server->height,
+            session->full_redraw, session->output);
+    session->output_sent = 0;
+    session->full_redraw = 0;
+    session->dirty = 0;
+    session->last_frame = server->tick_time;
+    CRServerFlush(session);
+}
+void CRServerWork(CRServer *server) {
+    for (;;) {
+        size_t i = __atomic_fetch_add(&server->next_session, 1, __ATOMIC_RELAXED);
+        if (i >= server->session_count)
+            break;
+        CRServerFrame(server, server->sessions[i]);
+    }
+}
+// Read whatever input has arrived, waiting up to timeout_ms for some
+void CRServerPoll(CRServer *server, int timeout_ms) {
+    struct epoll_event events[64];
+    int count = epoll_wait(server->epoll_fd, events, 64, timeout_ms);
+    char buffer[4096];
+    CRConfig *previous = CRGetConfig();
+    for (int i = 0; i < count; i++) {
+        CRSession *session = events[i].data.ptr;
+        ssize_t size = read(session->fd, buffer, sizeof(buffer));
+        if (size == 0 || (size < 0 && errno != EAGAIN && errno != EINTR)) {
+            session->closed = 1;
+            continue;
+        }
+        if (size < 0)
+            continue;
+        CRSetConfig(session->context);
+        CRFeedInput(buffer, size);
+        if (server->input != 0)
+            (*server->input)(session, buffer, size);
+    }
+    CRSetConfig(previous);
+}
+// Draw and send a frame for every session
+void CRServerTick(CRServer *server) {
+    CRConfig *previous = CRGetConfig();
+    for (size_t i = 0; i < server->session_count; ) {
+        if (server->sessions[i]->closed)
+            CRServerCloseSession(server, server->sessions[i]);
+        else
+            i++;
+    }
+    server->tick_time = CRGetTime();
+    server->next_session = 0;
+    pthread_mutex_lock(&server->lock);
+    server->busy = server->thread_count;
+    server->generation++;
+    pthread_cond_broadcast(&server->start);
+    pthread_mutex_unlock(&server->lock);
+    CRServerWork(server);
+    pthread_mutex_lock(&server->lock);
+    while (server->busy > 0)
+        pthread_cond_wait(&server->done, &server->lock);
+    pthread_mutex_unlock(&server->lock);
+    CRSetConfig(previous);
+}
+void CRRunServer(CRServer *server) {
+    server->running = 1;
+    while (server->running) {
+        double next = CRGetTime() + server->frame_interval;
+        CRServerTick(server);
+        int wait = (next - CRGetTime()) * 1000;
+        CRServerPoll(server, wait > 0 ? wait : 0);
+    }
+}
+void CRStopServer(CRServer *server) {
+    server->running = 0;
+}
+#endif
 
+// Terminal rendering
+#if TERMINAL
 void CRInitTerm() {
     initscr();
     cbreak();
     noecho();
     nodelay(stdscr, TRUE);
     curs_set(0);
+    // input is read straight from stdin once a frame, see CRPollTerminalInput
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
 }
 
 void CRStopTerm() {
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) & ~O_NONBLOCK);
     curs_set(1);
     endwin();
 }
 
 void CRBeginTerminalCamera() {
-    camera_shift = 1;
+    cr_config->terminal_camera = 1;
 }
 void CREndTerminalCamera() {
-    camera_shift = 0;
+    cr_config->terminal_camera = 0;
 }
 
 int CRIsTerminalInput(int c) {
-    int ch = getch();
-    if (ch == c) {
-        return true;
-    } else if (ch == ERR) {
-        return false;
-    }
-    ungetch(ch);
-    return false;
+    return CRIsTerminalKeyPressed(c);
 }
 
 void CRTermDrawTile(CRTile *tile, Vector2 position, uint8_t mask) {
     if (tile->foreground.a == 0 && tile->background.a == 0)
         return;
-    if (camera_shift) {
+    if (cr_config->terminal_camera) {
         Camera2D *camera = CRGetMainCamera();
         position.x += camera->target.x;
         position.y += camera->target.y;
@@ -969,10 +6032,10 @@ void CRTermDrawTile(CRTile *tile, Vector2 position, uint8_t mask) {
 }
 
 void CRCloseTerminal() {
-    close_terminal = 1;
+    cr_config->should_close = 1;
 }
 
 int TerminalShouldClose() {
-    return close_terminal ? 1 : 0;
+    return cr_config->should_close ? 1 : 0;
 }
 #endif
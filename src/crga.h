@@ -20,9 +20,29 @@
 #define TERMINAL 0
 #endif
 
+#ifndef THREADS
+#if _WIN32
+#define THREADS 0
+#else
+#define THREADS 1
+#endif
+#endif
+
+#ifndef SERVER
+#if __linux__ && THREADS
+#define SERVER 1
+#else
+#define SERVER 0
+#endif
+#endif
+
 #include <raylib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#if THREADS
+#include <pthread.h>
+#endif
 #if TERMINAL
 #if _WIN32
 //#include <curses.h>
@@ -31,10 +51,76 @@
 #endif
 #endif
 
+// outline every tile on every layer, on top of the layers that ask for it with flag bit 5
+#ifndef GRID_OUTLINE
 #define GRID_OUTLINE 1
+#endif
 #define TRANSPARENT (Color){0,0,0,0}
 #define MAXLAYERMASKS 16
+// masks are summarized in square blocks of this many cells a side. Has to divide 64 so a block's
+// row never straddles two occupancy words.
+#define MASKBLOCK 8
+#define BLOCKHIDDEN 0
+#define BLOCKVISIBLE 1
+#define BLOCKMIXED 2
+#define MAXPALETTES 16
+#define PALETTESIZE 256
+// texture slot the palette is bound to while drawing palette layers
+#define PALETTESLOT 7
+// texture slot the tilemap is bound to while drawing shader layers
+#define TILEMAPSLOT 6
+// texture slot the animated tile table is bound to while drawing shader layers
+#define ANIMATIONSLOT 5
+// top byte of an animated tile's index, the low 16 bits are the animation
+#define ANIMATEDTILE 0xFF000000
+// glyph atlas pages are square textures this many pixels a side
+#define GLYPHPAGESIZE 512
+#define MAXGLYPHPAGES 8
 
+// Memory accounting categories
+#define MEMORYLAYERS 0
+#define MEMORYMASKS 1
+#define MEMORYASSOCS 2
+#define MEMORYFONTS 3
+#define MEMORYTILEMAPS 4
+#define MEMORYTEXT 5
+#define MEMORYFOV 6
+#define MEMORYPALETTES 7
+#define MEMORYARENA 8
+#define MEMORYANIMATION 9
+#define MEMORYOTHER 10
+#define MEMORYCATEGORIES 11
+typedef struct {
+    // bytes held now and the most ever held, by category. gpu is estimated from texture sizes.
+    size_t cpu[MEMORYCATEGORIES];
+    size_t cpu_peak[MEMORYCATEGORIES];
+    size_t gpu[MEMORYCATEGORIES];
+    size_t gpu_peak[MEMORYCATEGORIES];
+    size_t cpu_total;
+    size_t cpu_total_peak;
+    size_t gpu_total;
+    size_t gpu_total_peak;
+} CRMemoryStats;
+typedef struct {
+    size_t cpu;
+    size_t gpu;
+} CRMemoryUsage;
+// Where CRGA gets its memory from. reallocate is never given a null pointer.
+typedef struct {
+    void *user;
+    void *(*allocate)(void *user, size_t size);
+    void *(*reallocate)(void *user, void *pointer, size_t size);
+    void (*deallocate)(void *user, void *pointer);
+} CRAllocator;
+typedef struct {
+    unsigned char *data;
+    size_t used;
+    size_t capacity;
+    // the most used since the arena was made, it's grown to this on reset
+    size_t peak;
+    // allocations that didn't fit, freed on reset
+    struct CRArenaOverflow *overflow;
+} CRArena;
 typedef union {
     // character representation of the tile. 4 bytes to hold unicode values.
     char c[4];
@@ -51,13 +137,18 @@ typedef struct {
     // The solid color rendered behind the text character/tilemap
     Color background;
     // How opaque the tiles above this tile are.
-    // 255: Default, totally opaque
+    // 255: Default, totally opaque. The tile isn't drawn when a world layer above covers it.
     // 0: totally transparent
     uint8_t visibility;
 } CRTile;
 typedef struct CREntity{
     CRTile tile;
     Vector2 position;
+    // position before the last fixed update, drawn positions are interpolated from it
+    Vector2 previous_position;
+    // where a tweening entity is drawn, and its index in the tweens or -1
+    Vector2 visual_position;
+    int tween;
     struct CREntity *next;
     struct CREntity *prev;
 } CREntity;
@@ -65,6 +156,136 @@ typedef struct {
     CREntity *head;
     CREntity *tail;
 } CREntityList;
+typedef struct {
+    // the tile index shown for each frame, and for how many seconds
+    CRTileIndex *frames;
+    float *durations;
+    size_t frame_count;
+    // sum of the durations
+    float length;
+    // frame showing this frame
+    size_t current;
+} CRTileAnimation;
+typedef struct {
+    // cell the particles start from
+    Vector2 position;
+    // cells per second, each particle adds a random amount up to velocity_spread either way
+    Vector2 velocity;
+    Vector2 velocity_spread;
+    CRTileIndex tile;
+    Color color;
+    // seconds, give or take lifetime_spread
+    float lifetime;
+    float lifetime_spread;
+    // particles per second while active, 0 to only emit with CREmitParticles
+    float rate;
+    float accumulator;
+    uint8_t active;
+} CREmitter;
+// Fixed size pool of particles, one entry per particle at the same index in every array
+typedef struct CRParticles {
+    float *x;
+    float *y;
+    float *vx;
+    float *vy;
+    // seconds left, and seconds it started with
+    float *life;
+    float *lifetime;
+    CRTileIndex *tiles;
+    Color *colors;
+    size_t count;
+    size_t capacity;
+    // cells per second per second, applied to every particle
+    Vector2 acceleration;
+    CREmitter *emitters;
+    size_t emitter_count;
+    size_t emitter_capacity;
+    uint32_t random;
+} CRParticles;
+// Every line added to a layer's scrollback, oldest first, kept compact and only turned back into
+// tiles for the lines on the layer. A line is its cell count, then runs of cells sharing colors: the
+// run length, foreground and background, then that many tile indexes. Empty cells at the end of a
+// line aren't kept, and neither are shift and visibility.
+typedef struct CRScrollback {
+    unsigned char *data;
+    size_t data_size;
+    size_t data_capacity;
+    // where each line starts in data. Lines before first were dropped, and are compacted away once
+    // they make up half of the array.
+    size_t *starts;
+    size_t first;
+    size_t line_count;
+    size_t line_capacity;
+    // the oldest lines are dropped past this many, 0 for no limit
+    size_t max_lines;
+    // line at the top of the layer, and whether it follows the newest line
+    long view;
+    uint8_t follow;
+    // line the layer's rows currently hold from its top row, if materialized
+    long shown;
+    uint8_t materialized;
+} CRScrollback;
+#define COMMANDTILE 1
+#define COMMANDREGION 2
+#define COMMANDMASK 3
+#define COMMANDADDENTITY 4
+#define COMMANDMOVEENTITY 5
+// A change queued from another thread. Layers are referred to by index since the layer arrays can
+// move before the command is applied.
+typedef struct {
+    uint8_t type;
+    // 1: layer is a UI layer, 0: a world layer
+    uint8_t ui;
+    size_t layer;
+    Vector2 position;
+    union {
+        CRTile tile;
+        struct {
+            CRTile *tiles;
+            int width;
+            int height;
+        } region;
+        struct {
+            size_t index;
+            uint8_t value;
+        } mask;
+        CREntity *entity;
+    };
+} CRCommand;
+typedef struct {
+    size_t sequence;
+    CRCommand command;
+} CRCommandSlot;
+typedef struct {
+    CRCommandSlot *slots;
+    // capacity - 1, the capacity is a power of 2
+    size_t mask;
+    // head is only touched by the consumer, tail by producers, so keep them on separate cache lines
+    size_t head;
+    char head_padding[64 - sizeof(size_t)];
+    size_t tail;
+    char tail_padding[64 - sizeof(size_t)];
+} CRCommandQueue;
+#define EASELINEAR 0
+#define EASEIN 1
+#define EASEOUT 2
+#define EASEINOUT 3
+// Movement tweens, one entry per moving entity at the same index in every array
+typedef struct {
+    CREntity **entities;
+    float *from_x;
+    float *from_y;
+    float *to_x;
+    float *to_y;
+    float *elapsed;
+    float *duration;
+    // eased fraction of the way there, only used while updating
+    float *progress;
+    uint8_t *easing;
+    size_t count;
+    size_t capacity;
+    double last_time;
+} CRTweens;
 typedef struct {
     // transparency for a given tile. 
     // 0: Default, objects are made invisible
@@ -77,17 +298,91 @@ typedef struct {
     // 0 bit: 1 mask grid, 0 don't mask grid. 
     // 1 bit: 1 mask entities, 0 don't mask entities.
     uint8_t flags;
+    // lowest and highest value in each MASKBLOCK by MASKBLOCK block of the grid
+    uint8_t *block_min;
+    uint8_t *block_max;
+    int block_width;
+    int block_height;
 } CRMask;
+typedef struct {
+    Vector2 position;
+    int radius;
+    // brightness at the light, falling off linearly to 0 past the radius
+    uint8_t intensity;
+    uint8_t active;
+    // 1 when the light moved, changed, or an opaque cell in its reach changed
+    uint8_t dirty;
+    // what the light reaches, a square of (2 * map_radius + 1) cells a side centered on map_x, map_y.
+    // The position it was computed from is kept so the old area is cleared when the light moves.
+    uint8_t *map;
+    int map_x;
+    int map_y;
+    int map_radius;
+} CRLight;
+typedef struct {
+    // 0: light passes through
+    // 1: cell blocks light and sight
+    uint8_t *opacity;
+    int width;
+    int height;
+    // the mask the lights are written into, the same size as the opacity grid
+    size_t mask_index;
+    CRLight *lights;
+    size_t light_count;
+    size_t light_capacity;
+    // area of the mask that has to be rebuilt from the light maps
+    uint8_t dirty;
+    int dirty_left;
+    int dirty_top;
+    int dirty_right;
+    int dirty_bottom;
+} CRFOV;
+// Draws one tile of a layer. source is the layer's font, glyph atlas or tilemap, looked up once per
+// layer draw rather than once per tile.
+typedef void (*CRDrawTileKernel)(void *source, CRTile *tile, float tile_size, Vector2 position, uint8_t mask);
 typedef struct {
     CRTile *grid;
+    // one bit per tile, set when the tile isn't empty. Each row starts on a new word.
+    uint64_t *occupancy;
+    int occupancy_words;
     CREntityList entities;
+    // particle pool drawn over the entities, or 0
+    struct CRParticles *particles;
+    // lines kept for scrolling back through, or 0
+    struct CRScrollback *scrollback;
     Vector2 position;
     size_t mask_indexes[MAXLAYERMASKS];
     size_t mask_count;
     size_t tile_index;
+    size_t palette_index;
+    // Shader layers keep their tiles packed into a texture, width by height*3: tile index and mask,
+    // then foreground, then background, each row where it's stored in the grid. Only layer rows
+    // between dirty_top and dirty_bottom get re-uploaded.
+    Texture2D data_texture;
+    Color *data;
+    int dirty_top;// -1 when nothing is dirty
+    int dirty_bottom;
+    // BLOCKHIDDEN, BLOCKVISIBLE or BLOCKMIXED for each block of the layer. Blocks under the dirty
+    // area, in cells, are rebuilt from the masks before drawing, left is -1 when none need to be.
+    uint8_t *mask_blocks;
+    int mask_dirty_left;
+    int mask_dirty_top;
+    int mask_dirty_right;
+    int mask_dirty_bottom;
+    // Picked by CRSelectDrawKernel whenever the flags or masks change, so drawing a tile doesn't
+    // check the layer's mode. draw_missing stands in when tile_index isn't loaded.
+    CRDrawTileKernel draw_tile;
+    CRDrawTileKernel draw_missing;
     int width;
     int height;
+    // Rows are a ring so scrolling doesn't move tiles. Row 0 of the layer is stored at this row of
+    // the grid and occupancy, the rows below it follow and wrap around.
+    int scroll_row;
     uint8_t flags;// bit 0: 0 char or 1 img | bit 1: if img, use 1 character mapping or 0 index directly
+                  // bit 2: 1 colors are palette indexes
+                  // bit 3: if img, 1 draw the whole layer in one quad from the data texture
+                  // bit 4: if char, 1 tile_index is a glyph atlas instead of a font
+                  // bit 5: 1 outline every tile | bit 6: 1 don't draw tile backgrounds
 } CRLayer;
 typedef struct {
     Texture2D texture;
@@ -95,6 +390,232 @@ typedef struct {
     int height;
     size_t tile_count;
 } CRTilemap;
+typedef struct {
+    // Tiles on a palette layer store an index into this array in the red channel of their colors.
+    // The alpha channel is still used as the alpha.
+    Color colors[PALETTESIZE];
+    // Palette cycling. The range [cycle_start, cycle_start + cycle_length) rotates by
+    // cycle_speed entries per second. A speed of 0 turns cycling off.
+    uint8_t cycle_start;
+    uint8_t cycle_length;
+    float cycle_speed;
+    int cycle_offset;
+} CRPalette;
+typedef struct {
+    int codepoint;
+    // where in the font texture the glyph is, and where it's drawn relative to the text's top left
+    Rectangle source;
+    Rectangle dest;
+} CRGlyphPlacement;
+typedef struct {
+    // the key: a hash of everything below, with the text kept to check against on a match
+    uint64_t hash;
+    char *text;
+    // index into the context's fonts, -1 for raylib's default
+    int font;
+    float width;
+    float height;
+    float font_size;
+    float spacing;
+    int word_wrap;
+
+    CRGlyphPlacement *glyphs;
+    size_t glyph_count;
+    // everything the layout holds on the heap, counted against the cache budget
+    size_t bytes;
+    // frame the layout was last drawn on
+    uint32_t last_used;
+} CRTextLayout;
+typedef struct {
+    int codepoint;
+    // page the glyph is on, -1 for an empty slot in the table
+    int page;
+    Rectangle rec;
+    int offset_x;
+    int offset_y;
+    int advance_x;
+} CRGlyphSlot;
+typedef struct {
+    // the font file, kept so glyphs can be rasterized the first time they're drawn
+    unsigned char *file_data;
+    int file_size;
+    int size;
+    Texture2D pages[MAXGLYPHPAGES];
+    // last frame a glyph on each page was drawn, the oldest page is cleared out when all are full
+    uint32_t page_used[MAXGLYPHPAGES];
+    int page_count;
+    // page glyphs are being packed into, row by row
+    int current_page;
+    int shelf_x;
+    int shelf_y;
+    int shelf_height;
+    // open addressing hash table of rasterized glyphs by codepoint, glyph_capacity is a power of 2
+    CRGlyphSlot *glyphs;
+    size_t glyph_count;
+    size_t glyph_capacity;
+} CRGlyphAtlas;
+// A character association as a bundle stores it, the character padded with zeros
+typedef struct {
+    char character[4];
+    int32_t index;
+} CRBundleAssoc;
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    // associations are written as one table when the bundle is saved
+    CRBundleAssoc *assocs;
+    size_t assoc_count;
+    size_t assoc_capacity;
+} CRBundle;
+typedef struct {
+    Vector2 position;
+    CRTile tile;
+} CRCapturedEntity;
+typedef struct {
+    int width;
+    int height;
+    // the tiles as last written, packed field by field
+    unsigned char *tiles;
+    CRCapturedEntity *entities;
+    size_t entity_count;
+    size_t entity_capacity;
+} CRCapturedLayer;
+typedef struct {
+    int width;
+    int height;
+    uint8_t *grid;
+} CRCapturedMask;
+// The scene as of the last captured frame, so the next one only has to hold what changed
+typedef struct {
+    // world layers first, then UI layers
+    CRCapturedLayer *layers;
+    size_t world_layer_count;
+    size_t layer_count;
+    CRCapturedMask *masks;
+    size_t mask_count;
+    uint32_t frame;
+    double start_time;
+    // the last frame encoded
+    CRBundle encoded;
+} CRCapture;
+typedef struct {
+    FILE *file;
+    CRCapture capture;
+    // frames between keyframes
+    int keyframe_interval;
+    int since_keyframe;
+} CRRecorder;
+typedef struct {
+    long offset;
+    double time;
+    uint32_t stored_size;
+    uint32_t size;
+    uint8_t keyframe;
+} CRReplayRecord;
+typedef struct {
+    CREntity *entities;
+    size_t entity_count;
+    size_t entity_capacity;
+} CRReplayLayer;
+typedef struct {
+    FILE *file;
+    CRReplayRecord *records;
+    size_t record_count;
+    size_t record_capacity;
+    // record last applied, -1 before the first
+    long current;
+    // playback clock, in recorded seconds
+    double time;
+    // the replay owns the entities it puts on the context's layers
+    CRReplayLayer *layers;
+    size_t layer_count;
+    // how many of layers are world layers, as the last decoded frame split them
+    size_t world_layer_count;
+    unsigned char *buffer;
+    size_t buffer_capacity;
+} CRReplay;
+// One encoded frame, shared by every subscriber it's queued for
+typedef struct {
+    int references;
+    size_t size;
+    unsigned char data[];
+} CRStreamBuffer;
+// frames a subscriber can fall behind before it skips ahead to the next keyframe
+#define STREAMQUEUE 32
+typedef struct {
+    int fd;
+    // ring of frames waiting to be sent, sent bytes of the first one are already out
+    CRStreamBuffer *queue[STREAMQUEUE];
+    size_t head;
+    size_t count;
+    size_t sent;
+    uint8_t waiting_keyframe;
+    uint8_t closed;
+} CRSubscriber;
+typedef struct {
+    int listen_fd;
+    // for a Unix socket, removed when the stream stops
+    char path[108];
+    CRSubscriber *subscribers;
+    size_t subscriber_count;
+    size_t subscriber_capacity;
+    CRCapture capture;
+    int keyframe_interval;
+    int since_keyframe;
+    uint8_t force_keyframe;
+} CRStream;
+typedef struct {
+    int fd;
+    CRReplay *replay;
+    // bytes received that don't make up a whole frame yet
+    unsigned char *buffer;
+    size_t size;
+    size_t capacity;
+    uint8_t closed;
+} CRViewer;
+// Keys past the byte range, for the ones terminals send as escape sequences
+#define TERMKEYUP 256
+#define TERMKEYDOWN 257
+#define TERMKEYRIGHT 258
+#define TERMKEYLEFT 259
+#define TERMKEYHOME 260
+#define TERMKEYEND 261
+#define TERMKEYINSERT 262
+#define TERMKEYDELETE 263
+#define TERMKEYPAGEUP 264
+#define TERMKEYPAGEDOWN 265
+// F1 to F12 follow in order
+#define TERMKEYF1 266
+#define TERMKEYCOUNT 278
+#define INPUTEVENTS 256
+typedef struct {
+    // the byte, a TERMKEY, or 0 for a character past ASCII
+    int key;
+    // the character it types, 0 for keys that don't type one
+    int codepoint;
+} CRInputEvent;
+typedef struct {
+    // ring of this frame's events, oldest first
+    CRInputEvent events[INPUTEVENTS];
+    size_t head;
+    size_t count;
+    // times each key was pressed this frame, and which keys those were so they can be cleared
+    uint8_t presses[TERMKEYCOUNT];
+    uint16_t pressed_keys[TERMKEYCOUNT];
+    size_t pressed_count;
+    // the start of a key that was cut off at the end of the last read
+    unsigned char partial[16];
+    size_t partial_size;
+    // frames the partial key has waited without more bytes arriving
+    uint8_t partial_age;
+} CRInput;
+// What a headless context draws into, a character cell
+typedef struct {
+    CRTileIndex index;
+    Color foreground;
+    Color background;
+} CRCell;
 typedef struct CRCharIndexAssoc{
     char character[4];
     int index;
@@ -108,6 +629,8 @@ typedef struct {
     char *title;
 
     float tile_size;
+    // size text is drawn at, SDF fonts stay sharp at any size
+    float font_size;
 
     int default_layer_width;
     int default_layer_height;
@@ -118,11 +641,27 @@ typedef struct {
 
     CRLayer *world_layers;
     size_t world_layer_count;
+    size_t world_layer_capacity;
     CRLayer *ui_layers;
     size_t ui_layer_count;
+    size_t ui_layer_capacity;
 
     CRMask *masks;
     size_t mask_count;
+    size_t mask_capacity;
+
+    CRFOV *fovs;
+    size_t fov_count;
+    size_t fov_capacity;
+
+    // For each cell of the world, 1 + the index of the topmost world layer with a fully opaque tile
+    // there, or 0 if there isn't one. Rows occlusion_top to occlusion_bottom are rebuilt before
+    // drawing, top is -1 when none need to be.
+    uint8_t *occlusion;
+    int occlusion_width;
+    int occlusion_height;
+    int occlusion_top;
+    int occlusion_bottom;
 
     Camera2D main_camera;
 
@@ -131,28 +670,214 @@ typedef struct {
     CRCharIndexAssoc char_index_assoc[255];
     CRCharIndexAssoc *assocs;
     size_t assoc_count;
+    size_t assoc_capacity;
+    // the association table of the last bundle loaded, looked up where it's mapped. bundle_assoc_starts
+    // has where each first byte's entries begin, and one past the end.
+    const uint32_t *bundle_assoc_starts;
+    CRBundleAssoc *bundle_assocs;
+    void *bundle_mapping;
+    size_t bundle_mapping_size;
 
     Font *fonts;
     size_t font_count;
+    size_t font_capacity;
+    // bit 0: 1 the font is a signed distance field
+    uint8_t font_flags[255];
+    Shader sdf_shader;
 
     CRTilemap *tilemaps;
     size_t tilemap_count;
+    size_t tilemap_capacity;
+
+    CRGlyphAtlas *glyph_atlases;
+    size_t glyph_atlas_count;
+    size_t glyph_atlas_capacity;
+
+    CRPalette *palettes;
+    size_t palette_count;
+    size_t palette_capacity;
+    // one row per palette, sampled by the palette shader
+    Texture2D palette_texture;
+    Shader palette_shader;
+    // palette used by every palette layer, -1 to let each layer use its own
+    int palette_override;
+    // multiplied with every color drawn through a palette or a shader layer
+    Color palette_tint;
+
+    // draws shader layers from their data texture
+    Shader layer_shader;
+
+    // laid out text, least recently used layouts are dropped once they use more than the budget
+    CRTextLayout *text_layouts;
+    size_t text_layout_count;
+    size_t text_layout_capacity;
+    // hash table of layout index + 1, see CRGetTextLayout
+    size_t *text_layout_slots;
+    size_t text_layout_slot_count;
+    size_t text_cache_bytes;
+    size_t text_cache_budget;
+
+    // number of frames drawn so far
+    uint32_t frame;
+
+    CRAllocator allocator;
+    // scratch memory that's thrown away at the start of every frame
+    CRArena frame_arena;
+    // 1: print memory usage to stderr in CRClose
+    uint8_t dump_memory;
+
+    // 1: only draw frames when something changed, see CRSetRenderOnDemand
+    uint8_t render_on_demand;
+    uint8_t redraw;
+    int animations;
+    Camera2D drawn_camera;
+    // seconds to wait for input between checks while nothing is changing
+    float idle_timeout;
+
+    // fixed timestep, see CRSetUpdate
+    double update_step;
+    int max_update_steps;
+    double update_accumulator;
+    double last_update_time;
+    // how far between the last two updates to draw entities, 0 to 1
+    float update_alpha;
+    uint8_t interpolating;
+
+    CRTweens tweens;
+
+    CRTileAnimation *tile_animations;
+    size_t tile_animation_count;
+    size_t tile_animation_capacity;
+    // current frame of every animation, for shader layers
+    Texture2D tile_animation_texture;
+    uint8_t tile_animation_table_stale;
+
+    // when particles were last moved, -1 before the first update
+    double particle_time;
+
+    // changes from other threads, applied by CRLoop
+    CRCommandQueue commands;
+
+    void (*world_draw)();
+    void (*ui_draw)();
+    void (*pre_draw)();
+    void (*post_draw)();
+    void (*update)();
+    void (*render)(float alpha);
+
+    // terminal and cell drawing are inside the camera
+    uint8_t terminal_camera;
+    uint8_t should_close;
+
+    // 0 when fonts, tilemaps and associations belong to another context
+    uint8_t owns_assets;
+    uint8_t headless;
+    CRCell *cells;
+    int cell_width;
+    int cell_height;
+
+    // every drawn frame is recorded while this is set
+    CRRecorder *recorder;
+    // and published to spectators while this is
+    CRStream *stream;
+
+    CRInput input;
 } CRConfig;
+#if SERVER
+// A connected terminal, with its own headless context and a copy of what its screen shows
+typedef struct CRSession {
+    int fd;
+    // the other end of a pseudo-terminal stand-in, kept open so the session outlives its readers
+    int pty_slave;
+    char pty_name[64];
+    CRConfig *context;
+    CRCell *shown;
+    uint8_t full_redraw;
+    // a frame was drawn that hasn't been sent yet
+    uint8_t dirty;
+    double last_frame;
+    // encoded escape codes, output_sent of output_size written so far
+    char *output;
+    size_t output_size;
+    size_t output_sent;
+    uint8_t closed;
+    void *user;
+} CRSession;
+typedef struct CRServer {
+    CRSession **sessions;
+    size_t session_count;
+    size_t session_capacity;
+    int epoll_fd;
+    // contexts borrow their assets from here
+    CRConfig *assets;
+    int width;
+    int height;
+    // each session gets a frame at most this often, anything drawn in between is coalesced
+    double frame_interval;
+    // CRRunServer keeps going until CRStopServer
+    uint8_t running;
+
+    void (*open)(CRSession *session);
+    void (*input)(CRSession *session, const char *bytes, size_t count);
+    void (*close)(CRSession *session);
+
+    // the pool that draws and encodes sessions, the calling thread makes one more
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation;
+    int busy;
+    uint8_t stopping;
+    size_t next_session;
+    double tick_time;
+} CRServer;
+#endif
 
 // Init
 void CRInit();// malloc
 void CRInitConfig(CRConfig *config);
 void CRSetConfig(CRConfig *config);
+CRConfig *CRGetConfig();
 void CRInitCharIndexAssoc();
 void CRInitWindow();
 
+// Memory
+void CRSetAllocator(CRAllocator allocator);
+void *CRAlloc(size_t size, uint8_t category);
+void *CRCalloc(size_t count, size_t size, uint8_t category);
+void *CRRealloc(void *pointer, size_t size, uint8_t category);
+void CRFree(void *pointer);
+void *CRArenaAlloc(CRArena *arena, size_t size);// malloc
+void CRArenaReset(CRArena *arena);// malloc
+void CRArenaFree(CRArena *arena);
+void *CRFrameAlloc(size_t size);
+
+// Memory Accounting
+void CRTrackMemory(uint8_t category, size_t bytes);
+void CRUntrackMemory(uint8_t category, size_t bytes);
+void CRTrackTexture(uint8_t category, Texture2D texture);
+void CRUntrackTexture(uint8_t category, Texture2D texture);
+CRMemoryStats CRGetMemoryStats();
+CRMemoryUsage CRLayerMemory(CRLayer *layer);
+CRMemoryUsage CRMaskMemory(size_t index);
+CRMemoryUsage CRFontMemory(size_t index);
+CRMemoryUsage CRTilemapMemory(size_t index);
+void CRDumpMemory();
+
 // Cleanup Functions
 void CRClose();
 void CRUnloadLayers();
 void CRUnloadFonts();
+void CRUnloadGlyphAtlases();
 void CRUnloadCharIndexAssoc();
 void CRUnloadTilemaps();
 void CRUnloadMasks();
+void CRUnloadPalettes();
+void CRUnloadFOVs();
+void CRUnloadOcclusion();
+void CRUnloadTextLayouts();
 
 // Loop
 void CRLoop();
@@ -160,22 +885,62 @@ void CRSetWorldDraw(void (*newFunc)());
 void CRSetUIDraw(void (*newFunc)());
 void CRSetPreDraw(void (*newFunc)());
 void CRSetPostDraw(void (*newFunc)());
+void CRSetUpdate(void (*newFunc)());
+void CRSetRender(void (*newFunc)(float alpha));
+void CRSetUpdateRate(double steps_per_second, int max_steps);
+double CRGetTime();
+Vector2 CREntityDrawPosition(CREntity *entity);
+void CRSetRenderOnDemand(int enabled);
+void CRRequestRedraw();
+void CRBeginAnimation();
+void CREndAnimation();
+int CRDrawFrame();
+void CRDrawScreen();
+
+// Contexts
+CRConfig *CRNewContext(CRConfig *shared, int width, int height);// malloc
+void CRFreeContext(CRConfig *config);
+
+// Cell Rendering
+CRCell *CRGetCells();
+CRCell *CRGetCell(Vector2 position);
+void CRCellDrawTile(CRTile *tile, Vector2 position, uint8_t mask);
+void CRDrawLayerCells(CRLayer *layer);
+void CRDrawCells();
 
 // Font Loading
 void CRLoadFont(const char *font_path);
 void CRLoadFontSize(const char *font_path, int size);// malloc, realloc
+void CRLoadFontSDF(const char *font_path, int size);// malloc, realloc
+size_t CRLoadGlyphAtlas(const char *font_path, int size);// malloc, realloc
+CRGlyphSlot *CRGetGlyph(CRGlyphAtlas *atlas, int codepoint);// malloc
+void CRPreloadGlyphs(size_t atlas, const char *text);
 
 // Tilemap Loading
 void CRLoadTilemap(const char *tilemap_path, int tile_width, int tile_height);// malloc
+CRBundleAssoc *CRFindBundleAssoc(char *character);
 void CRSetCharAssoc(char *character, int index);// malloc, realloc
 
+// Asset Bundles
+CRBundle CRNewBundle();// malloc
+void CRBundleWrite(CRBundle *bundle, const void *data, size_t size);// realloc
+void CRBundleTilemap(CRBundle *bundle, const char *tilemap_path, int tile_width, int tile_height);
+void CRBundleTilemapImage(CRBundle *bundle, Image image, int tile_width, int tile_height);
+void CRBundleFont(CRBundle *bundle, const char *font_path, int size, int sdf);
+void CRBundleCharAssoc(CRBundle *bundle, char *character, int index);// realloc
+void CRBundleCharAssocs(CRBundle *bundle);
+int CRSaveBundle(CRBundle *bundle, const char *path);
+void CRFreeBundle(CRBundle *bundle);
+void CRUnmapBundle(void *data, size_t size);
+int CRLoadBundle(const char *path);// malloc, realloc
+
 // Configuration
 void CRTileImage();
 void CRTileChar();
 
 // Layers
 CRLayer CRNewLayer();
-void CRInitGrid(CRLayer *layer);// malloc
+int CRInitGrid(CRLayer *layer);// malloc
 CRLayer CRInitLayer();
 void CRSetWorldLayer(int index, CRLayer layer);
 void CRSetUILayer(int index, CRLayer layer);
@@ -188,20 +953,98 @@ void CRAppendUILayer(CRLayer layer);// malloc, realloc
 void CRInitWorld();
 void CRInitUI();
 void CRSetLayerFlags(CRLayer *layer, int flags);
+void CRSelectDrawKernel(CRLayer *layer);
+void CRSetLayerPosition(CRLayer *layer, Vector2 position);
 void CRSetWorldFlags(int flags);
 void CRSetUIFlags(int flags);
+int CRIsWorldLayer(CRLayer *layer);
+void CRMarkOcclusionDirty(int top, int bottom);
+void CRMarkLayerDirty(CRLayer *layer, int top, int bottom);
 
 // Mask
 size_t CRNewMask(int width, int height, uint8_t flags, Vector2 position);// malloc, realloc
 void CRAddMaskToLayer(size_t mask_index, CRLayer *layer);
+void CRMoveMask(size_t mask_index, Vector2 position);
+void CRMarkMaskBlocksDirty(CRLayer *layer, int left, int top, int right, int bottom);
+void CRMarkMaskAreaDirty(size_t mask_index, int left, int top, int right, int bottom);
+void CRMarkMaskDirty(size_t mask_index, Vector2 position);
 void CRSetWorldMask(Vector2 position, uint8_t mask_value);
 void CRSetUIMask(Vector2 position, uint8_t mask_value);
+void CRSetMaskValue(size_t mask_index, Vector2 position, uint8_t mask_value);
+void CRUpdateMaskBlocks(CRMask *mask, int left, int top, int right, int bottom);
+void CRLayerMaskBlocks(CRLayer *layer);// malloc
 uint8_t CRMaskTile(CRLayer *layer, Vector2 position, uint8_t flags);
 
+// Field of view and lighting
+size_t CRNewFOV(size_t mask_index);// malloc, realloc
+void CRSetOpacity(size_t fov, Vector2 position, uint8_t opaque);
+size_t CRAddLight(size_t fov, Vector2 position, int radius, uint8_t intensity);// realloc
+void CRMoveLight(size_t fov, size_t light, Vector2 position);
+void CRSetLight(size_t fov, size_t light, int radius, uint8_t intensity);
+void CRRemoveLight(size_t fov, size_t light);
+void CRUpdateFOV(size_t fov);// malloc
+void CRUpdateFOVThreaded(size_t fov, int thread_count);// malloc
+
+// Palettes
+size_t CRNewPalette(Color *colors, size_t count);// malloc, realloc
+void CRSetPaletteColor(size_t palette, uint8_t index, Color color);
+void CRSetPaletteCycle(size_t palette, uint8_t start, uint8_t length, float speed);
+void CRSetLayerPalette(CRLayer *layer, size_t palette);
+void CRSetGlobalPalette(int palette);
+void CRSetPaletteTint(Color tint);
+Color CRPaletteColor(uint8_t index);
+void CRUpdatePalettes();
+void CRBeginPaletteMode(CRLayer *layer);
+void CREndPaletteMode();
+
 // Entities
 CREntity CRNewEntity(CRTile tile, Vector2 position);
+void CRMoveEntity(CREntity *entity, Vector2 position);
+void CRSetEntityTile(CREntity *entity, CRTile tile);
 void CRAddEntity(CREntity *entity);
 void CRAddEntityToLayer(CRLayer *layer, CREntity *entity);
+void CRRemoveEntity(CRLayer *layer, CREntity *entity);
+
+// Command Queue
+int CRNewCommandQueue(size_t capacity);// malloc
+void CRUnloadCommandQueue();
+int CRQueueCommand(CRConfig *config, CRCommand command);
+int CRNextCommand(CRCommand *command);
+void CRApplyCommands();
+int CRQueueLayerTile(CRConfig *config, uint8_t ui, size_t layer, CRTile tile, Vector2 position);
+int CRQueueLayerRegion(CRConfig *config, uint8_t ui, size_t layer, Vector2 top_left, int width, int height, const CRTile *tiles);// malloc
+int CRQueueMaskValue(CRConfig *config, size_t mask, Vector2 position, uint8_t value);
+int CRQueueAddEntity(CRConfig *config, uint8_t ui, size_t layer, CREntity *entity);
+int CRQueueMoveEntity(CRConfig *config, CREntity *entity, Vector2 position);
+
+// Particles
+void CRNewParticles(CRLayer *layer, size_t capacity);// malloc
+void CRUnloadParticles(CRLayer *layer);
+CREmitter CRNewEmitter(CRTileIndex tile, Color color, Vector2 position);
+size_t CRAddEmitter(CRLayer *layer, CREmitter emitter);// malloc, realloc
+CREmitter *CRGetEmitter(CRLayer *layer, size_t emitter);
+void CREmitParticle(CRLayer *layer, Vector2 position, Vector2 velocity, CRTileIndex tile, Color color, float lifetime);
+void CREmitParticles(CRLayer *layer, size_t emitter, int count);
+void CRUpdateParticles(CRLayer *layer, float delta);
+void CRRunParticles();
+void CRDrawParticles(CRLayer *layer);
+
+// Scrollback
+void CRNewScrollback(CRLayer *layer, size_t max_lines);// malloc
+void CRUnloadScrollback(CRLayer *layer);
+void CRAddScrollbackLine(CRLayer *layer, CRTile *tiles, int count);// realloc
+void CRAddScrollbackText(CRLayer *layer, char *text, Color foreground, Color background);// realloc
+void CRSetScrollbackView(CRLayer *layer, long line);
+void CRScrollScrollback(CRLayer *layer, long lines);
+void CRFollowScrollback(CRLayer *layer);
+size_t CRScrollbackLineCount(CRLayer *layer);
+
+// Tweens
+void CRTweenEntity(CREntity *entity, Vector2 to, float duration, uint8_t easing);// malloc, realloc
+void CRCancelTween(CREntity *entity);
+void CRUpdateTweens(float delta);
+void CRRunTweens();
+void CRUnloadTweens();
 
 // Tiles
 CRTile CRDefaultTileConfig(int index);
@@ -211,6 +1054,8 @@ void CRSetGridTile(CRTile *grid, CRTile tile, Vector2 position, int width, int h
 void CRSetLayerTile(CRLayer *layer, CRTile tile, Vector2 position);
 void CRSetLayerTileChar(CRLayer *layer, char *string, Vector2 position);
 void CRSetLayerTileIndex(CRLayer *layer, int index, Vector2 position);
+void CRClearLayer(CRLayer *layer);
+void CRScrollLayer(CRLayer *layer, int lines);
 void CRSetWorldTile(CRTile tile, Vector2 position);
 void CRSetUITile(CRTile tile, Vector2 position);
 void CRSetWorldTileChar(char *character, Vector2 position);
@@ -219,13 +1064,26 @@ void CRSetWorldTileIndex(int index, Vector2 position);
 void CRSetUITileIndex(int index, Vector2 position);
 void CRSetWorldLayerTile(int index, CRTile tile, Vector2 position);
 void CRSetUILayerTile(int index, CRTile tile, Vector2 position);
+
+// Animated Tiles
+size_t CRNewTileAnimation(CRTileIndex *frames, float *durations, size_t frame_count);// malloc, realloc
+CRTile CRAnimatedTile(size_t animation);
+int CRIsAnimatedTile(CRTileIndex index);
+CRTileIndex CRTileAnimationFrame(CRTileIndex index);
+void CRUpdateTileAnimations(double time);
+void CRUnloadTileAnimations();
 // Draw Tiles
 int CRCharToIndex(char *character);
 void CRDrawTile(CRTile *tile, uint8_t tilemap_flags, size_t index, float tile_size, 
         Vector2 position, uint8_t mask);
 void CRDrawTileChar(CRTile *tile, Font *font, float tile_size, Vector2 position, uint8_t mask);
 void CRDrawTileImage(CRTile *tile, CRTilemap *tilemap, int char_index, float tile_size, Vector2 position, uint8_t mask);
+void CRDrawTileGlyph(CRTile *tile, CRGlyphAtlas *atlas, float tile_size, Vector2 position, uint8_t mask);
 void CRDrawLayer(CRLayer *layer);
+void CRUpdateOcclusion();// malloc
+void CRUploadLayerRows(CRLayer *layer, int top, int rows);
+void CRUploadLayerData(CRLayer *layer);// malloc
+void CRDrawShaderLayer(CRLayer *layer);
 
 // Camera functions
 Camera2D *CRGetMainCamera();
@@ -244,14 +1102,77 @@ void CRDrawTileRectangle(CRLayer *layer, Vector2 top_left, Vector2 bottom_right,
 void CRDrawUITileRectangle(Vector2 top_left, Vector2 bottom_right, 
         CRTile tl, CRTile t, CRTile tr, CRTile r, CRTile br, CRTile b, CRTile bl, CRTile l, CRTile fill);
 
+// Text Rendering
+void CRDrawTextString(CRLayer *layer, char *text, Color tile_color, Color text_color, Font *font, Vector2 start,
+        float tile_size, int width, int height, int word_wrap);
+CRTextLayout *CRGetTextLayout(int font, const char *text, Rectangle rec, float font_size, float spacing,
+        int word_wrap);// malloc
+void CRDrawTextLayout(CRTextLayout *layout, Vector2 position, Color tint);
+void CRSetTextCacheBudget(size_t bytes);
+void CRLayoutTextTiles(CRLayer *layer, const char *text, Vector2 top_left, int width, int height, int word_wrap,
+        Color foreground, Color background);
+
 // Window Information
 Vector2 CRCameraOffset();
 Vector2 CRScreenSize();
 
+// Recording
+void CRFreeCapture(CRCapture *capture);
+int CRCaptureMatches(CRCapture *capture);
+int CRCaptureFrame(CRCapture *capture, int keyframe);// malloc, realloc
+int CRApplyCapturedFrame(CRReplay *replay, const unsigned char *data, size_t size);// malloc, realloc
+int CRStartRecording(const char *path, int keyframe_interval);// malloc
+void CRRecordFrame(CRRecorder *recorder);// realloc
+void CRStopRecording();
+CRReplay *CROpenReplay(const char *path);// malloc
+void CRCloseReplay(CRReplay *replay);
+int CRReplayFrame(CRReplay *replay, size_t index);// malloc
+int CRReplayNext(CRReplay *replay);
+int CRReplayAdvance(CRReplay *replay, double seconds);
+size_t CRReplayFrameCount(CRReplay *replay);
+unsigned char *CRCompressFrame(CRBundle *frame, int *stored_size);// malloc
+int CRApplyStoredFrame(CRReplay *replay, const unsigned char *stored, size_t stored_size, size_t size);
+
+// Spectator Streaming
+#if !_WIN32
+int CRStartStream(const char *address, int keyframe_interval);// malloc
+void CRStopStream();
+void CRServiceStream(CRStream *stream);// realloc
+void CRStreamFrame(CRStream *stream);// malloc
+CRViewer *CRConnectStream(const char *address);// malloc
+int CRUpdateViewer(CRViewer *viewer);// realloc
+void CRCloseViewer(CRViewer *viewer);
+#endif
+
+// Input
+void CRFeedInput(const char *bytes, size_t count);
+int CRNextInputEvent(CRInputEvent *event);
+int CRTerminalKeyPresses(int key);
+int CRIsTerminalKeyPressed(int key);
+void CRFlushInput();
+void CREndInputFrame();
+
+// Terminal Server
+#if SERVER
+CRServer *CRNewServer(CRConfig *assets, int width, int height, int thread_count);// malloc
+void CRFreeServer(CRServer *server);
+void CRSetServerCallbacks(CRServer *server, void (*open)(CRSession *session),
+        void (*input)(CRSession *session, const char *bytes, size_t count), void (*close)(CRSession *session));
+void CRSetServerFrameRate(CRServer *server, double frames_per_second);
+CRSession *CRServerAddSession(CRServer *server, int fd);// malloc
+CRSession *CRServerOpenPty(CRServer *server);// malloc
+void CRServerCloseSession(CRServer *server, CRSession *session);
+void CRServerPoll(CRServer *server, int timeout_ms);
+void CRServerTick(CRServer *server);
+void CRRunServer(CRServer *server);
+void CRStopServer(CRServer *server);
+#endif
+
 // Terminal rendering
 #if TERMINAL
 void CRInitTerm();
 void CRStopTerm();
+void CRPollTerminalInput();
 void CRBeginTerminalCamera();
 void CREndTerminalCamera();
 int CRIsTerminalInput(int c);
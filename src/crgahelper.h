@@ -21,8 +21,15 @@
 
 #include "crga.h"
 #include <raylib.h>
+#include <string.h>
 
-static void DrawTextBoxed(Font *font, CRLayer *layer, const char *text, Rectangle rec, float fontSize, float spacing, int wordWrap, Color tint) {
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+
+// Runs the word wrap without drawing anything, recording where each glyph goes relative to the top
+// left of rec. out needs room for one glyph per byte of text. Returns the number of glyphs placed.
+static size_t LayoutTextBoxed(Font *font, const char *text, Rectangle rec, float fontSize, float spacing, int wordWrap, CRGlyphPlacement *out) {
+    size_t count = 0;
     int length = TextLength(text);  // Total length in bytes of the text, scanned by codepoints in loop
 
     float textOffsetY = 0;          // Offset between lines (on line break '\n')
@@ -107,9 +114,16 @@ static void DrawTextBoxed(Font *font, CRLayer *layer, const char *text, Rectangl
                 if ((textOffsetY + font->baseSize*scaleFactor) > rec.height)
                     break;
 
-                // Draw current character glyph
+                // Place current character glyph, the same way DrawTextCodepoint would draw it
                 if ((codepoint != ' ') && (codepoint != '\t')) {
-                    DrawTextCodepoint(*font, codepoint, (Vector2){ rec.x + textOffsetX, rec.y + textOffsetY }, fontSize, tint);
+                    float padding = font->glyphPadding;
+                    CRGlyphPlacement *glyph = &out[count++];
+                    glyph->codepoint = codepoint;
+                    glyph->source = (Rectangle){ font->recs[index].x - padding, font->recs[index].y - padding,
+                        font->recs[index].width + 2.0f*padding, font->recs[index].height + 2.0f*padding };
+                    glyph->dest = (Rectangle){ textOffsetX + (font->glyphs[index].offsetX - padding)*scaleFactor,
+                        textOffsetY + (font->glyphs[index].offsetY - padding)*scaleFactor,
+                        glyph->source.width*scaleFactor, glyph->source.height*scaleFactor };
                 }
             }
 
@@ -128,6 +142,67 @@ static void DrawTextBoxed(Font *font, CRLayer *layer, const char *text, Rectangl
         if ((textOffsetX != 0) || (codepoint != ' '))
             textOffsetX += glyphWidth;  // avoid leading spaces
     }
+    return count;
+}
+
+static void DrawGlyphPlacements(Font *font, CRGlyphPlacement *glyphs, size_t count, Vector2 position, Color tint) {
+    // every glyph comes from the same texture, so this is a single batch
+    for (size_t i = 0; i < count; i++) {
+        Rectangle dest = glyphs[i].dest;
+        dest.x += position.x;
+        dest.y += position.y;
+        DrawTexturePro(font->texture, glyphs[i].source, dest, (Vector2){ 0, 0 }, 0.0f, tint);
+    }
+}
+
+static void DrawTextBoxed(Font *font, CRLayer *layer, const char *text, Rectangle rec, float fontSize, float spacing, int wordWrap, Color tint) {
+    CRGlyphPlacement *glyphs = CRFrameAlloc(sizeof(CRGlyphPlacement) * (TextLength(text) + 1));
+    size_t count = LayoutTextBoxed(font, text, rec, fontSize, spacing, wordWrap, glyphs);
+    DrawGlyphPlacements(font, glyphs, count, (Vector2){ rec.x, rec.y }, tint);
+}
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size) {
+    // FNV-1a
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int CountTrailingZeros(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int count = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+// Append to and read from a flat byte buffer, moving the cursor past what was written or read
+void WriteBytes(unsigned char **cursor, const void *data, size_t size) {
+    memcpy(*cursor, data, size);
+    *cursor += size;
+}
+void ReadBytes(const unsigned char **cursor, void *data, size_t size) {
+    memcpy(data, *cursor, size);
+    *cursor += size;
+}
+
+// ReadBytes for data that can't be trusted, like recordings and streams. Fails rather than reading
+// past end, and keeps failing once it has.
+int ReadBytesChecked(const unsigned char **cursor, const unsigned char *end, void *data, size_t size) {
+    if (*cursor == 0 || (size_t) (end - *cursor) < size) {
+        *cursor = 0;
+        return 0;
+    }
+    ReadBytes(cursor, data, size);
+    return 1;
 }
 
 int cmpstr(char *s1, char *s2, size_t size) {
@@ -161,28 +236,52 @@ Rectangle TileIndexRec(CRTilemap *tilemap, int index) {
     return rect;
 }
 
+void UnlinkEntity(CREntityList *list, CREntity *entity) {
+    if (entity->prev != 0)
+        entity->prev->next = entity->next;
+    else
+        list->head = entity->next;
+    if (entity->next != 0)
+        entity->next->prev = entity->prev;
+    else
+        list->tail = entity->prev;
+    entity->next = 0;
+    entity->prev = 0;
+}
 int OnLayer(CRLayer *layer, Vector2 position) {
     position.x += layer->position.x;
     position.y += layer->position.y;
 
-    if (position.x < 0 || position.x > layer->width || 
-            position.y < 0 || position.y > layer->height) {
+    if (position.x < 0 || position.x >= layer->width || 
+            position.y < 0 || position.y >= layer->height) {
         return 0;
     }
     return 1;
 }
 
+// Where a row of the layer is stored in its grid, since the rows are a ring starting at scroll_row
+int LayerRow(CRLayer *layer, int row) {
+    row += layer->scroll_row;
+    return row >= layer->height ? row - layer->height : row;
+}
+
 int OnMask(CRMask *mask, Vector2 position) {
     position.x += mask->position.x;
     position.y += mask->position.y;
 
-    if (position.x < 0 || position.x > mask->width || 
-            position.y < 0 || position.y > mask->height) {
+    if (position.x < 0 || position.x >= mask->width || 
+            position.y < 0 || position.y >= mask->height) {
         return 0;
     }
     return 1;
 }
 
+// Field by field, a CRTile's padding bytes are indeterminate so the whole struct can't be memcmp'd
+int SameTile(CRTile *a, CRTile *b) {
+    return a->index.i == b->index.i && memcmp(&a->shift, &b->shift, sizeof(Vector2)) == 0 &&
+        memcmp(&a->foreground, &b->foreground, sizeof(Color)) == 0 &&
+        memcmp(&a->background, &b->background, sizeof(Color)) == 0 && a->visibility == b->visibility;
+}
 int CheckMaskFlags(uint8_t flags1, uint8_t flags2) {
     int match = 0;
     if ((flags1 & 0b0) == (flags2 & 0b0))
@@ -200,15 +299,15 @@ Vector2 ShiftPosition(Vector2 position, Vector2 shift) {
     return position;
 }
 
-Vector2 CenterText(Vector2 position, float tile_size, char *string_out) {
+Vector2 CenterText(Vector2 position, float tile_size, float font_size, char *string_out) {
     Vector2 size;
-    size.x = MeasureText(string_out, 24);
+    size.x = MeasureText(string_out, font_size);
     position.x += tile_size/2.0f - size.x/2.0f;
     return position;
 }
 
-Vector2 CenterTextEx(Vector2 position, Font font, float tile_size, char *string_out) {
-    Vector2 size = MeasureTextEx(font, string_out, 24, 0);
+Vector2 CenterTextEx(Vector2 position, Font font, float tile_size, float font_size, char *string_out) {
+    Vector2 size = MeasureTextEx(font, string_out, font_size, 0);
     position.x += tile_size/2.0f - size.x/2.0f;
     position.y += tile_size/2.0f - size.y/2.0f;
     return position;
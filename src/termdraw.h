@@ -18,4 +18,63 @@
 // Only include this file if terminal rendering is switched on
 #ifndef TERMDRAW_HEADER
 #define TERMDRAW_HEADER
+
+#include "crga.h"
+#include <stdio.h>
+#include <string.h>
+
+// Most bytes a single cell can take to encode: a cursor move, both colors and a 4 byte character
+#define TERMCELLBYTES 64
+// Clearing the screen and hiding the cursor before a full frame
+#define TERMFRAMEBYTES 32
+
+// only the terminal server encodes frames
+#if SERVER
+static int TermSameColor(Color a, Color b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+// Write the ANSI escape codes that turn what a terminal shows (shown) into cells, and bring shown up
+// to date. Only cells that changed are written, and cursor moves and colors are only sent when they
+// differ from what the last cell left behind. full redraws everything, for a terminal that's just
+// connected. out needs room for TERMFRAMEBYTES + TERMCELLBYTES per cell. Returns the bytes written.
+static size_t TermEncodeDiff(CRCell *shown, CRCell *cells, int width, int height, int full, char *out) {
+    char *cursor = out;
+    if (full)
+        cursor += sprintf(cursor, "\x1b[0m\x1b[?25l\x1b[2J");
+    int cursor_x = -1;
+    int cursor_y = -1;
+    int colored = 0;
+    Color foreground = {0};
+    Color background = {0};
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            CRCell *cell = &cells[x + y * width];
+            CRCell *old = &shown[x + y * width];
+            if (!full && memcmp(cell, old, sizeof(CRCell)) == 0)
+                continue;
+            if (x != cursor_x || y != cursor_y)
+                cursor += sprintf(cursor, "\x1b[%d;%dH", y + 1, x + 1);
+            if (!colored || !TermSameColor(foreground, cell->foreground) || !TermSameColor(background, cell->background)) {
+                foreground = cell->foreground;
+                background = cell->background;
+                cursor += sprintf(cursor, "\x1b[38;2;%d;%d;%d;48;2;%d;%d;%dm", foreground.r, foreground.g, foreground.b,
+                        background.r, background.g, background.b);
+                colored = 1;
+            }
+            // control characters would move the cursor, so they're drawn as blanks
+            int length = 0;
+            while (length < 4 && (unsigned char) cell->index.c[length] >= ' ')
+                *cursor++ = cell->index.c[length++];
+            if (length == 0)
+                *cursor++ = ' ';
+            cursor_x = x + 1;
+            cursor_y = y;
+            *old = *cell;
+        }
+    }
+    return cursor - out;
+}
+#endif
+
 #endif
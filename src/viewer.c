@@ -0,0 +1,55 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  viewer.c
+ *
+ *    Description: Watches a game published with CRStartStream, drawing it with the
+ *                 usual layer drawing.
+ *
+ *        Version:  1.0
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+#include "crga.h"
+#include <stdio.h>
+
+CRViewer *viewer;
+
+void Usage(const char *name) {
+    printf("usage: %s ADDRESS [BUNDLE.crb]\n", name);
+    printf("  ADDRESS is a Unix socket path, or a TCP [host:]port\n");
+    printf("  BUNDLE.crb holds the fonts and tilemaps the game draws with\n");
+}
+
+void Update() {
+    // once the game ends its last frame stays up
+    if (!viewer->closed)
+        CRUpdateViewer(viewer);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        Usage(argv[0]);
+        return 1;
+    }
+    CRInit();
+    if (argc > 2 && !CRLoadBundle(argv[2])) {
+        printf("couldn't load %s\n", argv[2]);
+        CRClose();
+        return 1;
+    }
+    viewer = CRConnectStream(argv[1]);
+    if (viewer == 0) {
+        printf("couldn't connect to %s\n", argv[1]);
+        CRClose();
+        return 1;
+    }
+    // frames only change when the stream sends one
+    CRSetRenderOnDemand(1);
+    CRSetPreDraw(Update);
+    CRLoop();
+    CRCloseViewer(viewer);
+    CRClose();
+    return 0;
+}